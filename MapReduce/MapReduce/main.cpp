@@ -9,73 +9,1079 @@
 //  In this program we implement a MapReduce model to perform word counting so that we can
 //  learn more about the MapReduce model.
 //
-//  Our program uses threads and mutexes to allow for parallel processing.  We first create a
+//  Our program uses threads to allow for parallel processing.  We first create a
 //  map function that tokenizes the input string and then transforms the provided input string to
 //  lower case with all of the punctuation marks removed.  This function stores the transformed
 //  data into a vector of pairs that houses word occurences.  Our next function is the reduce function
 //  which will sum the values that are contained in a provided vector.  We implement a map_worker function
-//  that applies the map function to the provided input string and utilizes a mutex to help safeguard
-//  updates to a intermediate step map.  The program utilizes threads to perform these executions
-//  in parallel on different strings - once the threads have finished with their executions we then
-//  apply the reduce phase of the model and display the word count results.
+//  that applies the map function to the provided input string and shuffles the results into hash
+//  partitions - every thread owns its own set of partitions so no mutex is needed.  The program utilizes
+//  threads to perform these executions in parallel on different strings - once the threads have finished
+//  with their executions we then apply the reduce phase of the model with one reducer thread per
+//  partition and display the word count results.
+//
+//  The same job can also run distributed over several processes: a coordinator serves the splits
+//  of the input to worker processes over TCP and reduces what they send back, or has the workers
+//  send their output to the workers that reduce it (see Distributed execution below).
 //
 //
 
 // Include libraries used for our MapReduce program
 #include <iostream>
-#include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
-#include <map>
 #include <algorithm>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <exception>
 #include <numeric>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <iterator>
+#include <functional>
+#include <utility>
+#include <limits>
+#include <type_traits>
+#include <cstdint>
+#include <stdexcept>
+#include <memory>
+#include <optional>
+#include <new>
+#include <memory_resource>
+#include <charconv>
+#include <cmath>
+#include <random>
+
+// Optional block compression, see Blocks
+#if defined(MAPREDUCE_WITH_LZ4)
+#include <lz4.h>
+#endif
+#if defined(MAPREDUCE_WITH_ZSTD)
+#include <zstd.h>
+#endif
+
+// Memory mapped input files
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <dirent.h>
+#define MAPREDUCE_HAVE_MMAP 1
+// Sockets of distributed jobs
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#define MAPREDUCE_HAVE_SOCKETS 1
+#else
+#include <fstream>
+#include <sstream>
+#endif
+
+// Thread pinning and the NUMA nodes of memory, see NUMA placement
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#define MAPREDUCE_HAVE_NUMA 1
+#endif
+
+// Asynchronous reads of the input files, see AsyncFileReader.  MAPREDUCE_NO_IO_URING builds
+// the pread fallback only.
+#if defined(__linux__) && defined(SYS_io_uring_setup) && !defined(MAPREDUCE_NO_IO_URING) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define MAPREDUCE_HAVE_IO_URING 1
+#endif
+
+// SIMD instruction sets used by the tokenizer
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define MAPREDUCE_SIMD_X86 1
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MAPREDUCE_SIMD_NEON 1
+#endif
+
+// **************************************************************************************
+//
+// Metrics
+// Description: A build with MAPREDUCE_METRICS defined measures where the time of a job goes.
+//              Spans time a phase or a task: the wall clock time and the CPU time of the
+//              thread, summed up per span name.  Counters add up records, bytes, spill runs
+//              and the nanoseconds that threads spent waiting for a lock, a queue or the end
+//              of a phase.  With --metrics the totals and the peak memory of the process are
+//              written as a JSON report, with --trace every span is written as a Chrome trace
+//              event (chrome://tracing or https://ui.perfetto.dev).
+//
+//              Without MAPREDUCE_METRICS the macros below expand to nothing - or to just
+//              the statement for MAPREDUCE_WAIT - so the instrumentation costs nothing.
+//
+//                MAPREDUCE_SPAN(name)               time the rest of the scope
+//                MAPREDUCE_COUNT(metric, amount)    add to a counter
+//                MAPREDUCE_WAIT(metric, statement)  run the statement, count its time
+//                MAPREDUCE_METRICS_ONLY(code)       code that only exists for the metrics
+//
+// **************************************************************************************
+
+#if defined(MAPREDUCE_METRICS)
+
+enum class Metric : size_t {
+    InputBytes,
+    MapTasks,
+    Records,
+    SpillRuns,
+    SpillBytes,
+    LockWaitNs,
+    QueueWaitNs,
+    BarrierWaitNs,
+    OutputBytes,
+    Count,
+};
+
+class Metrics {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static Metrics &instance() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    void add(Metric metric, uint64_t amount) {
+        counters_[static_cast<size_t>(metric)].fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    void enable_trace() {
+        tracing_ = true;
+    }
+
+    void record_span(const char *name, Clock::time_point start, Clock::time_point end, uint64_t cpu_ns) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Totals &totals = totals_[name];
+        ++totals.count;
+        totals.wall_ns += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        totals.cpu_ns += cpu_ns;
+        if (tracing_) {
+            events_.push_back(TraceEvent{name, thread_number(), start, end});
+        }
+    }
+
+    // CPU time of the calling thread
+    static uint64_t thread_cpu_ns() {
+#if defined(MAPREDUCE_HAVE_MMAP)
+        timespec time;
+        ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+        return static_cast<uint64_t>(time.tv_sec) * 1000000000u + static_cast<uint64_t>(time.tv_nsec);
+#else
+        return 0;
+#endif
+    }
+
+    template <typename Out>
+    void write_report(Out &out) {
+        static const char *const names[] = {"input_bytes", "map_tasks", "records", "spill_runs", "spill_bytes",
+                                            "lock_wait_ns", "queue_wait_ns", "barrier_wait_ns", "output_bytes"};
+        std::lock_guard<std::mutex> lock(mutex_);
+        out << "{\n  \"spans\": {";
+        const char *separator = "\n";
+        for (const auto& span : totals_) {
+            out << separator << "    \"" << span.first << "\": {\"count\": " << span.second.count
+                << ", \"wall_ns\": " << span.second.wall_ns << ", \"cpu_ns\": " << span.second.cpu_ns << "}";
+            separator = ",\n";
+        }
+        out << "\n  },\n  \"counters\": {";
+        separator = "\n";
+        for (size_t i = 0; i < static_cast<size_t>(Metric::Count); ++i) {
+            out << separator << "    \"" << names[i] << "\": " << counters_[i].load(std::memory_order_relaxed);
+            separator = ",\n";
+        }
+        out << "\n  },\n  \"peak_rss_bytes\": " << peak_rss_bytes() << "\n}\n";
+    }
+
+    template <typename Out>
+    void write_trace(Out &out) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        out << "{\"traceEvents\": [";
+        const char *separator = "\n";
+        for (const TraceEvent &event : events_) {
+            out << separator << "{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread
+                << ", \"ts\": " << microseconds(event.start) << ", \"dur\": " << microseconds(event.end) - microseconds(event.start) << "}";
+            separator = ",\n";
+        }
+        out << "\n]}\n";
+    }
+
+private:
+    struct Totals {
+        uint64_t count = 0;
+        uint64_t wall_ns = 0;
+        uint64_t cpu_ns = 0;
+    };
+
+    struct TraceEvent {
+        const char *name;
+        uint64_t thread;
+        Clock::time_point start;
+        Clock::time_point end;
+    };
+
+    // Small sequential thread numbers read better in a trace than thread ids
+    static uint64_t thread_number() {
+        static std::atomic<uint64_t> next{1};
+        thread_local const uint64_t number = next.fetch_add(1, std::memory_order_relaxed);
+        return number;
+    }
+
+    uint64_t microseconds(Clock::time_point time) const {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(time - epoch_).count());
+    }
+
+    static uint64_t peak_rss_bytes() {
+#if defined(MAPREDUCE_HAVE_MMAP)
+        rusage usage;
+        ::getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+        return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+        return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+#else
+        return 0;
+#endif
+    }
+
+    std::atomic<uint64_t> counters_[static_cast<size_t>(Metric::Count)] = {};
+    std::mutex mutex_;
+    std::map<std::string, Totals> totals_;
+    std::vector<TraceEvent> events_;
+    bool tracing_ = false;
+    const Clock::time_point epoch_ = Clock::now();
+};
+
+// Records the time from its construction to its destruction as a span
+class ScopedSpan {
+public:
+    explicit ScopedSpan(const char *name) : name_(name), start_(Metrics::Clock::now()), cpu_start_(Metrics::thread_cpu_ns()) {}
+
+    ~ScopedSpan() {
+        Metrics::instance().record_span(name_, start_, Metrics::Clock::now(), Metrics::thread_cpu_ns() - cpu_start_);
+    }
+
+    ScopedSpan(const ScopedSpan &) = delete;
+    ScopedSpan &operator=(const ScopedSpan &) = delete;
+
+private:
+    const char *name_;
+    Metrics::Clock::time_point start_;
+    uint64_t cpu_start_;
+};
+
+#define MAPREDUCE_CONCAT_(a, b) a##b
+#define MAPREDUCE_CONCAT(a, b) MAPREDUCE_CONCAT_(a, b)
+#define MAPREDUCE_SPAN(name) ScopedSpan MAPREDUCE_CONCAT(mapreduce_span_, __LINE__)(name)
+#define MAPREDUCE_COUNT(metric, amount) Metrics::instance().add(Metric::metric, static_cast<uint64_t>(amount))
+#define MAPREDUCE_WAIT(metric, statement)                                                                        \
+    do {                                                                                                         \
+        const auto mapreduce_wait_start = Metrics::Clock::now();                                                 \
+        statement;                                                                                               \
+        MAPREDUCE_COUNT(metric, std::chrono::duration_cast<std::chrono::nanoseconds>(Metrics::Clock::now() -     \
+                                                                                     mapreduce_wait_start).count()); \
+    } while (0)
+#define MAPREDUCE_METRICS_ONLY(...) __VA_ARGS__
+
+#else
+
+#define MAPREDUCE_SPAN(name) static_cast<void>(0)
+#define MAPREDUCE_COUNT(metric, amount) static_cast<void>(0)
+#define MAPREDUCE_WAIT(metric, statement) \
+    do {                                  \
+        statement;                        \
+    } while (0)
+#define MAPREDUCE_METRICS_ONLY(...)
+
+#endif
+
+// Lock the mutex and count the time spent waiting for it
+inline std::unique_lock<std::mutex> lock_counted(std::mutex &mutex) {
+    std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        MAPREDUCE_WAIT(LockWaitNs, lock.lock());
+    }
+    return lock;
+}
+
+// **************************************************************************************
+//
+// Character classes
+// Description: The tokenizer classifies the bytes of the input itself instead of going
+//              through the locale aware functions of <cctype>.  The classes match the
+//              "C" locale that the program runs in: whitespace separates words, punctuation
+//              marks are removed from words and upper case letters are lowered.  Bytes
+//              outside of ASCII are decoded as UTF-8, see below.
+//
+// **************************************************************************************
+
+constexpr bool is_space_byte(unsigned char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+constexpr bool is_punct_byte(unsigned char c) {
+    return (c >= '!' && c <= '/') || (c >= ':' && c <= '@') || (c >= '[' && c <= '`') || (c >= '{' && c <= '~');
+}
+
+constexpr bool is_upper_byte(unsigned char c) {
+    return c >= 'A' && c <= 'Z';
+}
+
+constexpr char to_lower_byte(unsigned char c) {
+    return static_cast<char>(is_upper_byte(c) ? c + ('a' - 'A') : c);
+}
+
+// **************************************************************************************
+//
+// UTF-8
+// Description: Text outside of ASCII is decoded as UTF-8.  The tokenizer kernels count every
+//              byte outside of ASCII as dirty, so a word that is pure ASCII - nearly every word
+//              of most corpora - never leaves the fast path, and only the words with other
+//              bytes are decoded.  Their code points are classified here: Unicode whitespace
+//              separates words, Unicode punctuation follows the punctuation policy and the
+//              letters are folded with the simple case folding of Unicode (the one-to-one
+//              mappings of CaseFolding.txt, see case_fold_runs).  Bytes that are not valid
+//              UTF-8 are kept as they are.
+//
+// **************************************************************************************
+
+// Sentinel of decode_utf8 for a byte that does not start a valid sequence
+constexpr char32_t invalid_code_point = 0xffffffff;
+
+// Decode the code point at position and advance past it.  An invalid sequence - truncated,
+// overlong, a surrogate or beyond U+10FFFF - yields invalid_code_point and advances one byte.
+inline char32_t decode_utf8(const char *&position, const char *end) {
+    const unsigned char lead = static_cast<unsigned char>(*position);
+    size_t length;
+    char32_t code_point;
+    if (lead < 0x80) {
+        ++position;
+        return lead;
+    } else if (lead >= 0xc2 && lead <= 0xdf) {
+        length = 2;
+        code_point = lead & 0x1f;
+    } else if (lead >= 0xe0 && lead <= 0xef) {
+        length = 3;
+        code_point = lead & 0x0f;
+    } else if (lead >= 0xf0 && lead <= 0xf4) {
+        length = 4;
+        code_point = lead & 0x07;
+    } else {
+        ++position;
+        return invalid_code_point;
+    }
+    if (static_cast<size_t>(end - position) < length) {
+        ++position;
+        return invalid_code_point;
+    }
+    for (size_t i = 1; i < length; ++i) {
+        const unsigned char next = static_cast<unsigned char>(position[i]);
+        if ((next & 0xc0) != 0x80) {
+            ++position;
+            return invalid_code_point;
+        }
+        code_point = (code_point << 6) | (next & 0x3f);
+    }
+    constexpr char32_t smallest[] = {0, 0, 0x80, 0x800, 0x10000};
+    if (code_point < smallest[length] || (code_point >= 0xd800 && code_point <= 0xdfff) || code_point > 0x10ffff) {
+        ++position;
+        return invalid_code_point;
+    }
+    position += length;
+    return code_point;
+}
+
+inline void append_utf8(std::string &out, char32_t code_point) {
+    if (code_point < 0x80) {
+        out.push_back(static_cast<char>(code_point));
+    } else if (code_point < 0x800) {
+        out.push_back(static_cast<char>(0xc0 | (code_point >> 6)));
+        out.push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+    } else if (code_point < 0x10000) {
+        out.push_back(static_cast<char>(0xe0 | (code_point >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+    } else {
+        out.push_back(static_cast<char>(0xf0 | (code_point >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((code_point >> 12) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+    }
+}
+
+constexpr bool is_unicode_space(char32_t c) {
+    return c == 0x85 || c == 0xa0 || c == 0x1680 || (c >= 0x2000 && c <= 0x200a) || c == 0x2028 || c == 0x2029
+        || c == 0x202f || c == 0x205f || c == 0x3000;
+}
+
+// The punctuation of Latin-1, the General Punctuation block - except for its spaces and
+// format characters - and the common CJK and fullwidth marks
+constexpr bool is_unicode_punct(char32_t c) {
+    return c == 0xa1 || c == 0xa7 || c == 0xab || c == 0xb6 || c == 0xb7 || c == 0xbb || c == 0xbf
+        || (c >= 0x2010 && c <= 0x2027) || (c >= 0x2030 && c <= 0x205e)
+        || (c >= 0x3001 && c <= 0x3003) || (c >= 0x3008 && c <= 0x3011)
+        || (c >= 0xff01 && c <= 0xff0f) || (c >= 0xff1a && c <= 0xff20) || (c >= 0xff3b && c <= 0xff40)
+        || (c >= 0xff5b && c <= 0xff65);
+}
+
+// A run of the simple case folding: the code points from first to last - every one, or every
+// other one for the alternating upper and lower case letters of a stride of 2 - fold to the
+// code point delta away
+struct CaseFoldRun {
+    char32_t first;
+    char32_t last;
+    int32_t delta;
+    uint8_t stride;
+};
+
+// The mappings with status C and S of CaseFolding.txt of Unicode 14.0 outside of ASCII, as
+// sorted runs that do not overlap
+constexpr CaseFoldRun case_fold_runs[] = {
+    {0xb5, 0xb5, 775, 1}, {0xc0, 0xd6, 32, 1}, {0xd8, 0xde, 32, 1}, {0x100, 0x12e, 1, 2}, {0x132, 0x136, 1, 2},
+    {0x139, 0x147, 1, 2}, {0x14a, 0x176, 1, 2}, {0x178, 0x178, -121, 1}, {0x179, 0x17d, 1, 2},
+    {0x17f, 0x17f, -268, 1}, {0x181, 0x181, 210, 1}, {0x182, 0x184, 1, 2}, {0x186, 0x186, 206, 1},
+    {0x187, 0x187, 1, 1}, {0x189, 0x18a, 205, 1}, {0x18b, 0x18b, 1, 1}, {0x18e, 0x18e, 79, 1},
+    {0x18f, 0x18f, 202, 1}, {0x190, 0x190, 203, 1}, {0x191, 0x191, 1, 1}, {0x193, 0x193, 205, 1},
+    {0x194, 0x194, 207, 1}, {0x196, 0x196, 211, 1}, {0x197, 0x197, 209, 1}, {0x198, 0x198, 1, 1},
+    {0x19c, 0x19c, 211, 1}, {0x19d, 0x19d, 213, 1}, {0x19f, 0x19f, 214, 1}, {0x1a0, 0x1a4, 1, 2},
+    {0x1a6, 0x1a6, 218, 1}, {0x1a7, 0x1a7, 1, 1}, {0x1a9, 0x1a9, 218, 1}, {0x1ac, 0x1ac, 1, 1},
+    {0x1ae, 0x1ae, 218, 1}, {0x1af, 0x1af, 1, 1}, {0x1b1, 0x1b2, 217, 1}, {0x1b3, 0x1b5, 1, 2},
+    {0x1b7, 0x1b7, 219, 1}, {0x1b8, 0x1b8, 1, 1}, {0x1bc, 0x1bc, 1, 1}, {0x1c4, 0x1c4, 2, 1}, {0x1c5, 0x1c5, 1, 1},
+    {0x1c7, 0x1c7, 2, 1}, {0x1c8, 0x1c8, 1, 1}, {0x1ca, 0x1ca, 2, 1}, {0x1cb, 0x1db, 1, 2}, {0x1de, 0x1ee, 1, 2},
+    {0x1f1, 0x1f1, 2, 1}, {0x1f2, 0x1f4, 1, 2}, {0x1f6, 0x1f6, -97, 1}, {0x1f7, 0x1f7, -56, 1}, {0x1f8, 0x21e, 1, 2},
+    {0x220, 0x220, -130, 1}, {0x222, 0x232, 1, 2}, {0x23a, 0x23a, 10795, 1}, {0x23b, 0x23b, 1, 1},
+    {0x23d, 0x23d, -163, 1}, {0x23e, 0x23e, 10792, 1}, {0x241, 0x241, 1, 1}, {0x243, 0x243, -195, 1},
+    {0x244, 0x244, 69, 1}, {0x245, 0x245, 71, 1}, {0x246, 0x24e, 1, 2}, {0x345, 0x345, 116, 1}, {0x370, 0x372, 1, 2},
+    {0x376, 0x376, 1, 1}, {0x37f, 0x37f, 116, 1}, {0x386, 0x386, 38, 1}, {0x388, 0x38a, 37, 1},
+    {0x38c, 0x38c, 64, 1}, {0x38e, 0x38f, 63, 1}, {0x391, 0x3a1, 32, 1}, {0x3a3, 0x3ab, 32, 1}, {0x3c2, 0x3c2, 1, 1},
+    {0x3cf, 0x3cf, 8, 1}, {0x3d0, 0x3d0, -30, 1}, {0x3d1, 0x3d1, -25, 1}, {0x3d5, 0x3d5, -15, 1},
+    {0x3d6, 0x3d6, -22, 1}, {0x3d8, 0x3ee, 1, 2}, {0x3f0, 0x3f0, -54, 1}, {0x3f1, 0x3f1, -48, 1},
+    {0x3f4, 0x3f4, -60, 1}, {0x3f5, 0x3f5, -64, 1}, {0x3f7, 0x3f7, 1, 1}, {0x3f9, 0x3f9, -7, 1},
+    {0x3fa, 0x3fa, 1, 1}, {0x3fd, 0x3ff, -130, 1}, {0x400, 0x40f, 80, 1}, {0x410, 0x42f, 32, 1},
+    {0x460, 0x480, 1, 2}, {0x48a, 0x4be, 1, 2}, {0x4c0, 0x4c0, 15, 1}, {0x4c1, 0x4cd, 1, 2}, {0x4d0, 0x52e, 1, 2},
+    {0x531, 0x556, 48, 1}, {0x10a0, 0x10c5, 7264, 1}, {0x10c7, 0x10c7, 7264, 1}, {0x10cd, 0x10cd, 7264, 1},
+    {0x13f8, 0x13fd, -8, 1}, {0x1c80, 0x1c80, -6222, 1}, {0x1c81, 0x1c81, -6221, 1}, {0x1c82, 0x1c82, -6212, 1},
+    {0x1c83, 0x1c84, -6210, 1}, {0x1c85, 0x1c85, -6211, 1}, {0x1c86, 0x1c86, -6204, 1}, {0x1c87, 0x1c87, -6180, 1},
+    {0x1c88, 0x1c88, 35267, 1}, {0x1c90, 0x1cba, -3008, 1}, {0x1cbd, 0x1cbf, -3008, 1}, {0x1e00, 0x1e94, 1, 2},
+    {0x1e9b, 0x1e9b, -58, 1}, {0x1e9e, 0x1e9e, -7615, 1}, {0x1ea0, 0x1efe, 1, 2}, {0x1f08, 0x1f0f, -8, 1},
+    {0x1f18, 0x1f1d, -8, 1}, {0x1f28, 0x1f2f, -8, 1}, {0x1f38, 0x1f3f, -8, 1}, {0x1f48, 0x1f4d, -8, 1},
+    {0x1f59, 0x1f5f, -8, 2}, {0x1f68, 0x1f6f, -8, 1}, {0x1f88, 0x1f8f, -8, 1}, {0x1f98, 0x1f9f, -8, 1},
+    {0x1fa8, 0x1faf, -8, 1}, {0x1fb8, 0x1fb9, -8, 1}, {0x1fba, 0x1fbb, -74, 1}, {0x1fbc, 0x1fbc, -9, 1},
+    {0x1fbe, 0x1fbe, -7173, 1}, {0x1fc8, 0x1fcb, -86, 1}, {0x1fcc, 0x1fcc, -9, 1}, {0x1fd8, 0x1fd9, -8, 1},
+    {0x1fda, 0x1fdb, -100, 1}, {0x1fe8, 0x1fe9, -8, 1}, {0x1fea, 0x1feb, -112, 1}, {0x1fec, 0x1fec, -7, 1},
+    {0x1ff8, 0x1ff9, -128, 1}, {0x1ffa, 0x1ffb, -126, 1}, {0x1ffc, 0x1ffc, -9, 1}, {0x2126, 0x2126, -7517, 1},
+    {0x212a, 0x212a, -8383, 1}, {0x212b, 0x212b, -8262, 1}, {0x2132, 0x2132, 28, 1}, {0x2160, 0x216f, 16, 1},
+    {0x2183, 0x2183, 1, 1}, {0x24b6, 0x24cf, 26, 1}, {0x2c00, 0x2c2f, 48, 1}, {0x2c60, 0x2c60, 1, 1},
+    {0x2c62, 0x2c62, -10743, 1}, {0x2c63, 0x2c63, -3814, 1}, {0x2c64, 0x2c64, -10727, 1}, {0x2c67, 0x2c6b, 1, 2},
+    {0x2c6d, 0x2c6d, -10780, 1}, {0x2c6e, 0x2c6e, -10749, 1}, {0x2c6f, 0x2c6f, -10783, 1},
+    {0x2c70, 0x2c70, -10782, 1}, {0x2c72, 0x2c72, 1, 1}, {0x2c75, 0x2c75, 1, 1}, {0x2c7e, 0x2c7f, -10815, 1},
+    {0x2c80, 0x2ce2, 1, 2}, {0x2ceb, 0x2ced, 1, 2}, {0x2cf2, 0x2cf2, 1, 1}, {0xa640, 0xa66c, 1, 2},
+    {0xa680, 0xa69a, 1, 2}, {0xa722, 0xa72e, 1, 2}, {0xa732, 0xa76e, 1, 2}, {0xa779, 0xa77b, 1, 2},
+    {0xa77d, 0xa77d, -35332, 1}, {0xa77e, 0xa786, 1, 2}, {0xa78b, 0xa78b, 1, 1}, {0xa78d, 0xa78d, -42280, 1},
+    {0xa790, 0xa792, 1, 2}, {0xa796, 0xa7a8, 1, 2}, {0xa7aa, 0xa7aa, -42308, 1}, {0xa7ab, 0xa7ab, -42319, 1},
+    {0xa7ac, 0xa7ac, -42315, 1}, {0xa7ad, 0xa7ad, -42305, 1}, {0xa7ae, 0xa7ae, -42308, 1},
+    {0xa7b0, 0xa7b0, -42258, 1}, {0xa7b1, 0xa7b1, -42282, 1}, {0xa7b2, 0xa7b2, -42261, 1}, {0xa7b3, 0xa7b3, 928, 1},
+    {0xa7b4, 0xa7c2, 1, 2}, {0xa7c4, 0xa7c4, -48, 1}, {0xa7c5, 0xa7c5, -42307, 1}, {0xa7c6, 0xa7c6, -35384, 1},
+    {0xa7c7, 0xa7c9, 1, 2}, {0xa7d0, 0xa7d0, 1, 1}, {0xa7d6, 0xa7d8, 1, 2}, {0xa7f5, 0xa7f5, 1, 1},
+    {0xab70, 0xabbf, -38864, 1}, {0xff21, 0xff3a, 32, 1}, {0x10400, 0x10427, 40, 1}, {0x104b0, 0x104d3, 40, 1},
+    {0x10570, 0x1057a, 39, 1}, {0x1057c, 0x1058a, 39, 1}, {0x1058c, 0x10592, 39, 1}, {0x10594, 0x10595, 39, 1},
+    {0x10c80, 0x10cb2, 64, 1}, {0x118a0, 0x118bf, 32, 1}, {0x16e40, 0x16e5f, 32, 1}, {0x1e900, 0x1e921, 34, 1},
+};
+
+// The simple case folding of a code point, see UTF-8
+constexpr char32_t fold_case(char32_t c) {
+    if (c < 0x80) {
+        return static_cast<unsigned char>(to_lower_byte(static_cast<unsigned char>(c)));
+    }
+    // The last run that starts at or before c
+    size_t low = 0;
+    size_t high = std::size(case_fold_runs);
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        if (case_fold_runs[middle].first <= c) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low == 0) {
+        return c;
+    }
+    const CaseFoldRun &run = case_fold_runs[low - 1];
+    if (c > run.last || (c - run.first) % run.stride != 0) {
+        return c;
+    }
+    return static_cast<char32_t>(static_cast<int32_t>(c) + run.delta);
+}
+
+// **************************************************************************************
+//
+// Normalization policies
+// Description: How a word is normalized is assembled at compile time from policy types:
+//
+//                Normalization<Case, Punctuation, Filters...>
+//
+//              The case policy (FoldCase, KeepCase) and the punctuation policy
+//              (StripPunctuation, KeepPunctuation, SplitOnPunctuation) are folded into one
+//              constexpr table of 256 entries that gives every byte its replacement and what
+//              to do with it, so normalizing a word is a single loop of table lookups without
+//              a branch per character class.  The filters (MinLength, EnglishStopwords,
+//              SStemmer) then look at the normalized word in order and may drop it or shorten
+//              it.  Every configuration is its own type, so the tokenizer is compiled once per
+//              configuration with no runtime switches left in its loop.
+//
+//              The tokenizers only hand the words that contain upper case letters or
+//              punctuation marks to the table, every other word is the same under all tables
+//              and goes straight to the filters as a view into the input.
+//
+// **************************************************************************************
+
+// What the normalization does with a byte of a word
+enum class ByteAction : uint8_t {
+    Keep,   // keep the replacement of the byte
+    Drop,   // remove the byte from the word
+    Split,  // end the word, the byte separates two words
+};
+
+struct FoldCase {
+    static constexpr char replace(unsigned char c) { return to_lower_byte(c); }
+    static constexpr char32_t replace(char32_t c) { return fold_case(c); }
+};
+
+struct KeepCase {
+    static constexpr char replace(unsigned char c) { return static_cast<char>(c); }
+    static constexpr char32_t replace(char32_t c) { return c; }
+};
+
+struct StripPunctuation {
+    static constexpr ByteAction action = ByteAction::Drop;
+};
+
+struct KeepPunctuation {
+    static constexpr ByteAction action = ByteAction::Keep;
+};
+
+struct SplitOnPunctuation {
+    static constexpr ByteAction action = ByteAction::Split;
+};
+
+// The replacement and the action of every byte under a case and a punctuation policy
+struct ByteTable {
+    char replacement[256];
+    ByteAction action[256];
+};
+
+template <typename Case, typename Punctuation>
+constexpr ByteTable make_byte_table() {
+    ByteTable table{};
+    for (unsigned c = 0; c < 256; ++c) {
+        table.replacement[c] = Case::replace(static_cast<unsigned char>(c));
+        table.action[c] = is_punct_byte(static_cast<unsigned char>(c)) ? Punctuation::action : ByteAction::Keep;
+    }
+    return table;
+}
+
+// Drop the words that are shorter than Length bytes
+template <size_t Length>
+struct MinLength {
+    static bool apply(std::string_view &word, std::string &) { return word.size() >= Length; }
+};
+
+// Drop the most common English function words.  The list is kept sorted for binary_search.
+struct EnglishStopwords {
+    static constexpr std::string_view words[] = {
+        "a", "an", "and", "are", "as", "at", "be", "but", "by", "for", "from", "had", "has", "have",
+        "he", "her", "his", "i", "in", "is", "it", "its", "not", "of", "on", "or", "she", "that",
+        "the", "their", "they", "this", "to", "was", "were", "which", "will", "with", "you",
+    };
+
+    static constexpr bool sorted() {
+        for (size_t i = 1; i < std::size(words); ++i) {
+            if (!(words[i - 1] < words[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool apply(std::string_view &word, std::string &) {
+        return !std::binary_search(std::begin(words), std::end(words), word);
+    }
+};
+
+static_assert(EnglishStopwords::sorted(), "The stopwords must be sorted");
+
+// Harman's S stemmer, which only conflates plurals: "-ies" becomes "-y" unless the word ends
+// in "-eies" or "-aies", "-es" becomes "-e" unless it ends in "-aes", "-ees" or "-oes", and a
+// final "s" is removed unless the word ends in "-us" or "-ss"
+struct SStemmer {
+    static bool apply(std::string_view &word, std::string &buffer) {
+        auto ends_with = [&word](std::string_view suffix) {
+            return word.size() >= suffix.size() && word.substr(word.size() - suffix.size()) == suffix;
+        };
+        if (ends_with("ies") && !ends_with("eies") && !ends_with("aies")) {
+            buffer.assign(word.data(), word.size() - 3);
+            buffer.push_back('y');
+            word = buffer;
+        } else if (ends_with("es") && !ends_with("aes") && !ends_with("ees") && !ends_with("oes")) {
+            word.remove_suffix(1);
+        } else if (ends_with("s") && !ends_with("us") && !ends_with("ss")) {
+            word.remove_suffix(1);
+        }
+        return true;
+    }
+};
+
+template <typename Case, typename Punctuation, typename... Filters>
+struct Normalization {
+    static constexpr ByteTable table = make_byte_table<Case, Punctuation>();
+
+    // Whether the table leaves every word as it is, so no ASCII word needs to be copied
+    static constexpr bool identity() {
+        for (unsigned c = 0; c < 256; ++c) {
+            if (table.replacement[c] != static_cast<char>(c) || table.action[c] != ByteAction::Keep) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // ******************************************************************************
+    //
+    // Function: emit_word
+    // Description: Emit the word between begin and end.  A clean word - one that is
+    //              already lower case and free of punctuation - is the same under every
+    //              table and is passed on as a view into the input.  Other words are
+    //              normalized into a reused per-thread buffer: every byte is written as its
+    //              replacement and the end of the word only advances over the kept bytes.
+    //              Words with bytes outside of ASCII are decoded instead, see UTF-8.
+    //              Empty words and the words that a filter drops are skipped.
+    //
+    // Parameters:
+    //   - begin, end: The bytes of the word in the input
+    //   - clean: Whether the word can be emitted without normalizing it
+    //   - emit: Callable that receives the word and its count
+    //
+    // ******************************************************************************
+
+    template <typename Emit>
+    static void emit_word(const char *begin, const char *end, bool clean, Emit &emit) {
+        if (clean) {
+            filter(std::string_view(begin, end - begin), emit);
+            return;
+        }
+
+        // Even a table that leaves every byte as it is must not skip the decoding, Unicode
+        // whitespace still separates words
+        for (const char *c = begin; c != end; ++c) {
+            if (static_cast<unsigned char>(*c) >= 0x80) {
+                emit_unicode_word(begin, end, emit);
+                return;
+            }
+        }
+        if constexpr (identity()) {
+            filter(std::string_view(begin, end - begin), emit);
+            return;
+        }
+
+        // Buffer for words that have to be normalized - it keeps its capacity between calls
+        thread_local std::string word;
+        word.resize(end - begin);
+        char *const out = &word[0];
+        size_t length = 0;
+        for (const char *c = begin; c != end; ++c) {
+            const unsigned char byte = static_cast<unsigned char>(*c);
+            if constexpr (Punctuation::action == ByteAction::Split) {
+                if (table.action[byte] == ByteAction::Split) {
+                    filter(std::string_view(out, length), emit);
+                    length = 0;
+                    continue;
+                }
+            }
+            out[length] = table.replacement[byte];
+            length += table.action[byte] == ByteAction::Keep;
+        }
+        filter(std::string_view(out, length), emit);
+    }
+
+private:
+    // Normalize a word one code point at a time
+    template <typename Emit>
+    static void emit_unicode_word(const char *begin, const char *end, Emit &emit) {
+        thread_local std::string word;
+        word.clear();
+        for (const char *position = begin; position != end;) {
+            const char *const start = position;
+            const char32_t code_point = decode_utf8(position, end);
+            ByteAction action = ByteAction::Keep;
+            if (code_point < 0x80) {
+                action = table.action[code_point];
+            } else if (code_point == invalid_code_point) {
+                word.push_back(*start);
+                continue;
+            } else if (is_unicode_space(code_point)) {
+                action = ByteAction::Split;
+            } else if (is_unicode_punct(code_point)) {
+                action = Punctuation::action;
+            }
+            if (action == ByteAction::Split) {
+                filter(std::string_view(word), emit);
+                word.clear();
+            } else if (action == ByteAction::Keep) {
+                if (code_point < 0x80) {
+                    word.push_back(table.replacement[code_point]);
+                } else {
+                    append_utf8(word, Case::replace(code_point));
+                }
+            }
+        }
+        filter(std::string_view(word), emit);
+    }
+
+    template <typename Emit>
+    static void filter(std::string_view word, Emit &emit) {
+        if (word.empty()) {
+            return;
+        }
+        if constexpr (sizeof...(Filters) != 0) {
+            thread_local std::string buffer;
+            if (!(Filters::apply(word, buffer) && ...)) {
+                return;
+            }
+        }
+        emit(word, 1);
+    }
+};
+
+// The normalization of the word count: lower case, punctuation marks removed
+using DefaultNormalization = Normalization<FoldCase, StripPunctuation>;
+// Words exactly as they are in the input, only whitespace separates them
+using ExactNormalization = Normalization<KeepCase, KeepPunctuation>;
+// Terms for a search index: punctuation separates words, short words and stopwords are
+// dropped and plurals are stemmed
+using SearchNormalization = Normalization<FoldCase, SplitOnPunctuation, MinLength<2>, EnglishStopwords, SStemmer>;
+
+// Call function with a value of the normalization called name, returns false for an unknown
+// name: "default", "exact" or "search"
+template <typename Function>
+bool with_normalization(std::string_view name, Function &&function) {
+    if (name == "default") {
+        function(DefaultNormalization());
+    } else if (name == "exact") {
+        function(ExactNormalization());
+    } else if (name == "search") {
+        function(SearchNormalization());
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// **************************************************************************************
+//
+// Function: tokenize_scalar
+// Description: Portable tokenizer that looks at one byte at a time.  It is used when the
+//              CPU has none of the SIMD instruction sets below.
+//
+// **************************************************************************************
+
+template <typename Normalizer, typename Emit>
+void tokenize_scalar(std::string_view input, Emit &emit) {
+    const char *position = input.data();
+    const char *const end = position + input.size();
+    while (position != end) {
+        // Skip the whitespace in front of the next word
+        while (position != end && is_space_byte(*position)) {
+            ++position;
+        }
+        if (position == end) {
+            break;
+        }
+
+        // Find the end of the word and check whether it has to be normalized
+        const char *const begin = position;
+        bool clean = true;
+        while (position != end && !is_space_byte(*position)) {
+            clean &= !is_punct_byte(*position) && !is_upper_byte(*position) && static_cast<unsigned char>(*position) < 0x80;
+            ++position;
+        }
+        Normalizer::emit_word(begin, position, clean, emit);
+    }
+}
+
+// **************************************************************************************
+//
+// SIMD classification kernels
+// Description: A kernel classifies a block of bytes at once and returns two bitmasks with
+//              one bit per byte: space has the bit set for whitespace bytes and dirty for the
+//              bytes that a word must be normalized for (upper case letters, punctuation and
+//              bytes outside of ASCII).  The same classes as the scalar functions above are
+//              used:
+//
+//                space = ' ' or '\t'..'\r'
+//                dirty = '!'..'~' except for the digits and the lower case letters, or >= 0x80
+//
+//              The comparisons are signed, so bytes outside of ASCII are never space.  They
+//              have their top bit set, which is what the movemask of the bytes collects.
+//
+// **************************************************************************************
+
+struct BlockMasks {
+    uint32_t space;
+    uint32_t dirty;
+};
+
+#if defined(MAPREDUCE_SIMD_X86)
+
+struct Sse2Kernel {
+    static constexpr size_t width = 16;
+
+    static BlockMasks classify(const char *block) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block));
+        const __m128i space = _mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(' ')),
+                                           _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('\t' - 1)),
+                                                         _mm_cmplt_epi8(bytes, _mm_set1_epi8('\r' + 1))));
+        const __m128i graphic = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(' ')),
+                                              _mm_cmplt_epi8(bytes, _mm_set1_epi8(0x7f)));
+        const __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('0' - 1)),
+                                            _mm_cmplt_epi8(bytes, _mm_set1_epi8('9' + 1)));
+        const __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('a' - 1)),
+                                            _mm_cmplt_epi8(bytes, _mm_set1_epi8('z' + 1)));
+        const __m128i dirty = _mm_andnot_si128(_mm_or_si128(digit, lower), graphic);
+        return {static_cast<uint32_t>(_mm_movemask_epi8(space)),
+                static_cast<uint32_t>(_mm_movemask_epi8(dirty) | _mm_movemask_epi8(bytes))};
+    }
+};
+
+#if defined(__GNUC__)
+struct Avx2Kernel {
+    static constexpr size_t width = 32;
+
+    __attribute__((target("avx2")))
+    static BlockMasks classify(const char *block) {
+        const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block));
+        const __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(' ')),
+                                              _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('\t' - 1)),
+                                                               _mm256_cmpgt_epi8(_mm256_set1_epi8('\r' + 1), bytes)));
+        const __m256i graphic = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8(' ')),
+                                                 _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7f), bytes));
+        const __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('0' - 1)),
+                                               _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), bytes));
+        const __m256i lower = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('a' - 1)),
+                                               _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), bytes));
+        const __m256i dirty = _mm256_andnot_si256(_mm256_or_si256(digit, lower), graphic);
+        return {static_cast<uint32_t>(_mm256_movemask_epi8(space)),
+                static_cast<uint32_t>(_mm256_movemask_epi8(dirty) | _mm256_movemask_epi8(bytes))};
+    }
+};
+#endif
+
+#elif defined(MAPREDUCE_SIMD_NEON)
+
+struct NeonKernel {
+    static constexpr size_t width = 16;
+
+    // NEON has no movemask instruction - weight every lane with its bit and add the lanes up
+    static uint32_t movemask(uint8x16_t lanes) {
+        static const uint8_t weights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+        const uint8x16_t bits = vandq_u8(lanes, vld1q_u8(weights));
+        return vaddv_u8(vget_low_u8(bits)) | (static_cast<uint32_t>(vaddv_u8(vget_high_u8(bits))) << 8);
+    }
+
+    static BlockMasks classify(const char *block) {
+        const int8x16_t bytes = vld1q_s8(reinterpret_cast<const int8_t *>(block));
+        const uint8x16_t space = vorrq_u8(vceqq_s8(bytes, vdupq_n_s8(' ')),
+                                          vandq_u8(vcgeq_s8(bytes, vdupq_n_s8('\t')), vcleq_s8(bytes, vdupq_n_s8('\r'))));
+        const uint8x16_t graphic = vandq_u8(vcgtq_s8(bytes, vdupq_n_s8(' ')), vcltq_s8(bytes, vdupq_n_s8(0x7f)));
+        const uint8x16_t digit = vandq_u8(vcgeq_s8(bytes, vdupq_n_s8('0')), vcleq_s8(bytes, vdupq_n_s8('9')));
+        const uint8x16_t lower = vandq_u8(vcgeq_s8(bytes, vdupq_n_s8('a')), vcleq_s8(bytes, vdupq_n_s8('z')));
+        const uint8x16_t dirty = vorrq_u8(vbicq_u8(graphic, vorrq_u8(digit, lower)), vcltq_s8(bytes, vdupq_n_s8(0)));
+        return {movemask(space), movemask(dirty)};
+    }
+};
+
+#endif
+
+// Index of the lowest set bit of a non-zero mask
+inline unsigned lowest_bit(uint32_t mask) {
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    unsigned index = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        ++index;
+    }
+    return index;
+#endif
+}
+
+// Mask with the bits [from, width) set
+inline uint32_t bits_from(unsigned from, size_t width) {
+    const uint32_t all = width == 32 ? ~uint32_t(0) : (uint32_t(1) << width) - 1;
+    return from >= 32 ? 0 : all & (~uint32_t(0) << from);
+}
+
+// **************************************************************************************
+//
+// Function: tokenize_simd
+// Description: Tokenizer driven by a SIMD kernel.  Every block of the input is classified
+//              once and the word boundaries are found by scanning the space mask with bit
+//              operations - a word ends at the next space bit and starts at the next bit that
+//              is not a space.  A word is clean when no dirty bit falls between its boundaries.
+//              The last partial block is copied into a buffer padded with spaces, but the
+//              emitted views always point into the input.
+//
+// **************************************************************************************
+
+template <typename Normalizer, typename Kernel, typename Emit>
+void tokenize_simd(std::string_view input, Emit &emit) {
+    constexpr size_t width = Kernel::width;
+    const char *const data = input.data();
+    bool in_word = false;
+    size_t word_begin = 0;
+    bool word_dirty = false;
+
+    for (size_t offset = 0; offset < input.size(); offset += width) {
+        BlockMasks masks;
+        if (offset + width <= input.size()) {
+            masks = Kernel::classify(data + offset);
+        } else {
+            char tail[width];
+            std::memset(tail, ' ', width);
+            std::memcpy(tail, data + offset, input.size() - offset);
+            masks = Kernel::classify(tail);
+        }
+
+        unsigned position = 0;
+        while (position < width) {
+            if (!in_word) {
+                // Look for the first byte of the next word
+                const uint32_t starts = ~masks.space & bits_from(position, width);
+                if (!starts) {
+                    break;
+                }
+                position = lowest_bit(starts);
+                word_begin = offset + position;
+                word_dirty = false;
+                in_word = true;
+            }
+
+            // Look for the end of the current word
+            const uint32_t ends = masks.space & bits_from(position, width);
+            if (!ends) {
+                word_dirty |= (masks.dirty & bits_from(position, width)) != 0;
+                break;
+            }
+            const unsigned word_end = lowest_bit(ends);
+            word_dirty |= (masks.dirty & bits_from(position, width) & ~bits_from(word_end, width)) != 0;
+            Normalizer::emit_word(data + word_begin, data + offset + word_end, !word_dirty, emit);
+            in_word = false;
+            position = word_end;
+        }
+    }
 
-// Create mutual exclusion primitive
-std::mutex reduceMutex;
+    // The input may end in the middle of a word
+    if (in_word) {
+        Normalizer::emit_word(data + word_begin, data + input.size(), !word_dirty, emit);
+    }
+}
+
+// **************************************************************************************
+//
+// Function: tokenizer_kernel
+// Description: Select the widest tokenizer kernel that the CPU supports.  The CPU is checked
+//              once at runtime, so a binary built for baseline x86-64 still uses AVX2 on the
+//              machines that have it.
+//
+// **************************************************************************************
+
+enum class TokenizerKernel { Scalar, Sse2, Avx2, Neon };
+
+inline TokenizerKernel tokenizer_kernel() {
+    static const TokenizerKernel kernel = []() {
+#if defined(MAPREDUCE_SIMD_X86) && defined(__GNUC__)
+        return __builtin_cpu_supports("avx2") ? TokenizerKernel::Avx2 : TokenizerKernel::Sse2;
+#elif defined(MAPREDUCE_SIMD_X86)
+        return TokenizerKernel::Sse2;
+#elif defined(MAPREDUCE_SIMD_NEON)
+        return TokenizerKernel::Neon;
+#else
+        return TokenizerKernel::Scalar;
+#endif
+    }();
+    return kernel;
+}
 
 // **************************************************************************************
 //
 // Function: map_function
 // Description: The map function will tokenize the input string and then
 //              transform the provided input string to lower case letters
-//              with all punctuation marks removed.  The function will store
-//              the transformed data in a vector of pairs that holds
-//              word occurences.
+//              with all punctuation marks removed.  Every transformed word
+//              is passed to the provided emit function together with an
+//              initial count of one.
+//
+//              The input is classified with the SIMD kernel selected by
+//              tokenizer_kernel and scanned once.  A word that is already lower
+//              case and free of punctuation is emitted as a view into the input,
+//              other words are normalized into a reused per-thread buffer, so no
+//              memory is allocated per word.  Words that consist only of
+//              punctuation marks are skipped.
+//
+//              Another normalization than the default one can be selected with
+//              the Normalizer template parameter, see Normalization policies.
 //
 // Parameters:
+//   - Normalizer: The Normalization of the words
 //   - input: This is the input string to be processed.
-
-// Returns:
-//   Vector of pairs showing word occurences in a provided text.  Each pair
-//   will contain a word and the number of times it appears in the provided text.
+//   - emit: Callable that receives each word as a std::string_view and its
+//           count.  The view is only valid during the call.  It is a template
+//           parameter so the call is inlined into the tokenizer loop.
 //
 // **************************************************************************************
 
-std::vector<std::pair<std::string, int>> map_function(const std::string &input) {
-    // Vectore to store word occurences - std::pair allows us to store two elements
-    // that may be of different type - in this case we use type string for the word
-    // in the pair and type int for the number of times the word occurs in the text
-    std::vector<std::pair<std::string, int>> result;
-    
-    // Tokenize the input string and create a string variable called word
-    std::istringstream iss(input);
-    std::string word;
-    
-    // Process the words that have been provided in the input
-    while (iss >> word) {
-        // Erase any punctuation marks in the provided text
-        word.erase(std::remove_if(word.begin(), word.end(), ispunct), word.end());
-        // Convert all of the text to lowercase
-        std::transform(word.begin(), word.end(), word.begin(),
-            [](unsigned char c){ return std::tolower(c); });
-        // Add the word to the result vector of pairs defined above with an
-        // intitial count of one
-        result.push_back(make_pair(word, 1));
+template <typename Normalizer = DefaultNormalization, typename Emit>
+void map_function(std::string_view input, Emit &&emit) {
+    switch (tokenizer_kernel()) {
+#if defined(MAPREDUCE_SIMD_X86)
+#if defined(__GNUC__)
+    case TokenizerKernel::Avx2:
+        tokenize_simd<Normalizer, Avx2Kernel>(input, emit);
+        return;
+#endif
+    case TokenizerKernel::Sse2:
+        tokenize_simd<Normalizer, Sse2Kernel>(input, emit);
+        return;
+#elif defined(MAPREDUCE_SIMD_NEON)
+    case TokenizerKernel::Neon:
+        tokenize_simd<Normalizer, NeonKernel>(input, emit);
+        return;
+#endif
+    default:
+        tokenize_scalar<Normalizer>(input, emit);
+        return;
     }
-    // Return the vector of word occurrences
-    return result;
 }
 
 // **************************************************************************************
@@ -103,97 +1109,7383 @@ int reduce_function(const std::vector<int> &values) {
 
 // **************************************************************************************
 //
-// Function: map_worker
-// Description: The map_worker function takes the provided string as input and applies
-//              the map_function to it.  For each pair in the mapped_result the map_worker
-//              utilizes an intermediate result map to push the result into the
-//              the corresponding key.  The map_worker uses a lock_guard with the mutex
-//              so that it can safely update the intermediate result map without another
-//              thread attempting to update it at the same time.
+// Combiner policies
+// Description: A combiner policy tells the MapReduce job whether the values that a map
+//              thread emits for the same key may be folded together before the shuffle.
+//              NoCombiner pushes every emitted value through the shuffle, SumCombiner
+//              adds the values together in the thread's local tables.  A policy provides
+//              a static enabled flag and a static combine function.
 //
-// Parameters:
-//   - input_data: String vector of input data
-//   - intermediate_result: Helper map that stores intermediate results from the map phase
-//   - start: Start index of the input_data
-//   - end: End index of the input_data
+// **************************************************************************************
+
+struct NoCombiner {
+    static constexpr bool enabled = false;
+    template <typename Value>
+    static void combine(Value &, const Value &) {}
+};
+
+struct SumCombiner {
+    static constexpr bool enabled = true;
+    template <typename Value>
+    static void combine(Value &accumulator, const Value &value) { accumulator += value; }
+};
+
+// **************************************************************************************
+//
+// Reducer traits
+// Description: A reducer that is associative and commutative can fold the values of a key
+//              as they arrive instead of collecting them in a list first.  Such a reducer
+//              declares static constexpr bool associative = true and provides a member
+//              fold(Value &accumulator, const Value &value).  The job then keeps a single
+//              running value per key, so the intermediate data is O(distinct keys) instead of
+//              O(emitted pairs).  Reducers without the flag use the list based reduce path.
+//              A list reducer may declare static constexpr bool splittable = true if
+//              reducing a piece of the values of a key and folding the partial results with
+//              fold gives the result of reducing all values at once - the list path may then
+//              reduce the values of a hot key in pieces (see split_hot_keys).  Having fold
+//              alone is not enough, a median or a distinct count can have one too.
 //
 // **************************************************************************************
 
-void map_worker(const std::vector<std::string> &input_data, std::map<std::string, std::vector<int>> &intermediate_result, int start, int end) {
-    for (int i = start; i < end; ++i) {
-        // Apply the map function to each of the strings provided in the input data
-        auto mapped_result = map_function(input_data[i]);
+template <typename Reducer, typename = void>
+struct is_streaming_reducer : std::false_type {};
 
-        // Before updating the helper map (intermediate_result) use lock_guard the the mutex
-        // defined earlier to safely update the map without multiple threads updating it
-        // at the same time
-        for (const auto& pair : mapped_result) {
-            std::lock_guard<std::mutex> lock(reduceMutex);
-            intermediate_result[pair.first].push_back(pair.second);
-        }
-    }
-}
+template <typename Reducer>
+struct is_streaming_reducer<Reducer, std::enable_if_t<Reducer::associative>> : std::true_type {};
 
+template <typename Reducer, typename = void>
+struct is_splittable_reducer : std::false_type {};
 
-int main(int argc, const char * argv[]) {
-    // Test input sentences to show MapReduce model.
-    std::vector<std::string> input_data = {
-        "This is sentence one.",
-        "This is sentence two.",
-        "This is a sentence that ends with red.",
-        "This is a sentence that ends with blue."
-    };
+template <typename Reducer>
+struct is_splittable_reducer<Reducer, std::enable_if_t<Reducer::splittable>> : std::true_type {};
 
-    // Determine the number of concurrent threads that the hardware can support
-    const int num_threads = std::thread::hardware_concurrency();
-    
-    // Create a vector of threads called map_threads
-    std::vector<std::thread> map_threads;
-    // Create a helper map that holds string keys and integer values
-    std::map<std::string, std::vector<int>> intermediate_result;
+template <typename Reducer, typename Value, typename = void>
+struct has_fold : std::false_type {};
 
-    // The below loop will distribute the work of the MapReduce model amongst multiple threads
-    // by dividing the input data into equal portions based on the number of threads determined
-    // above by std::thread::hardware_concurrency.
-    
-    // The start and end variables will determine the range of the input data that each of the
-    // threads will process.  A new thread will be created for each portion of the data and then
-    // the map_worker function will be used with it with the specified parameters.
-    
-    // std::ref passes references to the input_data and intermediate_result to each of the threads.
-    for (int i = 0; i < num_threads; ++i) {
-        // Calculate the start and end indices for the current thread's portion of the provided input data
-        unsigned long start = i * (input_data.size() / num_threads); // start index
-        unsigned long end = (i == num_threads - 1) ? input_data.size() : (i + 1) * (input_data.size() / num_threads); // end index
+template <typename Reducer, typename Value>
+struct has_fold<Reducer, Value, std::void_t<decltype(std::declval<const Reducer &>().fold(std::declval<Value &>(), std::declval<const Value &>()))>>
+    : std::true_type {};
 
-        // Create new thread and assign map_worker to it - emplace_back is used to add a new thread to the end
-        // of the map_threads vector - it constructs a new object in place at the end of the vector so that
-        // it avoids unnecessary copying
-        map_threads.emplace_back(map_worker, std::ref(input_data), std::ref(intermediate_result), start, end);
-    }
+// ListReducer hides the associative flag of a reducer so that it is run on the list based
+// reduce path - useful to compare both paths with the same reducer.  An associative reducer
+// stays splittable there.
+template <typename Reducer>
+struct ListReducer : Reducer {
+    static constexpr bool associative = false;
+    static constexpr bool splittable = is_streaming_reducer<Reducer>::value;
+};
 
-    // Wait for each of the threads in map_threads to finish before proceeding
-    // thread.join waits for a thread to finish its execution so we are waiting for
-    // all of the threads in map_threads to finish before we move to the reduce phase
-    for (auto& thread : map_threads) {
-        thread.join();
-    }
+// **************************************************************************************
+//
+// Function: hash_bytes
+// Description: 64 bit hash of a byte string.  The bytes are consumed eight at a time and the
+//              result is run through the finalizer of MurmurHash3 (mix64) so that both the
+//              low bits (used for the table slot) and the high bits (used for the reducer
+//              partition) are well distributed.
+//
+// **************************************************************************************
 
-    // Create a map of string keys with integer values called final_result
-    std::map<std::string, int> final_result;
+inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
 
-    // Iterate over the intermediate_result map and for each of the key value
-    // pairs in the map we want to apply the reduce_function to it - this is
-    // the program's reduce step of the MapReduce model
-    for (const auto& entry : intermediate_result) {
-        final_result[entry.first] = reduce_function(entry.second);
+inline uint64_t hash_bytes(std::string_view bytes) {
+    const char *position = bytes.data();
+    size_t remaining = bytes.size();
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ remaining;
+    while (remaining >= 8) {
+        uint64_t word;
+        std::memcpy(&word, position, 8);
+        hash = (hash ^ word) * 0xbf58476d1ce4e5b9ULL;
+        hash ^= hash >> 31;
+        position += 8;
+        remaining -= 8;
     }
-
-    // Iterate over the final results and print out the result set.
-    for (const auto& result : final_result) {
-        std::cout << result.first << ": " << result.second << std::endl;
+    if (remaining > 0) {
+        uint64_t word = 0;
+        std::memcpy(&word, position, remaining);
+        hash = (hash ^ word) * 0xbf58476d1ce4e5b9ULL;
     }
-
-    return 0;
+    return mix64(hash);
 }
 
+// **************************************************************************************
+//
+// Class: Arena
+// Description: Bump allocator for the intermediate data of a single thread.  Memory is
+//              handed out from large blocks by moving a cursor forward, deallocate does
+//              nothing and release() frees all blocks in one shot.  Every map thread has its
+//              own arena, so the threads do not contend on the global allocator for the slots
+//              and keys of their tables.  The arena is a std::pmr::memory_resource and can be
+//              used with the std::pmr containers.  It is not thread safe.
+//
+// **************************************************************************************
+
+class Arena : public std::pmr::memory_resource {
+public:
+    explicit Arena(size_t initial_block_size = 64 * 1024) : next_block_size_(initial_block_size) {}
+    ~Arena() override { release(); }
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    // Free all blocks - everything allocated from the arena is gone afterwards
+    void release() {
+        while (blocks_ != nullptr) {
+            Block *next = blocks_->next;
+            ::operator delete(blocks_);
+            blocks_ = next;
+        }
+        cursor_ = limit_ = nullptr;
+        bytes_reserved_ = 0;
+    }
+
+    // Number of bytes of the blocks that the arena holds
+    size_t bytes_reserved() const { return bytes_reserved_; }
+
+private:
+    static constexpr size_t max_block_size = 16 * 1024 * 1024;
+
+    struct Block {
+        Block *next;
+    };
+
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        uintptr_t start = (reinterpret_cast<uintptr_t>(cursor_) + alignment - 1) & ~(alignment - 1);
+        if (cursor_ == nullptr || start + bytes > reinterpret_cast<uintptr_t>(limit_)) {
+            // Start a new block - allocations larger than a block get a block of their own
+            const size_t size = std::max(next_block_size_, bytes + alignment + sizeof(Block));
+            next_block_size_ = std::min(next_block_size_ * 2, max_block_size);
+            Block *block = static_cast<Block *>(::operator new(size));
+            block->next = blocks_;
+            blocks_ = block;
+            bytes_reserved_ += size;
+            cursor_ = reinterpret_cast<char *>(block + 1);
+            limit_ = reinterpret_cast<char *>(block) + size;
+            start = (reinterpret_cast<uintptr_t>(cursor_) + alignment - 1) & ~(alignment - 1);
+        }
+        cursor_ = reinterpret_cast<char *>(start + bytes);
+        return reinterpret_cast<void *>(start);
+    }
+
+    void do_deallocate(void *, size_t, size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+    Block *blocks_ = nullptr;
+    char *cursor_ = nullptr;
+    char *limit_ = nullptr;
+    size_t next_block_size_;
+    size_t bytes_reserved_ = 0;
+};
+
+// **************************************************************************************
+//
+// Class: FlatStringMap
+// Description: Open addressing hash table with string keys, used for the intermediate data
+//              of jobs with std::string keys.  All entries live in one flat array of slots so
+//              a lookup touches one or two cache lines instead of chasing bucket nodes.
+//
+//              - Robin Hood probing: an entry that is further away from its home slot takes
+//                the place of an entry that is closer to its own, which keeps the probe
+//                sequences short and lets a lookup stop early.
+//              - Every slot stores the full hash of its key, so a probe only compares the key
+//                bytes when the hashes are equal and growing the table never rehashes a key.
+//              - Keys of up to 16 bytes - almost every word - are stored inline in the slot,
+//                longer keys are copied to the heap.
+//
+//              The slot array and the long keys are allocated from a std::pmr::memory_resource,
+//              usually the Arena of the thread that fills the table.
+//
+//              Lookups take a std::string_view so a word emitted by the tokenizer is found
+//              without creating a std::string.  Entries can not be erased one by one; clear()
+//              releases the whole table.  Iteration order is unspecified.
+//
+// **************************************************************************************
+
+template <typename Value>
+class FlatStringMap {
+    static constexpr size_t inline_capacity = 16;
+
+    struct Slot {
+        uint64_t hash;
+        uint32_t length;
+        // Distance from the home slot plus one, 0 marks an empty slot
+        uint32_t distance;
+        union {
+            char inline_key[inline_capacity];
+            char *heap_key;
+        };
+        // The value is only constructed while the slot is occupied
+        alignas(Value) unsigned char storage[sizeof(Value)];
+
+        const char *key_data() const {
+            return length <= inline_capacity ? inline_key : heap_key;
+        }
+        std::string_view key() const {
+            return std::string_view(key_data(), length);
+        }
+        Value &value() {
+            return *reinterpret_cast<Value *>(storage);
+        }
+    };
+
+public:
+    // Entry that iteration yields - the key is a view into the table
+    struct Entry {
+        std::string_view first;
+        Value &second;
+    };
+
+    class iterator {
+    public:
+        struct Arrow {
+            Entry entry;
+            Entry *operator->() { return &entry; }
+        };
+
+        iterator(Slot *slot, Slot *end) : slot_(slot), end_(end) { skip_empty(); }
+        Entry operator*() const { return {slot_->key(), slot_->value()}; }
+        Arrow operator->() const { return {**this}; }
+        iterator &operator++() {
+            ++slot_;
+            skip_empty();
+            return *this;
+        }
+        bool operator==(const iterator &other) const { return slot_ == other.slot_; }
+        bool operator!=(const iterator &other) const { return slot_ != other.slot_; }
+
+    private:
+        void skip_empty() {
+            while (slot_ != end_ && slot_->distance == 0) {
+                ++slot_;
+            }
+        }
+
+        Slot *slot_;
+        Slot *end_;
+    };
+
+    explicit FlatStringMap(std::pmr::memory_resource *resource = std::pmr::get_default_resource()) : resource_(resource) {}
+    FlatStringMap(FlatStringMap &&other) noexcept { swap(other); }
+    FlatStringMap &operator=(FlatStringMap &&other) noexcept {
+        swap(other);
+        return *this;
+    }
+    FlatStringMap(const FlatStringMap &) = delete;
+    FlatStringMap &operator=(const FlatStringMap &) = delete;
+    ~FlatStringMap() { clear(); }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    iterator begin() { return iterator(slots_, slots_ + capacity_); }
+    iterator end() { return iterator(slots_ + capacity_, slots_ + capacity_); }
+
+    void swap(FlatStringMap &other) noexcept {
+        std::swap(resource_, other.resource_);
+        std::swap(slots_, other.slots_);
+        std::swap(capacity_, other.capacity_);
+        std::swap(size_, other.size_);
+    }
+
+    // Release all entries and the slot array
+    void clear() {
+        for (size_t i = 0; i < capacity_; ++i) {
+            if (slots_[i].distance != 0) {
+                destroy(slots_[i]);
+            }
+        }
+        if (slots_ != nullptr) {
+            resource_->deallocate(slots_, capacity_ * sizeof(Slot), alignof(Slot));
+            slots_ = nullptr;
+        }
+        capacity_ = 0;
+        size_ = 0;
+    }
+
+    // Make room for the provided number of entries without growing the table
+    void reserve(size_t entries) {
+        while (entries * 5 > capacity_ * 4) {
+            grow();
+        }
+    }
+
+    // Find the value of a key, returns nullptr if the key is not in the table
+    Value *find(std::string_view key) { return find(key, hash_bytes(key)); }
+    Value *find(std::string_view key, uint64_t hash) {
+        Slot *slot = find_slot(key, hash);
+        return slot != nullptr ? &slot->value() : nullptr;
+    }
+
+    // Insert the key with the provided value unless it is in the table already.  Returns the
+    // value of the key and whether it was inserted.  The hash must be hash_bytes(key).
+    std::pair<Value *, bool> try_emplace(std::string_view key, uint64_t hash, const Value &value) {
+        if (Slot *slot = find_slot(key, hash)) {
+            return {&slot->value(), false};
+        }
+        if ((size_ + 1) * 5 > capacity_ * 4) {
+            grow();
+        }
+
+        Slot carry;
+        carry.hash = hash;
+        carry.length = static_cast<uint32_t>(key.size());
+        carry.distance = 1;
+        if (key.size() <= inline_capacity) {
+            std::memcpy(carry.inline_key, key.data(), key.size());
+        } else {
+            carry.heap_key = static_cast<char *>(resource_->allocate(key.size(), 1));
+            std::memcpy(carry.heap_key, key.data(), key.size());
+        }
+        new (carry.storage) Value(value);
+        ++size_;
+        return {insert_new(carry), true};
+    }
+
+    std::pair<Value *, bool> try_emplace(std::string_view key, const Value &value) {
+        return try_emplace(key, hash_bytes(key), value);
+    }
+
+    // Value of a key, a default constructed value is inserted if the key is not in the table
+    Value &operator[](std::string_view key) {
+        return *try_emplace(key, Value()).first;
+    }
+
+private:
+    Slot *find_slot(std::string_view key, uint64_t hash) const {
+        if (capacity_ == 0) {
+            return nullptr;
+        }
+        const size_t mask = capacity_ - 1;
+        size_t index = hash & mask;
+        for (uint32_t distance = 1;; ++distance) {
+            Slot &slot = slots_[index];
+            // An empty slot or an entry closer to its home slot than we are to ours means
+            // that the key is not in the table
+            if (slot.distance < distance) {
+                return nullptr;
+            }
+            if (slot.hash == hash && slot.length == key.size() && std::memcmp(slot.key_data(), key.data(), key.size()) == 0) {
+                return &slot;
+            }
+            index = (index + 1) & mask;
+        }
+    }
+
+    // Robin Hood insertion of an entry that is known not to be in the table - returns the
+    // value of the inserted entry
+    Value *insert_new(Slot &carry) {
+        const size_t mask = capacity_ - 1;
+        size_t index = carry.hash & mask;
+        Value *inserted = nullptr;
+        for (;;) {
+            Slot &slot = slots_[index];
+            if (slot.distance == 0) {
+                relocate(slot, carry);
+                return inserted != nullptr ? inserted : &slot.value();
+            }
+            if (slot.distance < carry.distance) {
+                Slot displaced;
+                relocate(displaced, slot);
+                relocate(slot, carry);
+                relocate(carry, displaced);
+                if (inserted == nullptr) {
+                    inserted = &slot.value();
+                }
+            }
+            index = (index + 1) & mask;
+            ++carry.distance;
+        }
+    }
+
+    void grow() {
+        Slot *const old_slots = slots_;
+        const size_t old_capacity = capacity_;
+        capacity_ = std::max<size_t>(16, capacity_ * 2);
+        slots_ = static_cast<Slot *>(resource_->allocate(capacity_ * sizeof(Slot), alignof(Slot)));
+        std::memset(static_cast<void *>(slots_), 0, capacity_ * sizeof(Slot));
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old_slots[i].distance != 0) {
+                old_slots[i].distance = 1;
+                insert_new(old_slots[i]);
+            }
+        }
+        if (old_slots != nullptr) {
+            resource_->deallocate(old_slots, old_capacity * sizeof(Slot), alignof(Slot));
+        }
+    }
+
+    // Move the entry of one slot into an empty slot, the source slot is left empty
+    static void relocate(Slot &target, Slot &source) {
+        target.hash = source.hash;
+        target.length = source.length;
+        target.distance = source.distance;
+        std::memcpy(target.inline_key, source.inline_key, inline_capacity);
+        new (target.storage) Value(std::move(source.value()));
+        source.value().~Value();
+        source.distance = 0;
+    }
+
+    void destroy(Slot &slot) {
+        if (slot.length > inline_capacity) {
+            resource_->deallocate(slot.heap_key, slot.length, 1);
+        }
+        slot.value().~Value();
+        slot.distance = 0;
+    }
+
+    std::pmr::memory_resource *resource_ = std::pmr::get_default_resource();
+    Slot *slots_ = nullptr;
+    size_t capacity_ = 0;
+    size_t size_ = 0;
+};
+
+// **************************************************************************************
+//
+// Struct: KeyTraits
+// Description: Selects the hash table that a job uses for its intermediate data and how the
+//              keys are hashed.  Jobs with std::string keys use FlatStringMap and hash_bytes -
+//              the Hash parameter of the job is not used for them - and the emitted keys are
+//              looked up as std::string_view without being converted.  Their tables allocate
+//              from the provided memory resource.  All other key types use
+//              std::pmr::unordered_map with the Hash of the job.
+//
+//              The traits also decide which reducer partition a hash belongs to.  A table is
+//              created for a given partition so that tables which index by key (DenseTable
+//              below) can take the partitioning into account.
+//
+// **************************************************************************************
+
+template <typename Key, typename Hash>
+struct KeyTraits {
+    template <typename Value>
+    using Table = std::pmr::unordered_map<Key, Value, Hash>;
+
+    // Create an empty table for a partition
+    template <typename Value>
+    static Table<Value> make_table(std::pmr::memory_resource *resource, size_t, size_t) {
+        return Table<Value>(typename Table<Value>::allocator_type(resource));
+    }
+
+    // The mapper may emit keys of a type that is only explicitly convertible to Key, which
+    // are converted here - a Key is passed through
+    template <typename EmittedKey>
+    static decltype(auto) lookup_key(const EmittedKey &key) {
+        if constexpr (std::is_same<EmittedKey, Key>::value) {
+            return (key);
+        } else {
+            return Key(key);
+        }
+    }
+
+    static uint64_t hash(const Key &key) {
+        return mix64(Hash{}(key));
+    }
+
+    // The partition is taken from the high bits of the hash because the tables use the low
+    // bits to pick a slot
+    static size_t partition(uint64_t hash, size_t num_partitions) {
+        return static_cast<size_t>(((hash >> 32) * num_partitions) >> 32);
+    }
+
+    // Insert the key with the value, or combine the value into the existing value of the key
+    template <typename Value, typename Combine>
+    static void upsert(Table<Value> &table, const Key &key, uint64_t, const Value &value, Combine &&combine) {
+        auto inserted = table.try_emplace(key, value);
+        if (!inserted.second) {
+            combine(inserted.first->second, value);
+        }
+    }
+
+    // Value of a key, a default constructed value is inserted if the key is not in the table
+    template <typename Value>
+    static Value &at(Table<Value> &table, const Key &key, uint64_t) {
+        return table[key];
+    }
+};
+
+template <typename Hash>
+struct KeyTraits<std::string, Hash> {
+    template <typename Value>
+    using Table = FlatStringMap<Value>;
+
+    template <typename Value>
+    static Table<Value> make_table(std::pmr::memory_resource *resource, size_t, size_t) {
+        return Table<Value>(resource);
+    }
+
+    static std::string_view lookup_key(std::string_view key) {
+        return key;
+    }
+
+    static uint64_t hash(std::string_view key) {
+        return hash_bytes(key);
+    }
+
+    static size_t partition(uint64_t hash, size_t num_partitions) {
+        return static_cast<size_t>(((hash >> 32) * num_partitions) >> 32);
+    }
+
+    template <typename Value, typename Combine>
+    static void upsert(Table<Value> &table, std::string_view key, uint64_t hash, const Value &value, Combine &&combine) {
+        auto inserted = table.try_emplace(key, hash, value);
+        if (!inserted.second) {
+            combine(*inserted.first, value);
+        }
+    }
+
+    template <typename Value>
+    static Value &at(Table<Value> &table, std::string_view key, uint64_t hash) {
+        return *table.try_emplace(key, hash, Value()).first;
+    }
+};
+
+// **************************************************************************************
+//
+// Class: TermDictionary
+// Description: Dictionary that assigns a dense 32 bit id to every distinct term.  A job can
+//              emit the id of a word instead of the word itself, so the shuffle and the reduce
+//              phase only hash and compare integers and the bytes of a word are stored once.
+//              The strings are only looked up again when the results are printed.
+//
+//              The dictionary is shared by all map threads.  It is split into shards, each
+//              with its own mutex and FlatStringMap, so threads that intern different words
+//              rarely wait for each other.  The ids are handed out by an atomic counter and
+//              are therefore dense, in the order in which the words were first seen.
+//
+// **************************************************************************************
+
+class TermDictionary {
+public:
+    // Get the id of a term, the term is added if it is new.  The hash must be hash_bytes(term).
+    uint32_t intern(std::string_view term, uint64_t hash) {
+        Shard &shard = shards_[hash >> (64 - shard_bits)];
+        const auto lock = lock_counted(shard.mutex);
+        auto inserted = shard.ids.try_emplace(term, hash, 0);
+        if (inserted.second) {
+            *inserted.first = next_id_.fetch_add(1, std::memory_order_relaxed);
+        }
+        return *inserted.first;
+    }
+
+    size_t size() const {
+        return next_id_.load(std::memory_order_relaxed);
+    }
+
+    // Table of all terms indexed by their id.  The views point into the dictionary, which
+    // must not be used by other threads while the table is built.
+    std::vector<std::string_view> terms() {
+        std::vector<std::string_view> terms(size());
+        for (Shard &shard : shards_) {
+            for (auto &&entry : shard.ids) {
+                terms[entry.second] = entry.first;
+            }
+        }
+        return terms;
+    }
+
+private:
+    static constexpr unsigned shard_bits = 6;
+
+    struct Shard {
+        std::mutex mutex;
+        Arena arena;
+        FlatStringMap<uint32_t> ids{&arena};
+    };
+
+    Shard shards_[size_t(1) << shard_bits];
+    std::atomic<uint32_t> next_id_{0};
+};
+
+// Id of a term in a TermDictionary, used as the key of interning jobs
+struct TermId {
+    uint32_t value;
+
+    bool operator==(const TermId &other) const { return value == other.value; }
+    bool operator<(const TermId &other) const { return value < other.value; }
+};
+
+// **************************************************************************************
+//
+// Class: DenseTable
+// Description: Table for TermId keys.  The ids are dense, so instead of hashing them the
+//              table keeps its values in a vector indexed by the id.  The ids of a reducer
+//              partition are every stride-th id (see KeyTraits<TermId> below), so the index
+//              of an id is id / stride and the vector stays compact for every partition.
+//
+// **************************************************************************************
+
+template <typename Value>
+class DenseTable {
+public:
+    struct Entry {
+        TermId first;
+        Value &second;
+    };
+
+    class iterator {
+    public:
+        iterator(DenseTable *table, size_t index) : table_(table), index_(index) { skip_empty(); }
+        Entry operator*() const {
+            return {TermId{static_cast<uint32_t>(index_ * table_->stride_ + table_->offset_)}, table_->values_[index_]};
+        }
+        iterator &operator++() {
+            ++index_;
+            skip_empty();
+            return *this;
+        }
+        bool operator!=(const iterator &other) const { return index_ != other.index_; }
+
+    private:
+        void skip_empty() {
+            while (index_ < table_->present_.size() && !table_->present_[index_]) {
+                ++index_;
+            }
+        }
+
+        DenseTable *table_;
+        size_t index_;
+    };
+
+    DenseTable(std::pmr::memory_resource *resource, size_t stride, size_t offset)
+        : values_(resource), present_(resource), stride_(stride), offset_(offset) {}
+
+    size_t size() const { return size_; }
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, present_.size()); }
+
+    void reserve(size_t) {}
+
+    void clear() {
+        values_.clear();
+        values_.shrink_to_fit();
+        present_.clear();
+        present_.shrink_to_fit();
+        size_ = 0;
+    }
+
+    // Insert the id with the provided value unless it is in the table already, see
+    // FlatStringMap::try_emplace
+    std::pair<Value *, bool> try_emplace(TermId id, const Value &value) {
+        const size_t index = id.value / stride_;
+        if (index >= present_.size()) {
+            const size_t size = std::max(index + 1, present_.size() * 2);
+            values_.resize(size);
+            present_.resize(size);
+        }
+        if (present_[index]) {
+            return {&values_[index], false};
+        }
+        present_[index] = 1;
+        values_[index] = value;
+        ++size_;
+        return {&values_[index], true};
+    }
+
+private:
+    std::pmr::vector<Value> values_;
+    std::pmr::vector<uint8_t> present_;
+    size_t stride_;
+    size_t offset_;
+    size_t size_ = 0;
+};
+
+template <typename Hash>
+struct KeyTraits<TermId, Hash> {
+    template <typename Value>
+    using Table = DenseTable<Value>;
+
+    // The partition of an id is id % num_partitions, so the table of partition p holds the
+    // ids p, p + num_partitions, p + 2 * num_partitions...
+    template <typename Value>
+    static Table<Value> make_table(std::pmr::memory_resource *resource, size_t num_partitions, size_t partition) {
+        return Table<Value>(resource, num_partitions, partition);
+    }
+
+    static TermId lookup_key(TermId id) {
+        return id;
+    }
+
+    static uint64_t hash(TermId id) {
+        return id.value;
+    }
+
+    static size_t partition(uint64_t hash, size_t num_partitions) {
+        return static_cast<size_t>(hash % num_partitions);
+    }
+
+    template <typename Value, typename Combine>
+    static void upsert(Table<Value> &table, TermId id, uint64_t, const Value &value, Combine &&combine) {
+        auto inserted = table.try_emplace(id, value);
+        if (!inserted.second) {
+            combine(*inserted.first, value);
+        }
+    }
+
+    template <typename Value>
+    static Value &at(Table<Value> &table, TermId id, uint64_t) {
+        return *table.try_emplace(id, Value()).first;
+    }
+};
+
+// **************************************************************************************
+//
+// Class: TaskTracker
+// Description: Bookkeeping for the speculative execution of tasks.  On a shared machine or
+//              cluster a single slow disk or busy neighbour can make one task take much longer
+//              than the others, and the phase cannot end before its slowest task.  The tracker
+//              remembers when every task was started and how long the completed tasks took.
+//              A task that has run for more than factor times the median of the completed
+//              tasks (and at least min_delay) is a straggler, and an idle worker runs a backup
+//              copy of it.  Every copy produces its output on the side, and only the first copy
+//              to claim() the task may keep it - the other copies are abandoned.
+//
+//              Only map tasks are tracked.  A map task reads an input split that stays
+//              where it is, so a second copy can read it again.  A reduce task consumes its
+//              input: the reducer of a partition moves the values out of the tables of the
+//              map threads, a piece of a hot key moves its list, and the partitions of a
+//              distributed job exist only on their owner.  A backup copy would have nothing
+//              left to read, and keeping the input for it would double the intermediate data.
+//              The usual reason for a slow reducer, a skewed key, is handled by
+//              split_hot_keys instead.
+//
+//              All members are thread safe.  done() is a single atomic load so that a running
+//              copy can check cheaply whether it has already lost.  An idle worker waits in
+//              next_straggler, which sleeps until a task starts or completes or until the
+//              first running task becomes overdue, rather than polling.
+//
+// **************************************************************************************
+
+class TaskTracker {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit TaskTracker(size_t num_tasks, double factor = 1.5, Clock::duration min_delay = std::chrono::milliseconds(50))
+        : starts_(num_tasks), backed_up_(num_tasks, false), done_(std::make_unique<std::atomic<bool>[]>(num_tasks)),
+          remaining_(num_tasks), factor_(factor), min_delay_(min_delay) {}
+
+    // Record the start of the first copy of a task
+    void start(size_t task) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (starts_[task] == Clock::time_point()) {
+            starts_[task] = Clock::now();
+            changed_.notify_all();
+        }
+    }
+
+    // Claim the output of a task for the calling copy.  Returns false if another copy has
+    // claimed it first, the caller must then drop its output.
+    bool claim(size_t task) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (done_[task].load(std::memory_order_relaxed)) {
+            return false;
+        }
+        done_[task].store(true, std::memory_order_release);
+        --remaining_;
+        durations_.push_back(Clock::now() - starts_[task]);
+        // A completed task may end the phase or lower the limit of the stragglers
+        changed_.notify_all();
+        return true;
+    }
+
+    bool done(size_t task) const {
+        return done_[task].load(std::memory_order_acquire);
+    }
+
+    // Find a running task that is overdue and has no backup yet, the task is marked as
+    // backed up.  Without a straggler due is set to the time at which the first running task
+    // becomes overdue, or to time_point::max() if that is not known yet - a caller that waits
+    // on its own condition variable sleeps until then.
+    bool straggler(size_t &task, Clock::time_point &due) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return find_straggler(task, due);
+    }
+
+    // Wait for a straggler, see straggler.  Returns false once every task is done or after
+    // cancel().
+    bool next_straggler(size_t &task) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (remaining_ != 0 && !cancelled_) {
+            Clock::time_point due;
+            if (find_straggler(task, due)) {
+                return true;
+            }
+            if (due == Clock::time_point::max()) {
+                changed_.wait(lock);
+            } else {
+                changed_.wait_until(lock, due);
+            }
+        }
+        return false;
+    }
+
+    // Make next_straggler return false, for a worker that fails - its task would never
+    // complete
+    void cancel() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cancelled_ = true;
+        changed_.notify_all();
+    }
+
+private:
+    // straggler with the mutex held.  Without a straggler due is set to the time at which the
+    // first running task becomes overdue, or to time_point::max() if that is not known yet.
+    bool find_straggler(size_t &task, Clock::time_point &due) {
+        due = Clock::time_point::max();
+        if (durations_.empty()) {
+            return false;
+        }
+        std::vector<Clock::duration> durations = durations_;
+        std::nth_element(durations.begin(), durations.begin() + durations.size() / 2, durations.end());
+        const auto limit = std::max<Clock::duration>(min_delay_,
+            std::chrono::duration_cast<Clock::duration>(durations[durations.size() / 2] * factor_));
+        const Clock::time_point now = Clock::now();
+        for (size_t candidate = 0; candidate < starts_.size(); ++candidate) {
+            if (starts_[candidate] != Clock::time_point() && !backed_up_[candidate] &&
+                !done_[candidate].load(std::memory_order_relaxed)) {
+                if (now - starts_[candidate] > limit) {
+                    backed_up_[candidate] = true;
+                    task = candidate;
+                    return true;
+                }
+                due = std::min(due, starts_[candidate] + limit);
+            }
+        }
+        return false;
+    }
+
+    std::mutex mutex_;
+    std::vector<Clock::time_point> starts_;
+    std::vector<bool> backed_up_;
+    std::unique_ptr<std::atomic<bool>[]> done_;
+    std::vector<Clock::duration> durations_;
+    size_t remaining_;
+    double factor_;
+    Clock::duration min_delay_;
+    // Signalled when a task starts or completes and on cancel()
+    std::condition_variable changed_;
+    bool cancelled_ = false;
+};
+
+// Thrown inside a copy of a task once another copy has claimed the task, see TaskTracker
+struct TaskAbandoned {};
+
+// **************************************************************************************
+//
+// Class: TaskScheduler
+// Description: Hands the map tasks (indices of the input splits) out to the map threads.
+//              Every worker has its own deque of tasks which is filled with a contiguous run of
+//              tasks up front.  A worker takes its tasks from the front of its own deque, in
+//              input order, and once its deque is empty it steals from the back of the deques
+//              of the other workers.  A worker that gets long splits is therefore helped out by
+//              the others instead of becoming the straggler of the whole phase.
+//
+//              No tasks are added once the workers are running, so a worker is done as soon as
+//              all deques are empty.  The deques are protected by their own mutex - a worker
+//              only touches the mutex of another worker when it steals.
+//
+//              With a TaskTracker the scheduler executes stragglers speculatively.  A worker
+//              that finds all deques empty waits for the remaining tasks to complete and,
+//              meanwhile, takes the backup copies of the stragglers that the tracker finds
+//              (see TaskTracker::next_straggler).
+//              The worker must claim() every task it completes.
+//
+// **************************************************************************************
+
+class TaskScheduler {
+public:
+    TaskScheduler(size_t num_workers, size_t num_tasks, TaskTracker *tracker = nullptr)
+        : TaskScheduler(num_workers, block_owners(num_workers, num_tasks), tracker) {}
+
+    // Start with every task in the deque of a chosen worker - owners[task] is the worker
+    TaskScheduler(size_t num_workers, const std::vector<size_t> &owners, TaskTracker *tracker = nullptr)
+        : deques_(num_workers), tracker_(tracker) {
+        for (size_t task = 0; task < owners.size(); ++task) {
+            deques_[owners[task]].tasks.push_back(task);
+        }
+    }
+
+    // Every worker owns a contiguous range of the tasks
+    static std::vector<size_t> block_owners(size_t num_workers, size_t num_tasks) {
+        std::vector<size_t> owners(num_tasks);
+        for (size_t worker = 0; worker < num_workers; ++worker) {
+            const size_t start = worker * num_tasks / num_workers;
+            const size_t end = (worker + 1) * num_tasks / num_workers;
+            std::fill(owners.begin() + static_cast<std::ptrdiff_t>(start), owners.begin() + static_cast<std::ptrdiff_t>(end), worker);
+        }
+        return owners;
+    }
+
+    size_t num_workers() const {
+        return deques_.size();
+    }
+
+    TaskTracker *tracker() const {
+        return tracker_;
+    }
+
+    // Get the next task for a worker, returns false once there is no task left
+    bool next(size_t worker, size_t &task) {
+        if (take(worker, task)) {
+            if (tracker_ != nullptr) {
+                tracker_->start(task);
+            }
+            return true;
+        }
+        return tracker_ != nullptr && tracker_->next_straggler(task);
+    }
+
+    // Stop handing out backups, for a worker that fails - its task would never complete
+    void abort() {
+        if (tracker_ != nullptr) {
+            tracker_->cancel();
+        }
+    }
+
+    // Claim the output of a completed task, see TaskTracker::claim
+    bool claim(size_t task) {
+        return tracker_ == nullptr || tracker_->claim(task);
+    }
+
+private:
+    bool take(size_t worker, size_t &task) {
+        {
+            TaskDeque &own = deques_[worker];
+            const auto lock = lock_counted(own.mutex);
+            if (!own.tasks.empty()) {
+                task = own.tasks.front();
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < deques_.size(); ++i) {
+            TaskDeque &victim = deques_[(worker + i) % deques_.size()];
+            const auto lock = lock_counted(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.back();
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    struct TaskDeque {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    std::vector<TaskDeque> deques_;
+    TaskTracker *tracker_;
+};
+
+// **************************************************************************************
+//
+// Blocks
+// Description: The binary data of the job - spill files, the messages of a distributed job
+//              and binary result files - is stored in blocks.  A block is a 13 byte header
+//              followed by the stored bytes:
+//
+//                raw size      u32   size of the data after decompression
+//                stored size   u32   number of bytes that follow the header
+//                codec         u8    BlockCodec of the stored bytes
+//                checksum      u32   CRC-32C of the stored bytes
+//
+//              A block whose compressed form is not smaller than its data is stored as it is.
+//              LZ4 and Zstandard are only available when the program is built with
+//              MAPREDUCE_WITH_LZ4 or MAPREDUCE_WITH_ZSTD defined and linked with the library.
+//              The reader of a block must support its codec, otherwise decode_block throws
+//              std::runtime_error, as it does for a block with a bad checksum.  The checksum
+//              does not cover the header, so decode_block also rejects a raw size above
+//              max_block_size, or one that differs from the stored size of a block that is
+//              stored as it is, before it allocates anything for the data.
+//
+// **************************************************************************************
+
+enum class BlockCodec : uint8_t {
+    None = 0,
+    Lz4 = 1,
+    Zstd = 2,
+};
+
+constexpr size_t block_header_size = 13;
+// Largest raw size of a block, the messages of a distributed job are the largest blocks
+constexpr uint32_t max_block_size = 256 << 20;
+
+// Table of the bytewise CRC-32C (Castagnoli) computation
+struct Crc32cTable {
+    uint32_t entries[256];
+    constexpr Crc32cTable() : entries() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1u)));
+            }
+            entries[i] = crc;
+        }
+    }
+};
+
+inline uint32_t crc32c_scalar(const char *data, size_t size) {
+    static constexpr Crc32cTable table;
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table.entries[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#if defined(MAPREDUCE_SIMD_X86)
+// SSE 4.2 has an instruction for CRC-32C that handles 8 bytes at a time
+__attribute__((target("sse4.2"))) inline uint32_t crc32c_sse42(const char *data, size_t size) {
+    uint64_t crc = 0xFFFFFFFFu;
+    for (; size >= 8; data += 8, size -= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        crc = _mm_crc32_u64(crc, word);
+    }
+    uint32_t crc32 = static_cast<uint32_t>(crc);
+    for (; size > 0; ++data, --size) {
+        crc32 = _mm_crc32_u8(crc32, static_cast<unsigned char>(*data));
+    }
+    return ~crc32;
+}
+#endif
+
+inline uint32_t crc32c(std::string_view data) {
+#if defined(MAPREDUCE_SIMD_X86)
+    static const bool sse42 = __builtin_cpu_supports("sse4.2");
+    if (sse42) {
+        return crc32c_sse42(data.data(), data.size());
+    }
+#endif
+    return crc32c_scalar(data.data(), data.size());
+}
+
+// Parse the name of a codec, returns false for an unknown or unavailable codec
+inline bool parse_block_codec(std::string_view name, BlockCodec &codec) {
+    if (name == "none") {
+        codec = BlockCodec::None;
+        return true;
+    }
+#if defined(MAPREDUCE_WITH_LZ4)
+    if (name == "lz4") {
+        codec = BlockCodec::Lz4;
+        return true;
+    }
+#endif
+#if defined(MAPREDUCE_WITH_ZSTD)
+    if (name == "zstd") {
+        codec = BlockCodec::Zstd;
+        return true;
+    }
+#endif
+    return false;
+}
+
+// Compress the data with the codec into the buffer, returns false if the codec did not
+// make the data smaller
+inline bool compress_block([[maybe_unused]] std::string_view data, BlockCodec codec, [[maybe_unused]] std::string &compressed) {
+    switch (codec) {
+#if defined(MAPREDUCE_WITH_LZ4)
+    case BlockCodec::Lz4: {
+        compressed.resize(static_cast<size_t>(LZ4_compressBound(static_cast<int>(data.size()))));
+        const int size = LZ4_compress_default(data.data(), &compressed[0], static_cast<int>(data.size()), static_cast<int>(compressed.size()));
+        compressed.resize(size > 0 ? static_cast<size_t>(size) : 0);
+        return size > 0 && compressed.size() < data.size();
+    }
+#endif
+#if defined(MAPREDUCE_WITH_ZSTD)
+    case BlockCodec::Zstd: {
+        compressed.resize(ZSTD_compressBound(data.size()));
+        const size_t size = ZSTD_compress(&compressed[0], compressed.size(), data.data(), data.size(), 1);
+        if (ZSTD_isError(size)) {
+            return false;
+        }
+        compressed.resize(size);
+        return compressed.size() < data.size();
+    }
+#endif
+    default:
+        return false;
+    }
+}
+
+// Append the data as a block to the output
+inline void encode_block(std::string_view data, BlockCodec codec, std::string &output) {
+    if (data.size() > max_block_size) {
+        throw std::runtime_error("Block is too large");
+    }
+    thread_local std::string compressed;
+    std::string_view stored = data;
+    if (codec != BlockCodec::None && compress_block(data, codec, compressed)) {
+        stored = compressed;
+    } else {
+        codec = BlockCodec::None;
+    }
+    char header[block_header_size];
+    const uint32_t raw_size = static_cast<uint32_t>(data.size());
+    const uint32_t stored_size = static_cast<uint32_t>(stored.size());
+    const uint32_t checksum = crc32c(stored);
+    std::memcpy(header, &raw_size, 4);
+    std::memcpy(header + 4, &stored_size, 4);
+    header[8] = static_cast<char>(codec);
+    std::memcpy(header + 9, &checksum, 4);
+    output.append(header, sizeof(header));
+    output.append(stored.data(), stored.size());
+}
+
+// Size of the stored bytes that follow a block header
+inline size_t block_stored_size(const char *header) {
+    uint32_t stored_size;
+    std::memcpy(&stored_size, header + 4, 4);
+    return stored_size;
+}
+
+// Check and decompress the stored bytes of the block with the header into data
+inline void decode_block(const char *header, std::string_view stored, std::string &data) {
+    uint32_t raw_size;
+    uint32_t checksum;
+    std::memcpy(&raw_size, header, 4);
+    std::memcpy(&checksum, header + 9, 4);
+    if (crc32c(stored) != checksum) {
+        throw std::runtime_error("Block checksum mismatch");
+    }
+    const BlockCodec codec = static_cast<BlockCodec>(header[8]);
+    if (raw_size > max_block_size || (codec == BlockCodec::None && raw_size != stored.size())) {
+        throw std::runtime_error("Block is corrupt");
+    }
+    data.resize(raw_size);
+    bool decoded = false;
+    switch (codec) {
+    case BlockCodec::None:
+        std::memcpy(&data[0], stored.data(), raw_size);
+        decoded = true;
+        break;
+#if defined(MAPREDUCE_WITH_LZ4)
+    case BlockCodec::Lz4:
+        decoded = LZ4_decompress_safe(stored.data(), &data[0], static_cast<int>(stored.size()), static_cast<int>(raw_size)) == static_cast<int>(raw_size);
+        break;
+#endif
+#if defined(MAPREDUCE_WITH_ZSTD)
+    case BlockCodec::Zstd:
+        decoded = ZSTD_decompress(&data[0], raw_size, stored.data(), stored.size()) == raw_size;
+        break;
+#endif
+    default:
+        throw std::runtime_error("Block uses an unsupported codec");
+    }
+    if (!decoded) {
+        throw std::runtime_error("Block is corrupt");
+    }
+}
+
+// **************************************************************************************
+//
+// Varints
+// Description: Integers are stored as varints, 7 bits per byte with the high bit set on all
+//              but the last byte, so small counts and lengths take a single byte.  Signed
+//              integers are zigzag encoded first to keep small negative values short.
+//
+// **************************************************************************************
+
+template <typename Out>
+void write_varint(Out &out, uint64_t value) {
+    unsigned char bytes[10];
+    size_t size = 0;
+    while (value >= 0x80) {
+        bytes[size++] = static_cast<unsigned char>(value | 0x80);
+        value >>= 7;
+    }
+    bytes[size++] = static_cast<unsigned char>(value);
+    out.write(bytes, size);
+}
+
+template <typename In>
+uint64_t read_varint(In &in) {
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        unsigned char byte;
+        in.read(&byte, 1);
+        // The tenth byte holds the top bit only, more would not fit into 64 bits
+        if (shift == 63 && byte > 1) {
+            throw std::runtime_error("Varint does not fit into 64 bits");
+        }
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+    throw std::runtime_error("Varint is too long");
+}
+
+// **************************************************************************************
+//
+// Spill files
+// Description: When the intermediate data of a map thread grows past its memory budget the
+//              thread sorts its partitions by key and writes them to a spill file, a run of
+//              records in a compact binary format, in checksummed and optionally compressed
+//              blocks.  The runs are merged again in the reduce phase (see
+//              MapReduce::merge_reduce).
+//
+//              SpillFile is a temporary file that is removed again when it is destroyed.
+//              SpillWriter and SpillReader read and write its bytes through a large buffer and
+//              throw std::runtime_error if that fails.  SpillCodec<T> encodes a single key or
+//              value: integers and TermIds as varints, other trivially copyable types as they
+//              are, strings and vectors with their varint length in front.  Only jobs whose
+//              types have a codec can spill.
+//              The codec works on any stream with the write and read members of SpillWriter
+//              and SpillReader, MessageWriter and MessageReader below use it for the messages
+//              of a distributed job.
+//
+// **************************************************************************************
+
+class SpillFile {
+public:
+    explicit SpillFile(const std::string &directory) {
+        static std::atomic<unsigned> counter{0};
+        const auto ticks = std::chrono::steady_clock::now().time_since_epoch().count();
+        path_ = directory + "/mapreduce-spill-" + std::to_string(ticks) + "-" + std::to_string(counter++);
+    }
+
+    ~SpillFile() {
+        std::remove(path_.c_str());
+    }
+
+    SpillFile(const SpillFile &) = delete;
+    SpillFile &operator=(const SpillFile &) = delete;
+
+    const std::string &path() const { return path_; }
+
+private:
+    std::string path_;
+};
+
+// Writes a spill file as a sequence of blocks.  end_block() writes out the records that
+// were added since the last block and returns the offset at which the next block starts,
+// a range of the file that is read with SpillReader must begin and end at such an offset.
+class SpillWriter {
+public:
+    static constexpr size_t block_size = 64 << 10;
+
+    explicit SpillWriter(const std::string &path, BlockCodec codec = BlockCodec::None) : file_(std::fopen(path.c_str(), "wb")), codec_(codec) {
+        if (file_ == nullptr) {
+            throw std::runtime_error("Can not create spill file " + path + ": " + std::strerror(errno));
+        }
+        std::setvbuf(file_, nullptr, _IOFBF, 1 << 20);
+        block_.reserve(block_size);
+    }
+
+    ~SpillWriter() {
+        if (file_ != nullptr) {
+            std::fclose(file_);
+        }
+    }
+
+    SpillWriter(const SpillWriter &) = delete;
+    SpillWriter &operator=(const SpillWriter &) = delete;
+
+    void write(const void *data, size_t size) {
+        block_.append(static_cast<const char *>(data), size);
+        if (block_.size() >= block_size) {
+            end_block();
+        }
+    }
+
+    uint64_t end_block() {
+        if (!block_.empty()) {
+            encoded_.clear();
+            encode_block(block_, codec_, encoded_);
+            if (std::fwrite(encoded_.data(), 1, encoded_.size(), file_) != encoded_.size()) {
+                throw std::runtime_error(std::string("Can not write spill file: ") + std::strerror(errno));
+            }
+            offset_ += encoded_.size();
+            block_.clear();
+        }
+        return offset_;
+    }
+
+    void close() {
+        end_block();
+        const bool failed = std::fclose(file_) != 0;
+        file_ = nullptr;
+        if (failed) {
+            throw std::runtime_error(std::string("Can not write spill file: ") + std::strerror(errno));
+        }
+    }
+
+private:
+    std::FILE *file_;
+    BlockCodec codec_;
+    uint64_t offset_ = 0;
+    std::string block_;
+    std::string encoded_;
+};
+
+// Reads the records of the blocks in the bytes [begin, end) of a spill file
+class SpillReader {
+public:
+    SpillReader(const std::string &path, uint64_t begin, uint64_t end) : file_(std::fopen(path.c_str(), "rb")), remaining_(end - begin) {
+        if (file_ == nullptr || std::fseek(file_, static_cast<long>(begin), SEEK_SET) != 0) {
+            throw std::runtime_error("Can not read spill file " + path + ": " + std::strerror(errno));
+        }
+        std::setvbuf(file_, nullptr, _IOFBF, 1 << 20);
+    }
+
+    ~SpillReader() {
+        if (file_ != nullptr) {
+            std::fclose(file_);
+        }
+    }
+
+    SpillReader(const SpillReader &) = delete;
+    SpillReader &operator=(const SpillReader &) = delete;
+
+    bool at_end() const { return position_ == block_.size() && remaining_ == 0; }
+
+    void read(void *data, size_t size) {
+        char *target = static_cast<char *>(data);
+        while (size > 0) {
+            if (position_ == block_.size()) {
+                next_block();
+            }
+            const size_t available = std::min(size, block_.size() - position_);
+            std::memcpy(target, block_.data() + position_, available);
+            position_ += available;
+            target += available;
+            size -= available;
+        }
+    }
+
+private:
+    void next_block() {
+        char header[block_header_size];
+        if (remaining_ < sizeof(header) || std::fread(header, 1, sizeof(header), file_) != sizeof(header)) {
+            throw std::runtime_error("Spill file is truncated");
+        }
+        const size_t stored_size = block_stored_size(header);
+        if (remaining_ - sizeof(header) < stored_size) {
+            throw std::runtime_error("Spill file is truncated");
+        }
+        stored_.resize(stored_size);
+        if (std::fread(&stored_[0], 1, stored_size, file_) != stored_size) {
+            throw std::runtime_error("Spill file is truncated");
+        }
+        remaining_ -= sizeof(header) + stored_size;
+        decode_block(header, stored_, block_);
+        position_ = 0;
+    }
+
+    std::FILE *file_;
+    uint64_t remaining_;
+    std::string stored_;
+    std::string block_;
+    size_t position_ = 0;
+};
+
+// Encoded bytes in memory, the stream of the messages of a distributed job
+class MessageWriter {
+public:
+    void write(const void *data, size_t size) {
+        bytes_.append(static_cast<const char *>(data), size);
+    }
+
+    uint64_t offset() const { return bytes_.size(); }
+
+    std::string &bytes() { return bytes_; }
+
+private:
+    std::string bytes_;
+};
+
+class MessageReader {
+public:
+    explicit MessageReader(std::string_view bytes) : bytes_(bytes) {}
+
+    bool at_end() const { return bytes_.empty(); }
+
+    void read(void *data, size_t size) {
+        if (size > bytes_.size()) {
+            throw std::runtime_error("Message is truncated");
+        }
+        std::memcpy(data, bytes_.data(), size);
+        bytes_.remove_prefix(size);
+    }
+
+private:
+    std::string_view bytes_;
+};
+
+template <typename T, typename = void>
+struct SpillCodec;
+
+// Largest number of bytes or values that SpillCodec allocates ahead of the input
+constexpr size_t spill_read_chunk = 64 << 10;
+
+template <typename T, typename = void>
+struct is_spillable : std::false_type {};
+
+template <typename T>
+struct is_spillable<T, std::void_t<decltype(SpillCodec<T>::read(std::declval<SpillReader &>(), std::declval<T &>()))>>
+    : std::true_type {};
+
+template <typename T>
+struct SpillCodec<T, std::enable_if_t<std::is_integral<T>::value>> {
+    template <typename Out>
+    static void write(Out &out, T value) {
+        if constexpr (std::is_signed<T>::value) {
+            const auto bits = static_cast<std::make_unsigned_t<T>>(value);
+            write_varint(out, (static_cast<uint64_t>(bits) << 1) ^ static_cast<uint64_t>(value < 0 ? -1 : 0));
+        } else {
+            write_varint(out, value);
+        }
+    }
+    template <typename In>
+    static void read(In &in, T &value) {
+        const uint64_t bits = read_varint(in);
+        if constexpr (std::is_signed<T>::value) {
+            value = static_cast<T>(static_cast<std::make_signed_t<T>>((bits >> 1) ^ (0 - (bits & 1))));
+        } else {
+            value = static_cast<T>(bits);
+        }
+    }
+};
+
+template <>
+struct SpillCodec<TermId> {
+    template <typename Out>
+    static void write(Out &out, TermId id) {
+        write_varint(out, id.value);
+    }
+    template <typename In>
+    static void read(In &in, TermId &id) {
+        id.value = static_cast<uint32_t>(read_varint(in));
+    }
+};
+
+template <typename T>
+struct SpillCodec<T, std::enable_if_t<std::is_trivially_copyable<T>::value && !std::is_integral<T>::value>> {
+    template <typename Out>
+    static void write(Out &out, const T &value) {
+        out.write(&value, sizeof(T));
+    }
+    template <typename In>
+    static void read(In &in, T &value) {
+        in.read(&value, sizeof(T));
+    }
+};
+
+template <>
+struct SpillCodec<std::string> {
+    template <typename Out>
+    static void write(Out &out, std::string_view value) {
+        write_varint(out, value.size());
+        out.write(value.data(), value.size());
+    }
+    // The string grows with the bytes that are read, so a corrupt length fails on the end of
+    // the input rather than allocating for it.  A string is written in one piece, into one
+    // block, so it is never longer than a block either.
+    template <typename In>
+    static void read(In &in, std::string &value) {
+        const uint64_t length = read_varint(in);
+        if (length > max_block_size) {
+            throw std::runtime_error("Record is corrupt");
+        }
+        value.clear();
+        while (value.size() < length) {
+            const size_t offset = value.size();
+            const size_t size = std::min<size_t>(length - offset, spill_read_chunk);
+            value.resize(offset + size);
+            in.read(&value[offset], size);
+        }
+    }
+};
+
+template <typename T>
+struct SpillCodec<std::vector<T>, std::enable_if_t<is_spillable<T>::value>> {
+    template <typename Out>
+    static void write(Out &out, const std::vector<T> &values) {
+        write_varint(out, values.size());
+        for (const T &value : values) {
+            SpillCodec<T>::write(out, value);
+        }
+    }
+    // Like a string the vector grows with the values that are read, every value takes at
+    // least one byte of the input
+    template <typename In>
+    static void read(In &in, std::vector<T> &values) {
+        const uint64_t count = read_varint(in);
+        values.clear();
+        values.reserve(static_cast<size_t>(std::min<uint64_t>(count, spill_read_chunk)));
+        for (uint64_t i = 0; i < count; ++i) {
+            values.emplace_back();
+            SpillCodec<T>::read(in, values.back());
+        }
+    }
+};
+
+// A spill file of a map thread - the records of partition p are the bytes
+// [offsets[p], offsets[p + 1]) of the file, sorted by key
+struct SpillRun {
+    std::unique_ptr<SpillFile> file;
+    std::vector<uint64_t> offsets;
+};
+
+// **************************************************************************************
+//
+// Class: MpscRing
+// Description: Bounded lock-free queue with many producers and a single consumer that
+//              connects the map threads to the reducer of one partition in a pipelined job.
+//              The ring is an array of cells that each carry a sequence number (the scheme of
+//              Dmitry Vyukov's bounded queue).  A producer claims the next position with a
+//              compare-and-swap on tail_, writes its item into the cell and publishes it by
+//              advancing the sequence number of the cell.  The consumer is the only thread that
+//              moves head_, so popping needs no atomic read-modify-write at all.
+//
+//              A full ring is the backpressure: push backs off until the consumer has made
+//              room.  An empty ring makes pop back off until an item arrives.  After close()
+//              push drops its item and returns false, and pop returns false once the ring has
+//              been drained.  close() must only be called when the producers are done, or when
+//              the consumer is gone and the items that are still pushed may be dropped.  The
+//              positions are compared by their signed difference, so they may wrap around.
+//
+// **************************************************************************************
+
+template <typename T>
+class MpscRing {
+public:
+    explicit MpscRing(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        mask_ = size - 1;
+        cells_ = std::make_unique<Cell[]>(size);
+        for (size_t i = 0; i < size; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(T item) {
+        for (Backoff backoff;; backoff.wait()) {
+            // Nobody is going to pop an item that is pushed now
+            if (closed_.load(std::memory_order_acquire)) {
+                return false;
+            }
+            size_t position = tail_.load(std::memory_order_relaxed);
+            Cell &cell = cells_[position & mask_];
+            const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            const auto difference = static_cast<std::ptrdiff_t>(sequence - position);
+            if (difference == 0) {
+                if (tail_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(item);
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            // A negative difference is a full ring, a positive one a position that another
+            // producer has taken in the meantime - either way try again
+        }
+    }
+
+    bool pop(T &item) {
+        for (Backoff backoff;; backoff.wait()) {
+            Cell &cell = cells_[head_ & mask_];
+            if (cell.sequence.load(std::memory_order_acquire) == head_ + 1) {
+                item = std::move(cell.value);
+                cell.sequence.store(head_ + mask_ + 1, std::memory_order_release);
+                ++head_;
+                return true;
+            }
+            // Every push happened before close(), check the ring once more after seeing it
+            if (closed_.load(std::memory_order_acquire) &&
+                cell.sequence.load(std::memory_order_acquire) != head_ + 1) {
+                return false;
+            }
+        }
+    }
+
+    void close() { closed_.store(true, std::memory_order_release); }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence{0};
+        T value{};
+    };
+
+    // Spin briefly and then give the processor away, a producer waiting for a reducer can
+    // wait for a full map task
+    struct Backoff {
+        unsigned rounds = 0;
+        MAPREDUCE_METRICS_ONLY(Metrics::Clock::time_point first_wait;)
+
+        ~Backoff() {
+            MAPREDUCE_METRICS_ONLY(if (rounds != 0) {
+                MAPREDUCE_COUNT(QueueWaitNs, std::chrono::duration_cast<std::chrono::nanoseconds>(Metrics::Clock::now() - first_wait).count());
+            })
+        }
+
+        void wait() {
+            MAPREDUCE_METRICS_ONLY(if (rounds == 0) { first_wait = Metrics::Clock::now(); })
+            if (++rounds < 64) {
+                std::atomic_signal_fence(std::memory_order_seq_cst);
+            } else if (rounds < 256) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_ = 0;
+    // Producers and the consumer work on different cache lines
+    alignas(64) std::atomic<size_t> tail_{0};
+    alignas(64) size_t head_ = 0;
+    std::atomic<bool> closed_{false};
+};
+
+// **************************************************************************************
+//
+// NUMA placement
+// Description: On a host with several NUMA nodes - usually one per socket - a thread reaches
+//              the memory of its own node faster than the memory of the others.  Linux puts a
+//              page on the node of the thread that touches it first, so the memory of a job
+//              is local when every table is created and filled by a thread that stays on one
+//              node.  With MapReduce::set_numa the workers of a job are pinned to cores with a
+//              ScopedPin while they run: their arenas, partition tables and reducer tables are
+//              then first touched on their own node, and every input split is handed first to
+//              a worker on the node that holds the split's pages.
+//
+//              NumaTopology reads the nodes from /sys/devices/system/node and only keeps the
+//              cores that the process may run on.  Without that information, and on other
+//              systems than Linux, all cores form a single node and nothing is pinned.
+//
+// **************************************************************************************
+
+class NumaTopology {
+public:
+    // The topology of the host, read once
+    static const NumaTopology &instance() {
+        static const NumaTopology topology;
+        return topology;
+    }
+
+    size_t num_nodes() const {
+        return nodes_.size();
+    }
+
+    // Workers are spread over the nodes round robin, so a job with fewer workers than cores
+    // still uses the memory of every node, and over the cores of a node in order
+    size_t worker_node(size_t worker) const {
+        return worker % nodes_.size();
+    }
+
+    // The core of a worker, -1 when the cores are unknown
+    int worker_cpu(size_t worker) const {
+        const std::vector<int> &cpus = nodes_[worker_node(worker)].cpus;
+        return cpus.empty() ? -1 : cpus[(worker / nodes_.size()) % cpus.size()];
+    }
+
+    // The node that holds the page of every address, num_nodes() for a page that is not
+    // resident or when the nodes are unknown
+    std::vector<size_t> page_nodes(const std::vector<const void *> &addresses) const {
+        std::vector<size_t> result(addresses.size(), nodes_.size());
+#if defined(MAPREDUCE_HAVE_NUMA)
+        if (nodes_.size() < 2 || addresses.empty()) {
+            return result;
+        }
+        // move_pages without target nodes only reports where the pages are
+        const uintptr_t page_mask = ~(static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE)) - 1);
+        std::vector<void *> pages;
+        for (const void *address : addresses) {
+            pages.push_back(reinterpret_cast<void *>(reinterpret_cast<uintptr_t>(address) & page_mask));
+        }
+        std::vector<int> status(pages.size(), -1);
+        if (::syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr, status.data(), 0) != 0) {
+            return result;
+        }
+        for (size_t i = 0; i < status.size(); ++i) {
+            for (size_t node = 0; node < nodes_.size(); ++node) {
+                if (nodes_[node].id == status[i]) {
+                    result[i] = node;
+                }
+            }
+        }
+#endif
+        return result;
+    }
+
+private:
+    struct Node {
+        int id;
+        std::vector<int> cpus;
+    };
+
+    NumaTopology() {
+#if defined(MAPREDUCE_HAVE_NUMA)
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (::sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            if (DIR *directory = ::opendir("/sys/devices/system/node")) {
+                while (const dirent *entry = ::readdir(directory)) {
+                    int id;
+                    char rest;
+                    if (std::sscanf(entry->d_name, "node%d%c", &id, &rest) != 1) {
+                        continue;
+                    }
+                    Node node{id, read_cpu_list("/sys/devices/system/node/" + std::string(entry->d_name) + "/cpulist", allowed)};
+                    // Nodes with memory but no cores of ours get no workers
+                    if (!node.cpus.empty()) {
+                        nodes_.push_back(std::move(node));
+                    }
+                }
+                ::closedir(directory);
+            }
+            std::sort(nodes_.begin(), nodes_.end(), [](const Node &a, const Node &b) { return a.id < b.id; });
+            if (nodes_.empty()) {
+                Node node{0, {}};
+                for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                    if (CPU_ISSET(cpu, &allowed)) {
+                        node.cpus.push_back(cpu);
+                    }
+                }
+                nodes_.push_back(std::move(node));
+            }
+        }
+#endif
+        if (nodes_.empty()) {
+            nodes_.push_back(Node{0, {}});
+        }
+    }
+
+#if defined(MAPREDUCE_HAVE_NUMA)
+    // Parse a list of cores like "0-3,8-11", keeping the allowed ones
+    static std::vector<int> read_cpu_list(const std::string &path, const cpu_set_t &allowed) {
+        std::vector<int> cpus;
+        FILE *file = std::fopen(path.c_str(), "r");
+        if (file == nullptr) {
+            return cpus;
+        }
+        int first;
+        while (std::fscanf(file, "%d", &first) == 1) {
+            int last = first;
+            const int separator = std::fgetc(file);
+            if (separator == '-' && std::fscanf(file, "%d", &last) == 1) {
+                std::fgetc(file);
+            }
+            for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+                if (cpu >= 0 && CPU_ISSET(cpu, &allowed)) {
+                    cpus.push_back(cpu);
+                }
+            }
+        }
+        std::fclose(file);
+        return cpus;
+    }
+#endif
+
+    std::vector<Node> nodes_;
+};
+
+// Pin the calling thread to a core for the lifetime of the object and restore its previous
+// affinity afterwards - the threads of the ThreadPool outlive the job.  A core of -1 does not
+// pin.
+class ScopedPin {
+public:
+    explicit ScopedPin(int cpu) {
+#if defined(MAPREDUCE_HAVE_NUMA)
+        if (cpu >= 0 && ::pthread_getaffinity_np(::pthread_self(), sizeof(saved_), &saved_) == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pinned_ = ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) == 0;
+        }
+#else
+        (void)cpu;
+#endif
+    }
+
+    ~ScopedPin() {
+#if defined(MAPREDUCE_HAVE_NUMA)
+        if (pinned_) {
+            ::pthread_setaffinity_np(::pthread_self(), sizeof(saved_), &saved_);
+        }
+#endif
+    }
+
+    ScopedPin(const ScopedPin &) = delete;
+    ScopedPin &operator=(const ScopedPin &) = delete;
+
+private:
+#if defined(MAPREDUCE_HAVE_NUMA)
+    cpu_set_t saved_;
+    bool pinned_ = false;
+#endif
+};
+
+// **************************************************************************************
+//
+// Class: ThreadPool
+// Description: Persistent worker threads that the jobs run on, so a program that runs many
+//              small jobs does not pay for creating and joining threads in every phase of
+//              every job.  run(count, function) calls function(i) for every i in [0, count)
+//              concurrently: the calling thread runs i = 0 itself and the other calls are
+//              handed to idle workers.  When fewer workers are idle than needed new ones are
+//              started, so every call really gets a thread of its own - the threads of a
+//              pipelined job wait for each other and would deadlock if they were queued
+//              behind each other.  A run from inside a worker works the same way.  A worker
+//              returns to the idle list when its call is done and waits there for the next one,
+//              the pool only grows to the largest number of threads that ran at once.  The
+//              workers are stopped when the program ends.
+//
+// **************************************************************************************
+
+class ThreadPool {
+public:
+    // The pool shared by all jobs of the program
+    static ThreadPool &shared() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    ThreadPool() = default;
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool() {
+        for (auto& worker : workers_) {
+            {
+                std::lock_guard<std::mutex> lock(worker->mutex);
+                worker->stop = true;
+            }
+            worker->wake.notify_one();
+            worker->thread.join();
+        }
+    }
+
+    // Call function(i) for i in [0, count) on count threads and wait for all calls.  The
+    // function must not throw, run_parallel takes care of the exceptions.
+    template <typename Function>
+    void run(size_t count, Function &function) {
+        if (count == 0) {
+            return;
+        }
+        Latch latch(count - 1);
+        const auto call = [](void *context, size_t i) { (*static_cast<Function *>(context))(i); };
+        std::vector<Worker *> chosen = acquire(count - 1);
+        for (size_t i = 0; i < chosen.size(); ++i) {
+            Worker &worker = *chosen[i];
+            {
+                std::lock_guard<std::mutex> lock(worker.mutex);
+                worker.job = Job{call, &function, i + 1, &latch};
+            }
+            worker.wake.notify_one();
+        }
+        function(0);
+        std::unique_lock<std::mutex> lock(latch.mutex);
+        latch.done.wait(lock, [&latch]() { return latch.remaining == 0; });
+    }
+
+private:
+    // Counts down the calls of a run that are still going
+    struct Latch {
+        explicit Latch(size_t count) : remaining(count) {}
+
+        size_t remaining;
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+
+    // A call of a run handed to a worker.  The function is called through a plain function
+    // pointer so handing it over allocates nothing.
+    struct Job {
+        void (*call)(void *, size_t) = nullptr;
+        void *context = nullptr;
+        size_t index = 0;
+        Latch *latch = nullptr;
+    };
+
+    struct Worker {
+        std::mutex mutex;
+        std::condition_variable wake;
+        Job job;
+        bool stop = false;
+        std::thread thread;
+    };
+
+    // Take count idle workers, starting new ones when there are not enough.  If a thread can
+    // not be started the workers taken so far go back to the idle list, and only workers
+    // with a running thread are ever added to the pool.
+    std::vector<Worker *> acquire(size_t count) {
+        std::vector<Worker *> chosen;
+        chosen.reserve(count);
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (chosen.size() < count && !idle_.empty()) {
+            chosen.push_back(idle_.back());
+            idle_.pop_back();
+        }
+        try {
+            while (chosen.size() < count) {
+                auto worker = std::make_unique<Worker>();
+                workers_.reserve(workers_.size() + 1);
+                worker->thread = std::thread([this, raw = worker.get()]() { work(*raw); });
+                chosen.push_back(worker.get());
+                workers_.push_back(std::move(worker));
+            }
+        } catch (...) {
+            idle_.insert(idle_.end(), chosen.begin(), chosen.end());
+            throw;
+        }
+        return chosen;
+    }
+
+    void work(Worker &worker) {
+        for (;;) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(worker.mutex);
+                worker.wake.wait(lock, [&worker]() { return worker.job.call != nullptr || worker.stop; });
+                if (worker.job.call == nullptr) {
+                    return;
+                }
+                job = std::exchange(worker.job, Job());
+            }
+            job.call(job.context, job.index);
+            // Become idle before the run is told that the call is done, so the next run of
+            // the same caller finds this worker in the idle list
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                idle_.push_back(&worker);
+            }
+            std::lock_guard<std::mutex> lock(job.latch->mutex);
+            if (--job.latch->remaining == 0) {
+                job.latch->done.notify_one();
+            }
+        }
+    }
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<Worker *> idle_;
+};
+
+// **************************************************************************************
+//
+// Function: run_parallel
+// Description: Run function(i) for i in [0, count) on count threads of the shared ThreadPool
+//              and wait for them.  If any of the calls throws, the first exception is rethrown
+//              once all threads are done, so errors of the worker threads reach the caller of
+//              the job.
+//
+// **************************************************************************************
+
+template <typename Function>
+void run_parallel(size_t count, Function &&function) {
+    std::vector<std::exception_ptr> errors(count);
+    auto guarded = [&function, &errors](size_t i) {
+        try {
+            function(i);
+        } catch (...) {
+            errors[i] = std::current_exception();
+        }
+    };
+    ThreadPool::shared().run(count, guarded);
+    for (auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+// **************************************************************************************
+//
+// Class: HotKeySampler
+// Description: Finds the hot keys of a map thread - the few keys that make up a large share
+//              of its records, like "the" in a word count.  One record out of interval is
+//              sampled into a Misra-Gries summary of capacity counters: a sampled key that has
+//              a counter gets it incremented, a new key takes a free counter, and when none are
+//              free every counter is decremented instead.  A counter then undercounts its key
+//              by at most samples / capacity, so every key that makes up more than
+//              1 / capacity of the samples keeps a counter.  Sampling costs the map threads
+//              one comparison with the interval per record.  Two summaries are merged by
+//              adding up their counters and taking the (capacity + 1)-th largest counter off
+//              all of them, which keeps the same bound.
+//
+// **************************************************************************************
+
+template <typename Key>
+class HotKeySampler {
+public:
+    static constexpr uint64_t interval = 64;
+    static constexpr size_t capacity = 16;
+
+    template <typename K>
+    void record(const K &key, uint64_t hash) {
+        ++records_;
+        if (++phase_ % interval != 0) {
+            return;
+        }
+        for (auto& entry : entries_) {
+            if (entry.hash == hash && entry.key == key) {
+                ++entry.count;
+                return;
+            }
+        }
+        if (entries_.size() < capacity) {
+            entries_.push_back(Entry{Key(key), hash, 1});
+            return;
+        }
+        for (auto& entry : entries_) {
+            --entry.count;
+        }
+        entries_.erase(std::remove_if(entries_.begin(), entries_.end(), [](const Entry &entry) { return entry.count == 0; }),
+                       entries_.end());
+    }
+
+    // Add the records of another sampler, the one of a speculative task once it was claimed
+    void merge(const HotKeySampler &other) {
+        records_ += other.records_;
+        for (const auto& entry : other.entries_) {
+            auto found = std::find_if(entries_.begin(), entries_.end(), [&entry](const Entry &own) {
+                return own.hash == entry.hash && own.key == entry.key;
+            });
+            if (found != entries_.end()) {
+                found->count += entry.count;
+            } else {
+                entries_.push_back(entry);
+            }
+        }
+        if (entries_.size() > capacity) {
+            std::sort(entries_.begin(), entries_.end(), [](const Entry &a, const Entry &b) { return a.count > b.count; });
+            const uint64_t cut = entries_[capacity].count;
+            entries_.resize(capacity);
+            for (auto& entry : entries_) {
+                entry.count -= cut;
+            }
+            entries_.erase(std::remove_if(entries_.begin(), entries_.end(), [](const Entry &entry) { return entry.count == 0; }),
+                           entries_.end());
+        }
+    }
+
+    // Forget the records.  The position in the sampling interval is kept, so that the short
+    // tasks of a sampler that is cleared after every task are sampled as well.
+    void clear() {
+        records_ = 0;
+        entries_.clear();
+    }
+
+    // The keys that are estimated to make up at least the given share of the records of all
+    // samplers, with their hashes, the most frequent first
+    static std::vector<std::pair<Key, uint64_t>> hot_keys(const std::vector<HotKeySampler> &samplers, double share) {
+        uint64_t records = 0;
+        std::vector<Entry> merged;
+        for (const auto& sampler : samplers) {
+            records += sampler.records_;
+            for (const auto& entry : sampler.entries_) {
+                auto found = std::find_if(merged.begin(), merged.end(), [&entry](const Entry &other) {
+                    return other.hash == entry.hash && other.key == entry.key;
+                });
+                if (found != merged.end()) {
+                    found->count += entry.count;
+                } else {
+                    merged.push_back(entry);
+                }
+            }
+        }
+        std::sort(merged.begin(), merged.end(), [](const Entry &a, const Entry &b) { return a.count > b.count; });
+        std::vector<std::pair<Key, uint64_t>> hot;
+        for (auto& entry : merged) {
+            if (static_cast<double>(entry.count * interval) >= share * static_cast<double>(records)) {
+                hot.emplace_back(std::move(entry.key), entry.hash);
+            }
+        }
+        return hot;
+    }
+
+private:
+    struct Entry {
+        Key key;
+        uint64_t hash;
+        uint64_t count;
+    };
+
+    uint64_t records_ = 0;
+    uint64_t phase_ = 0;
+    std::vector<Entry> entries_;
+};
+
+// **************************************************************************************
+//
+// Class: TopK
+// Description: Collects the results of a reducer.  With a limit of k it only keeps the k
+//              pairs with the largest values, ties going to the smaller key, in a bounded heap
+//              whose root is the worst pair kept so far - a pair that does not beat the root
+//              is rejected after one comparison, so a large partition is never sorted.  admits
+//              tells whether a pair would be kept before its key is materialized.  Without a
+//              limit every pair is kept in arrival order.
+//
+// **************************************************************************************
+
+template <typename Key, typename Value>
+class TopK {
+public:
+    using Pair = std::pair<Key, Value>;
+
+    explicit TopK(size_t limit = 0) : limit_(limit) {}
+
+    void reserve(size_t size) {
+        pairs_.reserve(limit_ == 0 ? size : std::min(size, limit_));
+    }
+
+    template <typename KeyView>
+    bool admits(const KeyView &key, const Value &value) const {
+        if (limit_ == 0 || pairs_.size() < limit_) {
+            return true;
+        }
+        const Pair &worst = pairs_.front();
+        return worst.second < value || (!(value < worst.second) && key < worst.first);
+    }
+
+    void push(Key key, Value value) {
+        if (!admits(key, value)) {
+            return;
+        }
+        if (limit_ != 0 && pairs_.size() == limit_) {
+            std::pop_heap(pairs_.begin(), pairs_.end(), better);
+            pairs_.pop_back();
+        }
+        pairs_.emplace_back(std::move(key), std::move(value));
+        if (limit_ != 0) {
+            std::push_heap(pairs_.begin(), pairs_.end(), better);
+        }
+    }
+
+    // The pairs that were kept, best first if there is a limit
+    std::vector<Pair> take() {
+        if (limit_ != 0) {
+            std::sort_heap(pairs_.begin(), pairs_.end(), better);
+        }
+        return std::move(pairs_);
+    }
+
+private:
+    static bool better(const Pair &a, const Pair &b) {
+        return b.second < a.second || (!(a.second < b.second) && a.first < b.first);
+    }
+
+    size_t limit_;
+    std::vector<Pair> pairs_;
+};
+
+// **************************************************************************************
+//
+// Function: parallel_merge
+// Description: Merge sorted runs into one sorted vector with several threads.  The output
+//              is divided into one range per thread by splitter elements that are sampled
+//              from the runs: the range of a thread holds the elements from its splitter up
+//              to the next one, which lower_bound finds in every run.  The position of a
+//              range in the output is therefore known up front, so the output is allocated
+//              once and every thread merges its slice of the runs straight into its range.
+//              The elements are moved out of the runs.
+//
+// Parameters:
+//   - runs: The runs, each sorted by less
+//   - less: The order of the runs and of the result
+//   - num_threads: Number of threads to merge with
+//
+// **************************************************************************************
+
+template <typename T, typename Less>
+std::vector<T> parallel_merge(std::vector<std::vector<T>> &runs, Less less, size_t num_threads) {
+    size_t total = 0;
+    for (const auto& run : runs) {
+        total += run.size();
+    }
+    // Small outputs are not worth the threads
+    num_threads = std::max<size_t>(1, std::min(num_threads, total / (1 << 14)));
+
+    // Sample every run evenly and take the splitters from the sorted sample
+    std::vector<const T *> sample;
+    const size_t samples_per_run = 16 * num_threads;
+    for (const auto& run : runs) {
+        for (size_t i = 0; i < samples_per_run && !run.empty(); ++i) {
+            sample.push_back(&run[i * run.size() / samples_per_run]);
+        }
+    }
+    std::sort(sample.begin(), sample.end(), [&less](const T *a, const T *b) { return less(*a, *b); });
+
+    // bounds[c][r] is where range c starts in run r, the last row holds the ends of the runs
+    std::vector<std::vector<size_t>> bounds(num_threads + 1, std::vector<size_t>(runs.size(), 0));
+    for (size_t r = 0; r < runs.size(); ++r) {
+        bounds[num_threads][r] = runs[r].size();
+    }
+    for (size_t c = 1; c < num_threads; ++c) {
+        const T &splitter = *sample[c * sample.size() / num_threads];
+        for (size_t r = 0; r < runs.size(); ++r) {
+            bounds[c][r] = static_cast<size_t>(std::lower_bound(runs[r].begin(), runs[r].end(), splitter, less) - runs[r].begin());
+        }
+    }
+
+    std::vector<T> merged(total);
+    run_parallel(num_threads, [&](size_t c) {
+        size_t output = 0;
+        for (size_t r = 0; r < runs.size(); ++r) {
+            output += bounds[c][r];
+        }
+        // Min-heap of the runs that still have elements in the range, by their next element
+        std::vector<size_t> cursors = bounds[c];
+        auto greater = [&](size_t a, size_t b) { return less(runs[b][cursors[b]], runs[a][cursors[a]]); };
+        std::vector<size_t> heap;
+        for (size_t r = 0; r < runs.size(); ++r) {
+            if (cursors[r] < bounds[c + 1][r]) {
+                heap.push_back(r);
+            }
+        }
+        std::make_heap(heap.begin(), heap.end(), greater);
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), greater);
+            const size_t r = heap.back();
+            merged[output++] = std::move(runs[r][cursors[r]++]);
+            if (cursors[r] < bounds[c + 1][r]) {
+                std::push_heap(heap.begin(), heap.end(), greater);
+            } else {
+                heap.pop_back();
+            }
+        }
+    });
+    return merged;
+}
+
+// Sort the values with several threads: every thread sorts a part of the values and the
+// sorted parts are combined with parallel_merge
+template <typename T, typename Less>
+void parallel_sort(std::vector<T> &values, Less less, size_t num_threads) {
+    num_threads = std::max<size_t>(1, std::min(num_threads, values.size() / (1 << 14)));
+    if (num_threads == 1) {
+        std::sort(values.begin(), values.end(), less);
+        return;
+    }
+    std::vector<std::vector<T>> runs(num_threads);
+    run_parallel(num_threads, [&](size_t part) {
+        auto begin = values.begin() + static_cast<std::ptrdiff_t>(part * values.size() / num_threads);
+        auto end = values.begin() + static_cast<std::ptrdiff_t>((part + 1) * values.size() / num_threads);
+        runs[part].assign(std::make_move_iterator(begin), std::make_move_iterator(end));
+        std::sort(runs[part].begin(), runs[part].end(), less);
+    });
+    values = parallel_merge(runs, less, num_threads);
+}
+
+// **************************************************************************************
+//
+// Class: SpaceSaving
+// Description: Approximate counts of the most frequent strings of a stream in a fixed
+//              amount of memory (the Space-Saving algorithm of Metwally, Agrawal and El
+//              Abbadi).  The summary keeps capacity counters.  A string that has a counter is
+//              counted exactly from then on.  A new string takes over the counter with the
+//              smallest count c and starts at c + its count, remembering c as its error.  The
+//              count of a string is therefore never too small and at most error too large, and
+//              every string that occurs more often than total / capacity times has a counter.
+//
+//              The counters form a min-heap by count so the smallest is found at the root.
+//              An index from string to counter finds the counter of a string; evicted strings
+//              stay in the index until it is rebuilt, they are recognised because their
+//              counter holds another string.
+//
+//              Summaries of different parts of the input are combined with merge: counts and
+//              errors are added, a string that a full summary does not hold gets that
+//              summary's smallest count, the most it can have been counted there.
+//
+// **************************************************************************************
+
+class SpaceSaving {
+public:
+    struct Counter {
+        std::string key;
+        uint64_t count = 0;
+        uint64_t error = 0;
+    };
+
+    explicit SpaceSaving(size_t capacity) : capacity_(std::max<size_t>(1, capacity)) {
+        counters_.reserve(capacity_);
+        heap_.reserve(capacity_);
+        positions_.reserve(capacity_);
+    }
+
+    void add(std::string_view key, uint64_t count) {
+        const uint64_t hash = hash_bytes(key);
+        uint32_t *indexed = index_.find(key, hash);
+        if (indexed != nullptr && counters_[*indexed].key == key) {
+            counters_[*indexed].count += count;
+            sift_down(positions_[*indexed]);
+            return;
+        }
+        uint32_t counter;
+        if (counters_.size() < capacity_) {
+            counter = static_cast<uint32_t>(counters_.size());
+            counters_.push_back(Counter{std::string(key), count, 0});
+            positions_.push_back(heap_.size());
+            heap_.push_back(counter);
+            sift_up(heap_.size() - 1);
+        } else {
+            counter = heap_[0];
+            Counter &evicted = counters_[counter];
+            evicted.key.assign(key.data(), key.size());
+            evicted.error = evicted.count;
+            evicted.count += count;
+            sift_down(0);
+        }
+        if (indexed != nullptr) {
+            *indexed = counter;
+        } else {
+            if (index_.size() >= 4 * capacity_) {
+                rebuild_index();
+            }
+            *index_.try_emplace(key, hash, counter).first = counter;
+        }
+    }
+
+    // Smallest count of a full summary, the most that a string without a counter can have
+    uint64_t floor() const {
+        return counters_.size() < capacity_ ? 0 : counters_[heap_[0]].count;
+    }
+
+    // Add the counters of the other summaries, see the description above
+    static std::vector<Counter> merge(std::vector<SpaceSaving> &summaries) {
+        FlatStringMap<Counter> merged;
+        for (const SpaceSaving &summary : summaries) {
+            for (const Counter &counter : summary.counters_) {
+                auto inserted = merged.try_emplace(counter.key, Counter{counter.key, 0, 0});
+                inserted.first->count += counter.count;
+                inserted.first->error += counter.error;
+            }
+        }
+        std::vector<Counter> counters;
+        counters.reserve(merged.size());
+        for (auto&& entry : merged) {
+            Counter &counter = entry.second;
+            for (SpaceSaving &summary : summaries) {
+                // The key is missing from a summary that does not have a counter for it
+                if (summary.floor() != 0 && !summary.holds(counter.key)) {
+                    counter.count += summary.floor();
+                    counter.error += summary.floor();
+                }
+            }
+            counters.push_back(std::move(counter));
+        }
+        return counters;
+    }
+
+private:
+    bool holds(std::string_view key) {
+        const uint32_t *indexed = index_.find(key);
+        return indexed != nullptr && counters_[*indexed].key == key;
+    }
+
+    void rebuild_index() {
+        index_.clear();
+        for (uint32_t counter = 0; counter < counters_.size(); ++counter) {
+            index_.try_emplace(counters_[counter].key, counter);
+        }
+    }
+
+    bool smaller(size_t a, size_t b) const {
+        return counters_[heap_[a]].count < counters_[heap_[b]].count;
+    }
+
+    void swap_entries(size_t a, size_t b) {
+        std::swap(heap_[a], heap_[b]);
+        positions_[heap_[a]] = a;
+        positions_[heap_[b]] = b;
+    }
+
+    void sift_up(size_t position) {
+        while (position > 0 && smaller(position, (position - 1) / 2)) {
+            swap_entries(position, (position - 1) / 2);
+            position = (position - 1) / 2;
+        }
+    }
+
+    void sift_down(size_t position) {
+        for (;;) {
+            size_t smallest = position;
+            const size_t left = 2 * position + 1;
+            if (left < heap_.size() && smaller(left, smallest)) {
+                smallest = left;
+            }
+            if (left + 1 < heap_.size() && smaller(left + 1, smallest)) {
+                smallest = left + 1;
+            }
+            if (smallest == position) {
+                return;
+            }
+            swap_entries(position, smallest);
+            position = smallest;
+        }
+    }
+
+    size_t capacity_;
+    std::vector<Counter> counters_;
+    // Min-heap of counter indices and the heap position of every counter
+    std::vector<uint32_t> heap_;
+    std::vector<size_t> positions_;
+    FlatStringMap<uint32_t> index_;
+};
+
+// **************************************************************************************
+//
+// Function: approximate_top_k
+// Description: Find the k most frequent words of the input approximately, without a
+//              shuffle and without tables of every distinct word.  Every map thread runs the
+//              mapper over its tasks into its own SpaceSaving summary of capacity counters,
+//              the summaries are merged at the end.  The counts are upper bounds, see
+//              SpaceSaving.
+//
+// Parameters:
+//   - input_data: The splits of the input
+//   - mapper: Mapper that emits std::string_view words with integer counts
+//   - k: Number of words to return
+//   - num_threads: Number of map threads, 0 for one per hardware thread
+//   - capacity: Number of counters of every summary
+//
+// Returns:
+//   The k words with the largest counts, in the order of TopK.
+//
+// **************************************************************************************
+
+template <typename Mapper>
+std::vector<std::pair<std::string, int>> approximate_top_k(const std::vector<std::string_view> &input_data, const Mapper &mapper,
+                                                          size_t k, size_t num_threads, size_t capacity) {
+    if (num_threads == 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    num_threads = std::max<size_t>(1, std::min(num_threads, input_data.size()));
+    std::vector<SpaceSaving> summaries;
+    for (size_t i = 0; i < num_threads; ++i) {
+        summaries.emplace_back(capacity);
+    }
+    TaskScheduler scheduler(num_threads, input_data.size());
+    run_parallel(num_threads, [&](size_t worker) {
+        Mapper thread_mapper = mapper;
+        SpaceSaving &summary = summaries[worker];
+        auto emit = [&summary](std::string_view word, int count) {
+            summary.add(word, static_cast<uint64_t>(count));
+        };
+        for (size_t task; scheduler.next(worker, task);) {
+            thread_mapper(input_data[task], emit);
+        }
+    });
+
+    TopK<std::string, int> top(k);
+    for (auto& counter : SpaceSaving::merge(summaries)) {
+        top.push(std::move(counter.key), static_cast<int>(counter.count));
+    }
+    return top.take();
+}
+
+// Inputs of a MapReduce job smaller than this run on the calling thread, see
+// MapReduce::set_inline_threshold
+constexpr size_t default_inline_threshold = 64 * 1024;
+
+// **************************************************************************************
+//
+// Class: MapReduce
+// Description: Generic MapReduce job.  The mapper, the reducer and the combiner policy are
+//              template parameters so the calls in the inner loops are resolved at compile
+//              time and inlined - no std::function or virtual call is involved.
+//
+//              In the map phase every input is a task that is scheduled on the map threads by
+//              a work stealing TaskScheduler.  Every thread applies the mapper to its tasks and
+//              shuffles the emitted pairs into its own hash partitions.  In the reduce phase
+//              one reducer thread per partition collects the partition from all map threads
+//              and applies the reducer to each key.
+//
+//              With a streaming reducer (see the reducer traits above) the values are folded
+//              on arrival: the map threads fold straight into their partitions and the
+//              reducers fold the partitions of the map threads together.  The combiner policy
+//              is not used in that case because the reducer's fold already combines the values.
+//
+//              With a memory budget (set_memory_budget) the map threads spill their sorted
+//              partitions to disk when they grow too large and the reducers merge the spill
+//              runs.  Spilling needs a SpillCodec for Key and Value and a Key that is ordered
+//              by operator<.
+//
+//              A pipelined job (set_pipelined) does not wait for the map phase to finish.  The
+//              reducers run next to the map threads and the output of every map task is sent
+//              to them in batches, see run_pipelined.
+//
+// Template parameters:
+//   - Input: Type of a single input record
+//   - Key, Value: Types of the pairs that the mapper emits
+//   - Mapper: Callable as mapper(const Input &, emit) where emit(key, const Value &) and the
+//             key is a Key or a type that Key can be constructed from.  Each map thread
+//             calls its own copy of the mapper.
+//   - Reducer: Callable as reducer(const Key &, const std::vector<Value> &) returning a Value,
+//              or a streaming reducer with an associative flag and a fold member
+//   - Combiner: Combiner policy, see NoCombiner and SumCombiner above
+//   - Hash: Hash function used for the shuffle and the partition tables
+//
+// **************************************************************************************
+
+template <typename Input, typename Key, typename Value, typename Mapper, typename Reducer,
+          typename Combiner = NoCombiner, typename Hash = std::hash<Key>>
+class MapReduce {
+public:
+    // Whether the values are folded on arrival instead of being collected in lists
+    static constexpr bool streaming = is_streaming_reducer<Reducer>::value;
+    // Hash table and hashing of the keys, see KeyTraits
+    using Traits = KeyTraits<Key, Hash>;
+    // Value that a partition holds per key - a single running value for a streaming reducer,
+    // a list of values otherwise
+    using PartitionValue = std::conditional_t<streaming, Value, std::vector<Value>>;
+    // A partition holds the intermediate values of the keys that were hashed to it
+    using Partition = typename Traits::template Table<PartitionValue>;
+    // The job returns the reduced value of every key, in no particular order
+    using Result = std::vector<std::pair<Key, Value>>;
+    // Whether the intermediate data can be written to spill files
+    static constexpr bool spillable = is_spillable<Key>::value && is_spillable<PartitionValue>::value;
+    // Whether the values of a key reach the reducer one by one, so that a hot key makes its
+    // partition the largest one by far - the other paths fold the values in the map threads
+    static constexpr bool splits_hot_keys = !streaming && !Combiner::enabled;
+    // Whether the values of a hot key can be reduced in pieces, see split_hot_keys
+    static constexpr bool chunks_hot_keys = is_splittable_reducer<Reducer>::value;
+    static_assert(!chunks_hot_keys || has_fold<Reducer, Value>::value, "A splittable reducer must provide fold");
+
+    // A thread or partition count of 0 means one per hardware thread
+    explicit MapReduce(size_t num_threads = 0, size_t num_reducers = 0, Mapper mapper = Mapper(), Reducer reducer = Reducer())
+        : num_threads_(num_threads), num_reducers_(num_reducers), mapper_(std::move(mapper)), reducer_(std::move(reducer)) {
+        // hardware_concurrency may return 0 when it can not be determined so we always use
+        // at least one thread
+        if (num_threads_ == 0) {
+            num_threads_ = std::max(1u, std::thread::hardware_concurrency());
+        }
+        if (num_reducers_ == 0) {
+            num_reducers_ = num_threads_;
+        }
+    }
+
+    // Limit the memory that the intermediate data of the map threads may use.  The budget is
+    // shared evenly by the map threads and a thread that exceeds its share after a task spills
+    // its partitions to a file in spill_directory.  A budget of 0 means no limit.
+    MapReduce &set_memory_budget(size_t bytes, std::string spill_directory, BlockCodec codec = BlockCodec::None) {
+        if (bytes != 0 && !spillable) {
+            throw std::invalid_argument("The keys and values of this job can not be spilled");
+        }
+        memory_budget_ = bytes;
+        spill_directory_ = std::move(spill_directory);
+        spill_codec_ = codec;
+        return *this;
+    }
+
+    // Overlap the map and the reduce phase, see run_pipelined.  queue_capacity is the number
+    // of batches that may wait for a reducer before the map threads are held up.
+    MapReduce &set_pipelined(bool pipelined, size_t queue_capacity = 0) {
+        pipelined_ = pipelined;
+        queue_capacity_ = queue_capacity;
+        return *this;
+    }
+
+    // Run backup copies of straggling map tasks, see TaskTracker.  Every task then maps into a
+    // table of its own which is only merged into the thread's partitions by the copy that
+    // completes first.
+    MapReduce &set_speculative(bool speculative) {
+        speculative_ = speculative;
+        return *this;
+    }
+
+    // Only return the k pairs with the largest values, ordered from the largest value down
+    // and by key for equal values, see TopK.  0 returns all pairs.
+    MapReduce &set_top_k(size_t k) {
+        top_k_ = k;
+        return *this;
+    }
+
+    // Return the pairs ordered by key.  Every reducer sorts its own partition and the sorted
+    // partitions are combined with parallel_merge, so no single thread sorts all results.
+    // Does not apply together with set_top_k.
+    MapReduce &set_sorted(bool sorted) {
+        sorted_ = sorted;
+        return *this;
+    }
+
+    // Reduce the hot keys of a job without a combiner as reduce tasks of their own, see
+    // split_hot_keys.  On by default.
+    MapReduce &set_hot_keys(bool hot_keys) {
+        hot_keys_ = hot_keys;
+        return *this;
+    }
+
+    // Pin the workers to cores and place their memory and input splits on their NUMA node,
+    // see NUMA placement
+    MapReduce &set_numa(bool numa) {
+        numa_ = numa;
+        return *this;
+    }
+
+    // Run inputs of fewer than bytes bytes in total on the calling thread alone: one map
+    // thread and the reducers one after the other, pipelined or not.  For a small input the
+    // hand-offs between threads cost more than the parallel work saves.  Only inputs with a
+    // size() member, such as std::string_view, are measured, others always run in parallel.
+    // 0 turns the fast path off.
+    MapReduce &set_inline_threshold(size_t bytes) {
+        inline_threshold_ = bytes;
+        return *this;
+    }
+
+    // Run the job over the provided inputs and return the reduced results
+    Result run(const std::vector<Input> &input_data) const {
+        const bool run_inline = input_bytes(input_data) < inline_threshold_;
+        if (pipelined_ && !run_inline) {
+            return run_pipelined(input_data);
+        }
+
+        // There is no point in starting more map threads than there are inputs
+        const size_t num_map_threads = run_inline ? 1 : std::max<size_t>(1, std::min(num_threads_, input_data.size()));
+
+        // The partitions of every map thread - map_partitions[i][p] holds the values that
+        // thread i produced for the keys of partition p.  The partitions of a thread allocate
+        // from the thread's arena, the arenas are released in one shot when the job is done.
+        // Every thread creates its own partitions so their memory is first touched by it.
+        std::vector<std::unique_ptr<Arena>> map_arenas;
+        for (size_t i = 0; i < num_map_threads; ++i) {
+            map_arenas.push_back(std::make_unique<Arena>());
+        }
+        std::vector<std::vector<Partition>> map_partitions(num_map_threads);
+        // The spill files written by every map thread
+        std::vector<std::vector<SpillRun>> map_runs(num_map_threads);
+        // The hot keys of every map thread, see split_hot_keys
+        std::vector<HotKeySampler<Key>> samplers(num_map_threads);
+        const bool sample = splits_hot_keys && hot_keys_ && !run_inline && num_reducers_ > 1;
+
+        // Run the map threads, they take their tasks from the scheduler until none are left.
+        // run_parallel waits for all of them before we move to the reduce phase.
+        const bool numa = numa_ && !run_inline;
+        std::unique_ptr<TaskTracker> tracker = make_tracker(input_data.size());
+        TaskScheduler scheduler(num_map_threads, numa ? route_splits(input_data, num_map_threads)
+                                                      : TaskScheduler::block_owners(num_map_threads, input_data.size()), tracker.get());
+        {
+            MAPREDUCE_SPAN("map phase");
+            // The time between the end of a map thread and the end of the phase is spent
+            // waiting at the barrier
+            MAPREDUCE_METRICS_ONLY(std::vector<Metrics::Clock::time_point> map_ends(num_map_threads);)
+            run_parallel(num_map_threads, [&](size_t i) {
+                ScopedPin pin(numa ? NumaTopology::instance().worker_cpu(i) : -1);
+                try {
+                    map_partitions[i] = make_partitions(map_arenas[i].get());
+                    map_worker(scheduler, i, input_data, map_partitions[i], *map_arenas[i], map_runs[i],
+                               sample ? &samplers[i] : nullptr);
+                } catch (...) {
+                    scheduler.abort();
+                    throw;
+                }
+                MAPREDUCE_METRICS_ONLY(map_ends[i] = Metrics::Clock::now();)
+            });
+            MAPREDUCE_METRICS_ONLY(
+                const auto phase_end = Metrics::Clock::now();
+                for (const auto& map_end : map_ends) {
+                    MAPREDUCE_COUNT(BarrierWaitNs, std::chrono::duration_cast<std::chrono::nanoseconds>(phase_end - map_end).count());
+                })
+        }
+
+        // Take the hot keys out of their partitions, they are reduced as tasks of their own
+        std::vector<HotKey> hot_keys;
+        bool spilled = false;
+        for (const auto& runs : map_runs) {
+            spilled |= !runs.empty();
+        }
+        if constexpr (splits_hot_keys) {
+            if (sample && !spilled) {
+                hot_keys = split_hot_keys(samplers, map_partitions);
+            }
+        }
+
+        // Run one reducer thread per partition so every partition is reduced in parallel.  The
+        // pieces of the hot keys come first, so a partition never waits behind the hot key that
+        // it lost.
+        std::vector<Result> partition_results(num_reducers_);
+        const std::vector<HotChunk> hot_chunks = chunk_hot_keys(hot_keys);
+        // Optional so that Value needs no default constructor
+        std::vector<std::optional<Value>> hot_partials(hot_chunks.size());
+        {
+            MAPREDUCE_SPAN("reduce phase");
+            const size_t num_tasks = hot_chunks.size() + num_reducers_;
+            auto reduce = [&](size_t t) {
+                if (t < hot_chunks.size()) {
+                    hot_partials[t] = reduce_hot_chunk(hot_keys, hot_chunks[t]);
+                } else {
+                    const size_t p = t - hot_chunks.size();
+                    reduce_worker(map_partitions, map_runs, p, partition_results[p]);
+                    sort_partition(partition_results[p]);
+                }
+            };
+            if (run_inline) {
+                for (size_t t = 0; t < num_tasks; ++t) {
+                    reduce(t);
+                }
+            } else {
+                std::atomic<size_t> next_task{0};
+                run_parallel(num_reducers_, [&](size_t thread) {
+                    ScopedPin pin(numa ? NumaTopology::instance().worker_cpu(thread) : -1);
+                    for (size_t t; (t = next_task.fetch_add(1)) < num_tasks;) {
+                        reduce(t);
+                    }
+                });
+            }
+        }
+        Result hot_results = combine_hot_chunks(hot_keys, hot_chunks, hot_partials);
+        if (!hot_results.empty()) {
+            // The results of the hot keys are one more partition for concatenate
+            sort_partition(hot_results);
+            partition_results.push_back(std::move(hot_results));
+        }
+
+        return concatenate(partition_results);
+    }
+
+private:
+    // Batch of the output of one map task for one partition, sent to the reducer of a
+    // pipelined job
+    using Batch = std::vector<std::pair<Key, PartitionValue>>;
+
+    // **********************************************************************************
+    //
+    // Function: run_pipelined
+    // Description: Run the job with the map and the reduce phase overlapped.  Every reducer
+    //              partition gets an MpscRing and a reducer thread that consumes it while the
+    //              map threads are still running.  After each task a map thread moves the
+    //              contents of its partitions into one batch per partition, sends the batches to
+    //              the reducers and resets its arena, so a map thread only ever holds the output
+    //              of a single task.  When the last map thread is done the queues are closed and
+    //              the reducers finish their partitions.  The memory budget does not apply, the
+    //              intermediate data is not kept on the map side.
+    //
+    // **********************************************************************************
+
+    Result run_pipelined(const std::vector<Input> &input_data) const {
+        const size_t num_map_threads = std::max<size_t>(1, std::min(num_threads_, input_data.size()));
+        const size_t capacity = queue_capacity_ != 0 ? queue_capacity_ : 2 * num_map_threads;
+        std::vector<std::unique_ptr<MpscRing<Batch>>> queues;
+        for (size_t p = 0; p < num_reducers_; ++p) {
+            queues.push_back(std::make_unique<MpscRing<Batch>>(capacity));
+        }
+        auto close_queues = [&queues]() {
+            for (auto& queue : queues) {
+                queue->close();
+            }
+        };
+
+        MAPREDUCE_SPAN("pipelined phase");
+        std::unique_ptr<TaskTracker> tracker = make_tracker(input_data.size());
+        TaskScheduler scheduler(num_map_threads, numa_ ? route_splits(input_data, num_map_threads)
+                                                       : TaskScheduler::block_owners(num_map_threads, input_data.size()), tracker.get());
+        std::atomic<size_t> running_map_threads{num_map_threads};
+        std::vector<Result> partition_results(num_reducers_);
+        run_parallel(num_map_threads + num_reducers_, [&](size_t i) {
+            // The map threads and the reducers run side by side, so they are all spread over
+            // the cores
+            ScopedPin pin(numa_ ? NumaTopology::instance().worker_cpu(i) : -1);
+            if (i < num_map_threads) {
+                // The last map thread to finish closes the queues, also when it fails
+                struct Done {
+                    std::atomic<size_t> &running;
+                    decltype(close_queues) &close;
+                    ~Done() {
+                        if (running.fetch_sub(1) == 1) {
+                            close();
+                        }
+                    }
+                } done{running_map_threads, close_queues};
+                try {
+                    pipelined_map_worker(scheduler, i, input_data, queues);
+                } catch (...) {
+                    scheduler.abort();
+                    throw;
+                }
+            } else {
+                const size_t p = i - num_map_threads;
+                try {
+                    pipelined_reduce_worker(*queues[p], p, partition_results[p]);
+                    sort_partition(partition_results[p]);
+                } catch (...) {
+                    // Do not leave the map threads waiting for a reducer that is gone
+                    close_queues();
+                    throw;
+                }
+            }
+        });
+
+        return concatenate(partition_results);
+    }
+
+    void pipelined_map_worker(TaskScheduler &scheduler, size_t worker, const std::vector<Input> &input_data,
+                              std::vector<std::unique_ptr<MpscRing<Batch>>> &queues) const {
+        Mapper mapper = mapper_;
+        Arena arena;
+        std::vector<Partition> partitions = make_partitions(&arena);
+        std::vector<typename Traits::template Table<Value>> local_results;
+        if constexpr (!streaming && Combiner::enabled) {
+            local_results = make_local_tables(&arena);
+        }
+
+        TaskTracker *tracker = scheduler.tracker();
+        size_t task;
+        MAPREDUCE_METRICS_ONLY(uint64_t records = 0;)
+        auto emit = [&](const auto &emitted_key, const Value &value) {
+            MAPREDUCE_METRICS_ONLY(++records;)
+            if (tracker != nullptr && tracker->done(task)) {
+                throw TaskAbandoned();
+            }
+            const auto &key = Traits::lookup_key(emitted_key);
+            const uint64_t hash = Traits::hash(key);
+            if constexpr (streaming) {
+                Traits::upsert(partitions[partition_for(hash)], key, hash, value, fold());
+            } else if constexpr (Combiner::enabled) {
+                Traits::upsert(local_results[partition_for(hash)], key, hash, value,
+                               [](Value &accumulator, const Value &other) { Combiner::combine(accumulator, other); });
+            } else {
+                Traits::at(partitions[partition_for(hash)], key, hash).push_back(value);
+            }
+        };
+
+        while (scheduler.next(worker, task)) {
+            MAPREDUCE_SPAN("map task");
+            MAPREDUCE_COUNT(MapTasks, 1);
+            // The output of a task is its own until it is sent, so a copy of a speculative
+            // task that loses simply drops it
+            bool claimed = false;
+            try {
+                mapper(input_data[task], emit);
+                claimed = scheduler.claim(task);
+            } catch (const TaskAbandoned &) {
+            }
+            hand_over(local_results, partitions);
+
+            // Send the output of the task to the reducers
+            for (size_t p = 0; claimed && p < partitions.size(); ++p) {
+                if (partitions[p].size() == 0) {
+                    continue;
+                }
+                Batch batch;
+                batch.reserve(partitions[p].size());
+                for (auto&& entry : partitions[p]) {
+                    batch.emplace_back(Key(entry.first), std::move(entry.second));
+                }
+                if (!queues[p]->push(std::move(batch))) {
+                    return;
+                }
+            }
+
+            // Start the next task with empty tables and an empty arena
+            local_results.clear();
+            partitions.clear();
+            arena.release();
+            partitions = make_partitions(&arena);
+            if constexpr (!streaming && Combiner::enabled) {
+                local_results = make_local_tables(&arena);
+            }
+        }
+        MAPREDUCE_COUNT(Records, records);
+    }
+
+    void pipelined_reduce_worker(MpscRing<Batch> &queue, size_t partition, Result &partition_result) const {
+        MAPREDUCE_SPAN("pipelined reduce partition");
+        Arena arena;
+        Partition values = make_partition(&arena, partition);
+        for (Batch batch; queue.pop(batch);) {
+            for (auto& entry : batch) {
+                absorb(values, Traits::lookup_key(entry.first), entry.second);
+            }
+        }
+        finish(values, partition_result);
+    }
+
+    // Concatenate the results of all partitions, or pick the top k pairs of the top k
+    // pairs of every partition
+    Result concatenate(std::vector<Result> &partition_results) const {
+        if (top_k_ != 0) {
+            TopK<Key, Value> top(top_k_);
+            for (auto& partition_result : partition_results) {
+                for (auto& pair : partition_result) {
+                    top.push(std::move(pair.first), std::move(pair.second));
+                }
+            }
+            return top.take();
+        }
+        if (sorted_) {
+            return parallel_merge(partition_results, key_less, num_threads_);
+        }
+        Result result;
+        for (auto& partition_result : partition_results) {
+            std::move(partition_result.begin(), partition_result.end(), std::back_inserter(result));
+        }
+        return result;
+    }
+
+    // The total size of the inputs, or the largest size_t when the inputs have no size
+    template <typename T>
+    static auto input_size(const T &input, int) -> decltype(static_cast<size_t>(input.size())) {
+        return static_cast<size_t>(input.size());
+    }
+
+    template <typename T>
+    static size_t input_size(const T &, long) {
+        return std::numeric_limits<size_t>::max();
+    }
+
+    static size_t input_bytes(const std::vector<Input> &input_data) {
+        size_t total = 0;
+        for (const auto& input : input_data) {
+            const size_t size = input_size(input, 0);
+            if (size > std::numeric_limits<size_t>::max() - total) {
+                return std::numeric_limits<size_t>::max();
+            }
+            total += size;
+        }
+        return total;
+    }
+
+    // The address of the data of an input, nullptr when the inputs have no data()
+    template <typename T>
+    static auto input_address(const T &input, int) -> decltype(static_cast<const void *>(input.data())) {
+        return static_cast<const void *>(input.data());
+    }
+
+    template <typename T>
+    static const void *input_address(const T &, long) {
+        return nullptr;
+    }
+
+    // Choose the map thread that starts with each split: a thread on the NUMA node that holds
+    // the first page of the split, taking turns among the threads of the node.  Splits whose
+    // node is not known keep their place of TaskScheduler::block_owners.  Stealing still
+    // balances the threads when the splits are unevenly spread over the nodes.
+    std::vector<size_t> route_splits(const std::vector<Input> &input_data, size_t num_workers) const {
+        std::vector<size_t> owners = TaskScheduler::block_owners(num_workers, input_data.size());
+        const NumaTopology &topology = NumaTopology::instance();
+        std::vector<const void *> addresses;
+        for (const auto& input : input_data) {
+            addresses.push_back(input_address(input, 0));
+        }
+        const std::vector<size_t> nodes = topology.page_nodes(addresses);
+        // The workers of node n are n, n + num_nodes, ..., see NumaTopology::worker_node
+        std::vector<size_t> turns(topology.num_nodes(), 0);
+        for (size_t task = 0; task < input_data.size(); ++task) {
+            const size_t node = nodes[task];
+            if (addresses[task] == nullptr || node >= topology.num_nodes() || node >= num_workers) {
+                continue;
+            }
+            const size_t node_workers = (num_workers - node + topology.num_nodes() - 1) / topology.num_nodes();
+            owners[task] = node + (turns[node]++ % node_workers) * topology.num_nodes();
+        }
+        return owners;
+    }
+
+    static bool key_less(const std::pair<Key, Value> &a, const std::pair<Key, Value> &b) {
+        return a.first < b.first;
+    }
+
+    void sort_partition(Result &partition_result) const {
+        if (sorted_ && top_k_ == 0) {
+            std::sort(partition_result.begin(), partition_result.end(), key_less);
+        }
+    }
+
+    std::unique_ptr<TaskTracker> make_tracker(size_t num_tasks) const {
+        return speculative_ ? std::make_unique<TaskTracker>(num_tasks) : nullptr;
+    }
+
+    // Key of the entries when iterating over a table - a view for string keys
+    using KeyView = std::decay_t<decltype(Traits::lookup_key(std::declval<const Key &>()))>;
+    // Entries of a partition sorted by key, used to spill a partition and to merge it with runs
+    using SortedEntries = std::vector<std::pair<KeyView, PartitionValue *>>;
+
+    // **********************************************************************************
+    //
+    // Function: partition_for
+    // Description: The shuffle stage assigns every key to one of the reducer partitions by
+    //              hashing it.  Every occurence of the same key is hashed to the same partition
+    //              so each partition can be reduced without looking at the other partitions.
+    //              How a hash is turned into a partition is decided by KeyTraits.
+    //
+    // **********************************************************************************
+
+    size_t partition_for(uint64_t hash) const {
+        return Traits::partition(hash, num_reducers_);
+    }
+
+    // **********************************************************************************
+    //
+    // Function: map_worker
+    // Description: Applies the mapper to the inputs that the scheduler hands to this worker.
+    //              Without a combiner each emitted pair is pushed into the partition that owns
+    //              the key.  With a combiner the values are first folded into local tables which
+    //              are handed over to the partitions once all tasks have been processed, so the
+    //              reducers receive a single value per key from each thread.  Every thread has
+    //              its own partitions so no lock is needed to update them.
+    //
+    //              With a memory budget the thread checks the size of its intermediate data
+    //              after every task and spills it once it is above the thread's share.
+    //
+    // **********************************************************************************
+
+    void map_worker(TaskScheduler &scheduler, size_t worker, const std::vector<Input> &input_data,
+                    std::vector<Partition> &partitions, Arena &arena, std::vector<SpillRun> &runs,
+                    HotKeySampler<Key> *sampler) const {
+        // Every thread works on its own copy of the mapper, so a mapper can keep per-thread state
+        Mapper mapper = mapper_;
+        const size_t budget = memory_budget_ / std::max<size_t>(1, scheduler.num_workers());
+
+        // Local tables of the combiner and the bytes of the value lists, which do not live in
+        // the arena
+        std::vector<typename Traits::template Table<Value>> local_results;
+        size_t list_bytes = 0;
+        if constexpr (!streaming && Combiner::enabled) {
+            local_results = make_local_tables(&arena);
+        }
+
+        // With speculative execution a task maps into tables of its own in a separate arena,
+        // which are merged into the partitions once the task has been claimed
+        TaskTracker *tracker = scheduler.tracker();
+        Arena task_arena;
+        std::vector<Partition> task_partitions;
+        std::vector<typename Traits::template Table<Value>> task_results;
+        auto reset_task_tables = [&]() {
+            task_results.clear();
+            task_partitions.clear();
+            task_arena.release();
+            task_partitions = make_partitions(&task_arena);
+            if constexpr (!streaming && Combiner::enabled) {
+                task_results = make_local_tables(&task_arena);
+            }
+        };
+        if (tracker != nullptr) {
+            reset_task_tables();
+        }
+        std::vector<Partition> &targets = tracker != nullptr ? task_partitions : partitions;
+        std::vector<typename Traits::template Table<Value>> &target_results = tracker != nullptr ? task_results : local_results;
+        // The samples of a task are kept apart in the same way, a copy that is abandoned or
+        // loses the claim must not count its keys a second time
+        HotKeySampler<Key> task_sampler;
+        HotKeySampler<Key> *target_sampler = tracker != nullptr && sampler != nullptr ? &task_sampler : sampler;
+        // And so are the bytes of its value lists, they only count once the task is claimed
+        size_t task_list_bytes = 0;
+        size_t &target_list_bytes = tracker != nullptr ? task_list_bytes : list_bytes;
+
+        size_t task;
+        MAPREDUCE_METRICS_ONLY(uint64_t records = 0;)
+        auto emit = [&](const auto &emitted_key, const Value &value) {
+            MAPREDUCE_METRICS_ONLY(++records;)
+            if (tracker != nullptr && tracker->done(task)) {
+                throw TaskAbandoned();
+            }
+            const auto &key = Traits::lookup_key(emitted_key);
+            const uint64_t hash = Traits::hash(key);
+            if constexpr (streaming) {
+                // Fold every emitted value straight into the running value of its key
+                Traits::upsert(targets[partition_for(hash)], key, hash, value, fold());
+            } else if constexpr (Combiner::enabled) {
+                Traits::upsert(target_results[partition_for(hash)], key, hash, value,
+                               [](Value &accumulator, const Value &other) { Combiner::combine(accumulator, other); });
+            } else {
+                Traits::at(targets[partition_for(hash)], key, hash).push_back(value);
+                target_list_bytes += sizeof(Value);
+                if (target_sampler != nullptr) {
+                    target_sampler->record(key, hash);
+                }
+            }
+        };
+
+        while (scheduler.next(worker, task)) {
+            MAPREDUCE_SPAN("map task");
+            MAPREDUCE_COUNT(MapTasks, 1);
+            if (tracker == nullptr) {
+                mapper(input_data[task], emit);
+            } else {
+                bool claimed = false;
+                try {
+                    mapper(input_data[task], emit);
+                    claimed = scheduler.claim(task);
+                } catch (const TaskAbandoned &) {
+                }
+                if (claimed) {
+                    if (sampler != nullptr) {
+                        sampler->merge(task_sampler);
+                    }
+                    hand_over(task_results, task_partitions);
+                    for (size_t p = 0; p < partitions.size(); ++p) {
+                        for (auto&& entry : task_partitions[p]) {
+                            absorb(partitions[p], entry.first, entry.second);
+                        }
+                    }
+                    list_bytes += task_list_bytes;
+                }
+                reset_task_tables();
+                task_sampler.clear();
+                task_list_bytes = 0;
+            }
+            if constexpr (spillable) {
+                // The tables of a task keep their arena between the tasks
+                if (budget != 0 && arena.bytes_reserved() + task_arena.bytes_reserved() + list_bytes > budget) {
+                    hand_over(local_results, partitions);
+                    MAPREDUCE_SPAN("spill");
+                    runs.push_back(spill(partitions));
+                    // Everything is on disk now - drop the tables and the arena in one shot
+                    local_results.clear();
+                    partitions.clear();
+                    arena.release();
+                    list_bytes = 0;
+                    partitions = make_partitions(&arena);
+                    if constexpr (!streaming && Combiner::enabled) {
+                        local_results = make_local_tables(&arena);
+                    }
+                }
+            }
+        }
+        hand_over(local_results, partitions);
+        MAPREDUCE_COUNT(Records, records);
+    }
+
+    // A hot key with the value lists that the map threads collected for it
+    struct HotKey {
+        Key key;
+        std::vector<std::vector<Value>> lists;
+    };
+
+    // A reduce task of a hot key: the values [begin, end) of one of its lists, or all of its
+    // values when whole is set
+    struct HotChunk {
+        size_t key;
+        size_t list;
+        size_t begin;
+        size_t end;
+        bool whole;
+    };
+
+    // Fewest values of a piece of a hot key, below that the reduce calls cost more than they save
+    static constexpr size_t min_hot_chunk = 4096;
+
+    // **********************************************************************************
+    //
+    // Function: split_hot_keys
+    // Description: Without a combiner every value of a key travels to its reducer, so the
+    //              partition of a key like "the" has far more values to reduce than the
+    //              others and its reducer finishes last.  The keys that the samplers of the
+    //              map threads estimate at more than half the size of an average partition are
+    //              taken out of their partitions here - their value lists are moved out of the
+    //              tables of the map threads, so the reducer of the partition skips them -
+    //              and each one becomes a reduce task of its own that runs next to the
+    //              partitions.  A very hot key can still have more values than a whole
+    //              partition.  When the reducer is splittable (see Reducer traits) its values are
+    //              cut into one piece per reduce thread, each piece is a reduce task of its own
+    //              and the results of the pieces are folded into the value of the key.  Other
+    //              reducers get all the values of a key in a single call.
+    //
+    // **********************************************************************************
+
+    std::vector<HotKey> split_hot_keys(const std::vector<HotKeySampler<Key>> &samplers,
+                                       std::vector<std::vector<Partition>> &map_partitions) const {
+        std::vector<HotKey> hot_keys;
+        for (auto& hot : HotKeySampler<Key>::hot_keys(samplers, 0.5 / static_cast<double>(num_reducers_))) {
+            const size_t p = partition_for(hot.second);
+            HotKey hot_key{std::move(hot.first), {}};
+            // The map threads are done, so their tables can be grown here
+            for (auto& thread_partitions : map_partitions) {
+                std::vector<Value> &list = Traits::at(thread_partitions[p], hot_key.key, hot.second);
+                if (!list.empty()) {
+                    hot_key.lists.push_back(std::move(list));
+                    list.clear();
+                }
+            }
+            hot_keys.push_back(std::move(hot_key));
+        }
+        return hot_keys;
+    }
+
+    // Cut the hot keys into their reduce tasks, see split_hot_keys
+    std::vector<HotChunk> chunk_hot_keys(const std::vector<HotKey> &hot_keys) const {
+        std::vector<HotChunk> chunks;
+        for (size_t k = 0; k < hot_keys.size(); ++k) {
+            const size_t first = chunks.size();
+            if constexpr (chunks_hot_keys) {
+                size_t size = 0;
+                for (const auto& list : hot_keys[k].lists) {
+                    size += list.size();
+                }
+                const size_t piece = std::max(min_hot_chunk, (size + num_reducers_ - 1) / num_reducers_);
+                for (size_t l = 0; l < hot_keys[k].lists.size(); ++l) {
+                    const size_t list_size = hot_keys[k].lists[l].size();
+                    for (size_t begin = 0; begin < list_size; begin += piece) {
+                        chunks.push_back({k, l, begin, std::min(begin + piece, list_size), false});
+                    }
+                }
+            }
+            if (chunks.size() == first) {
+                chunks.push_back({k, 0, 0, 0, true});
+            }
+        }
+        return chunks;
+    }
+
+    // Reduce one piece of a hot key.  Every piece is reduced by one thread, the pieces only
+    // share the lists that they read, each its own range.
+    Value reduce_hot_chunk(std::vector<HotKey> &hot_keys, const HotChunk &chunk) const {
+        MAPREDUCE_SPAN("reduce hot key");
+        HotKey &hot_key = hot_keys[chunk.key];
+        std::vector<Value> values;
+        if (chunk.whole) {
+            size_t size = 0;
+            for (const auto& list : hot_key.lists) {
+                size += list.size();
+            }
+            values.reserve(size);
+            for (auto& list : hot_key.lists) {
+                std::move(list.begin(), list.end(), std::back_inserter(values));
+            }
+        } else {
+            auto &list = hot_key.lists[chunk.list];
+            values.assign(std::make_move_iterator(list.begin() + static_cast<std::ptrdiff_t>(chunk.begin)),
+                          std::make_move_iterator(list.begin() + static_cast<std::ptrdiff_t>(chunk.end)));
+        }
+        return reducer_(hot_key.key, values);
+    }
+
+    // Fold the results of the pieces of every hot key into the value of the key
+    Result combine_hot_chunks(std::vector<HotKey> &hot_keys, const std::vector<HotChunk> &chunks,
+                              std::vector<std::optional<Value>> &partials) const {
+        // The pieces of a key are next to each other and the keys are in order
+        Result results;
+        results.reserve(hot_keys.size());
+        for (size_t c = 0; c < chunks.size(); ++c) {
+            if (c == 0 || chunks[c - 1].key != chunks[c].key) {
+                results.emplace_back(std::move(hot_keys[chunks[c].key].key), std::move(*partials[c]));
+            } else if constexpr (chunks_hot_keys) {
+                reducer_.fold(results.back().second, *partials[c]);
+            }
+        }
+        return results;
+    }
+
+    // Move the combined values of the local tables into the partitions
+    void hand_over(std::vector<typename Traits::template Table<Value>> &local_results, std::vector<Partition> &partitions) const {
+        if constexpr (!streaming && Combiner::enabled) {
+            for (size_t p = 0; p < local_results.size(); ++p) {
+                for (auto &&entry : local_results[p]) {
+                    Traits::at(partitions[p], entry.first, Traits::hash(entry.first)).push_back(std::move(entry.second));
+                }
+                local_results[p].clear();
+            }
+        }
+    }
+
+    // **********************************************************************************
+    //
+    // Function: spill
+    // Description: Write the partitions of a map thread to a new spill file.  The entries of
+    //              every partition are sorted by key so that the reducers can merge the runs.
+    //
+    // **********************************************************************************
+
+    SpillRun spill(std::vector<Partition> &partitions) const {
+        SpillRun run;
+        if constexpr (spillable) {
+            run.file = std::make_unique<SpillFile>(spill_directory_);
+            SpillWriter writer(run.file->path(), spill_codec_);
+            for (Partition &partition : partitions) {
+                run.offsets.push_back(writer.end_block());
+                for (const auto &entry : sorted_entries(partition)) {
+                    SpillCodec<Key>::write(writer, entry.first);
+                    SpillCodec<PartitionValue>::write(writer, *entry.second);
+                }
+            }
+            run.offsets.push_back(writer.end_block());
+            writer.close();
+            MAPREDUCE_COUNT(SpillRuns, 1);
+            MAPREDUCE_COUNT(SpillBytes, run.offsets.back());
+        }
+        return run;
+    }
+
+    static SortedEntries sorted_entries(Partition &partition) {
+        SortedEntries entries;
+        entries.reserve(partition.size());
+        for (auto &&entry : partition) {
+            entries.emplace_back(entry.first, &entry.second);
+        }
+        std::sort(entries.begin(), entries.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+        return entries;
+    }
+
+    // **********************************************************************************
+    //
+    // Function: reduce_worker
+    // Description: Owns one reducer partition.  It collects the values that every map thread
+    //              produced for the partition and applies the reducer to the values of each key.
+    //              If the map threads spilled, the partition is reduced by merge_reduce instead.
+    //
+    // **********************************************************************************
+
+    void reduce_worker(std::vector<std::vector<Partition>> &map_partitions, std::vector<std::vector<SpillRun>> &map_runs,
+                       size_t partition, Result &partition_result) const {
+        MAPREDUCE_SPAN("reduce partition");
+        for (const auto& runs : map_runs) {
+            if (!runs.empty()) {
+                merge_reduce(map_partitions, map_runs, partition, partition_result);
+                return;
+            }
+        }
+
+        // The merged table of the partition lives in an arena of this reducer - the tables of
+        // the map threads must not be grown here because their arenas are not thread safe.
+        // It is sized for the largest of the tables to avoid growing it step by step.
+        Arena arena;
+        Partition values = make_partition(&arena, partition);
+        size_t largest = 0;
+        for (auto& thread_partitions : map_partitions) {
+            largest = std::max(largest, thread_partitions[partition].size());
+        }
+        values.reserve(largest);
+
+        // Fold (or collect) the values of all map threads together and reduce them
+        for (auto& thread_partitions : map_partitions) {
+            Partition &input = thread_partitions[partition];
+            for (auto&& entry : input) {
+                absorb(values, entry.first, entry.second);
+            }
+            input.clear();
+        }
+        finish(values, partition_result);
+    }
+
+    // Fold the value of a key into the merged table of a reducer - or append the values to
+    // the list of the key for the list based path
+    template <typename K>
+    void absorb(Partition &values, const K &key, PartitionValue &value) const {
+        if constexpr (streaming) {
+            Traits::upsert(values, key, Traits::hash(key), value, fold());
+        } else {
+            std::vector<Value> &target = Traits::at(values, key, Traits::hash(key));
+            std::move(value.begin(), value.end(), std::back_inserter(target));
+        }
+    }
+
+    // Turn the merged table of a reducer into the result of the partition - for a streaming
+    // reducer the folded values are the results, otherwise the reducer is applied to the list
+    // of every key
+    void finish(Partition &values, Result &partition_result) const {
+        TopK<Key, Value> top(top_k_);
+        top.reserve(values.size());
+        for (auto&& entry : values) {
+            if constexpr (streaming) {
+                // Skip the copy of the key for a pair that does not make it into the top k
+                if (top.admits(entry.first, entry.second)) {
+                    top.push(Key(entry.first), std::move(entry.second));
+                }
+            } else if (!entry.second.empty()) {
+                // A key without values was taken out as a hot key, see split_hot_keys
+                Key key(entry.first);
+                Value reduced = reducer_(key, entry.second);
+                top.push(std::move(key), std::move(reduced));
+            }
+        }
+        partition_result = top.take();
+    }
+
+    // One sorted input of merge_reduce: the records of a spill run, or the in-memory entries
+    // of a map thread's partition
+    struct MergeSource {
+        std::unique_ptr<SpillReader> reader;
+        SortedEntries entries;
+        size_t position = 0;
+        Key key{};
+        PartitionValue value{};
+
+        // Advance to the next record, returns false once the source is exhausted
+        bool next() {
+            if constexpr (spillable) {
+                if (reader) {
+                    if (reader->at_end()) {
+                        return false;
+                    }
+                    SpillCodec<Key>::read(*reader, key);
+                    SpillCodec<PartitionValue>::read(*reader, value);
+                    return true;
+                }
+            }
+            if (position == entries.size()) {
+                return false;
+            }
+            key = Key(entries[position].first);
+            value = std::move(*entries[position].second);
+            ++position;
+            return true;
+        }
+    };
+
+    // **********************************************************************************
+    //
+    // Function: merge_reduce
+    // Description: Reduce a partition after the map threads spilled.  The spill runs and the
+    //              in-memory remainder of every map thread are all sorted by key, so a k-way
+    //              merge over them meets the values of a key one after the other.  The values of
+    //              the current key are folded (or collected) and reduced as soon as the next key
+    //              comes up, so only one key is held in memory at a time.
+    //
+    // **********************************************************************************
+
+    void merge_reduce(std::vector<std::vector<Partition>> &map_partitions, std::vector<std::vector<SpillRun>> &map_runs,
+                      size_t partition, Result &partition_result) const {
+        if constexpr (spillable) {
+            std::vector<MergeSource> sources;
+            for (auto& runs : map_runs) {
+                for (auto& run : runs) {
+                    if (run.offsets[partition] != run.offsets[partition + 1]) {
+                        sources.emplace_back();
+                        sources.back().reader = std::make_unique<SpillReader>(run.file->path(), run.offsets[partition], run.offsets[partition + 1]);
+                    }
+                }
+            }
+            for (auto& thread_partitions : map_partitions) {
+                if (thread_partitions[partition].size() != 0) {
+                    sources.emplace_back();
+                    sources.back().entries = sorted_entries(thread_partitions[partition]);
+                }
+            }
+
+            // Min-heap of the sources ordered by their current key
+            auto greater = [&sources](size_t a, size_t b) { return sources[b].key < sources[a].key; };
+            std::vector<size_t> heap;
+            for (size_t i = 0; i < sources.size(); ++i) {
+                if (sources[i].next()) {
+                    heap.push_back(i);
+                }
+            }
+            std::make_heap(heap.begin(), heap.end(), greater);
+
+            bool have_key = false;
+            Key key{};
+            PartitionValue values{};
+            TopK<Key, Value> top(top_k_);
+            auto finish_key = [&]() {
+                if constexpr (streaming) {
+                    top.push(std::move(key), std::move(values));
+                } else {
+                    Value reduced = reducer_(key, values);
+                    top.push(std::move(key), std::move(reduced));
+                }
+            };
+            while (!heap.empty()) {
+                std::pop_heap(heap.begin(), heap.end(), greater);
+                MergeSource &source = sources[heap.back()];
+                if (have_key && key == source.key) {
+                    if constexpr (streaming) {
+                        reducer_.fold(values, source.value);
+                    } else {
+                        std::move(source.value.begin(), source.value.end(), std::back_inserter(values));
+                    }
+                } else {
+                    if (have_key) {
+                        finish_key();
+                    }
+                    key = std::move(source.key);
+                    values = std::move(source.value);
+                    have_key = true;
+                }
+                if (source.next()) {
+                    std::push_heap(heap.begin(), heap.end(), greater);
+                } else {
+                    heap.pop_back();
+                }
+            }
+            if (have_key) {
+                finish_key();
+            }
+            partition_result = top.take();
+        }
+    }
+
+    Partition make_partition(Arena *arena, size_t partition) const {
+        return Traits::template make_table<PartitionValue>(arena, num_reducers_, partition);
+    }
+
+    std::vector<Partition> make_partitions(Arena *arena) const {
+        std::vector<Partition> partitions;
+        for (size_t p = 0; p < num_reducers_; ++p) {
+            partitions.push_back(make_partition(arena, p));
+        }
+        return partitions;
+    }
+
+    std::vector<typename Traits::template Table<Value>> make_local_tables(Arena *arena) const {
+        std::vector<typename Traits::template Table<Value>> tables;
+        for (size_t p = 0; p < num_reducers_; ++p) {
+            tables.push_back(Traits::template make_table<Value>(arena, num_reducers_, p));
+        }
+        return tables;
+    }
+
+    // The fold of a streaming reducer as a callable for KeyTraits::upsert
+    auto fold() const {
+        return [this](Value &accumulator, const Value &value) { reducer_.fold(accumulator, value); };
+    }
+
+    size_t num_threads_;
+    size_t num_reducers_;
+    Mapper mapper_;
+    Reducer reducer_;
+    size_t memory_budget_ = 0;
+    std::string spill_directory_;
+    BlockCodec spill_codec_ = BlockCodec::None;
+    bool pipelined_ = false;
+    size_t queue_capacity_ = 0;
+    bool speculative_ = false;
+    size_t top_k_ = 0;
+    bool sorted_ = false;
+    size_t inline_threshold_ = default_inline_threshold;
+    bool numa_ = false;
+    bool hot_keys_ = true;
+};
+
+// **************************************************************************************
+//
+// Class: MappedFile
+// Description: Read only view of an input file.  The file is memory mapped so that the map
+//              threads read it straight from the page cache - nothing is copied into heap
+//              strings up front.  On platforms without mmap the file is read into memory.
+//              The constructor throws std::runtime_error if the file can not be opened.
+//
+// **************************************************************************************
+
+class MappedFile {
+public:
+    explicit MappedFile(const std::string &path) {
+#if defined(MAPREDUCE_HAVE_MMAP)
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Can not open " + path + ": " + std::strerror(errno));
+        }
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            const int error = errno;
+            ::close(fd);
+            throw std::runtime_error("Can not stat " + path + ": " + std::strerror(error));
+        }
+        size_ = static_cast<size_t>(info.st_size);
+        // mmap does not accept a length of 0, an empty file is simply an empty view
+        if (size_ > 0) {
+            void *mapping = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) {
+                const int error = errno;
+                ::close(fd);
+                throw std::runtime_error("Can not map " + path + ": " + std::strerror(error));
+            }
+            // The splits of the file are read front to back, let the OS read ahead
+            ::madvise(mapping, size_, MADV_SEQUENTIAL);
+            data_ = static_cast<const char *>(mapping);
+        }
+        // The mapping stays valid after the descriptor is closed
+        ::close(fd);
+#else
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            throw std::runtime_error("Can not open " + path);
+        }
+        std::ostringstream contents;
+        contents << file.rdbuf();
+        buffer_ = contents.str();
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+#endif
+    }
+
+    ~MappedFile() {
+#if defined(MAPREDUCE_HAVE_MMAP)
+        if (data_ != nullptr) {
+            ::munmap(const_cast<char *>(data_), size_);
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    std::string_view view() const {
+        return std::string_view(data_, size_);
+    }
+
+private:
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+#if !defined(MAPREDUCE_HAVE_MMAP)
+    std::string buffer_;
+#endif
+};
+
+// **************************************************************************************
+//
+// Function: split_input
+// Description: Divide the provided data into splits of roughly split_size bytes.  The end
+//              of every split is moved forward to the next whitespace byte so that no word
+//              is cut in two - each split can then be tokenized on its own.  The splits are
+//              views into the data.
+//
+// Parameters:
+//   - data: The data to be split, usually the view of a MappedFile
+//   - split_size: The target size of a split in bytes
+//   - splits: Vector that the splits are appended to
+//
+// **************************************************************************************
+
+void split_input(std::string_view data, size_t split_size, std::vector<std::string_view> &splits) {
+    split_size = std::max<size_t>(split_size, 1);
+    size_t start = 0;
+    while (start < data.size()) {
+        size_t end = std::min(start + split_size, data.size());
+        while (end < data.size() && !is_space_byte(data[end])) {
+            ++end;
+        }
+        splits.push_back(data.substr(start, end - start));
+        start = end;
+    }
+}
+
+#if defined(MAPREDUCE_HAVE_IO_URING)
+// **************************************************************************************
+//
+// Class: IoUring
+// Description: Minimal io_uring for the reads of an AsyncFileReader, set up with the raw
+//              system calls so that no liburing is needed.  The kernel shares two rings
+//              with the process: the submission ring, where read requests are queued, and
+//              the completion ring, where the kernel posts their results.  The process owns
+//              the tail of the submission ring and the head of the completion ring, the
+//              kernel the other two; both sides publish their index with a release store
+//              after the entries it covers are written.  Every read is handed to the kernel
+//              right away, with one io_uring_enter call.  The constructor throws
+//              std::runtime_error if the kernel does not support io_uring or its read
+//              operation, which only came with Linux 5.6.
+//
+// **************************************************************************************
+
+class IoUring {
+public:
+    explicit IoUring(unsigned entries) {
+        io_uring_params params{};
+        fd_ = static_cast<int>(::syscall(SYS_io_uring_setup, entries, &params));
+        if (fd_ < 0) {
+            throw std::runtime_error(std::string("Can not set up io_uring: ") + std::strerror(errno));
+        }
+        if (!supports(IORING_OP_READ)) {
+            ::close(fd_);
+            throw std::runtime_error("io_uring does not support reads");
+        }
+        sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        // Newer kernels map both rings with a single mapping
+        const bool single_mapping = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mapping) {
+            sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+        }
+        sq_ring_ = map(sq_size_, IORING_OFF_SQ_RING);
+        cq_ring_ = single_mapping ? sq_ring_ : map(cq_size_, IORING_OFF_CQ_RING);
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe *>(map(sqes_size_, IORING_OFF_SQES));
+
+        char *sq = static_cast<char *>(sq_ring_);
+        sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        char *cq = static_cast<char *>(cq_ring_);
+        cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    }
+
+    ~IoUring() {
+        unmap();
+    }
+
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    // Start a read of length bytes at the offset of the file into the buffer.  The tag comes
+    // back with the completion of the read.
+    void read(int fd, char *buffer, size_t length, uint64_t offset, uint64_t tag) {
+        const unsigned tail = *sq_tail_;
+        const unsigned index = tail & sq_mask_;
+        io_uring_sqe &sqe = sqes_[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.addr = reinterpret_cast<uint64_t>(buffer);
+        sqe.len = static_cast<uint32_t>(length);
+        sqe.off = offset;
+        sqe.user_data = tag;
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        while (enter(1, 0, 0) < 0) {
+            if (errno != EINTR && errno != EAGAIN) {
+                throw std::runtime_error(std::string("Can not submit a read: ") + std::strerror(errno));
+            }
+        }
+    }
+
+    // Wait for the next completed read and return its tag and result - the number of bytes
+    // read, or a negative errno
+    std::pair<uint64_t, int> wait() {
+        for (;;) {
+            const unsigned head = *cq_head_;
+            if (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+                const io_uring_cqe &cqe = cqes_[head & cq_mask_];
+                const std::pair<uint64_t, int> completion(cqe.user_data, cqe.res);
+                __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+                return completion;
+            }
+            if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+                throw std::runtime_error(std::string("Can not wait for a read: ") + std::strerror(errno));
+            }
+        }
+    }
+
+private:
+    // Whether the kernel supports the operation.  Kernels without the probe (before 5.6) do not
+    // have IORING_OP_READ either.
+    bool supports(unsigned operation) const {
+        constexpr unsigned num_operations = 256;
+        std::vector<char> buffer(sizeof(io_uring_probe) + num_operations * sizeof(io_uring_probe_op));
+        io_uring_probe *probe = reinterpret_cast<io_uring_probe *>(buffer.data());
+        if (::syscall(SYS_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, num_operations) < 0) {
+            return false;
+        }
+        return operation <= probe->last_op && (probe->ops[operation].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+
+    void *map(size_t size, off_t offset) {
+        void *mapping = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+        if (mapping == MAP_FAILED) {
+            const int error = errno;
+            unmap();
+            throw std::runtime_error(std::string("Can not map the io_uring: ") + std::strerror(error));
+        }
+        return mapping;
+    }
+
+    void unmap() {
+        if (sqes_ != nullptr) {
+            ::munmap(sqes_, sqes_size_);
+        }
+        if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) {
+            ::munmap(cq_ring_, cq_size_);
+        }
+        if (sq_ring_ != nullptr) {
+            ::munmap(sq_ring_, sq_size_);
+        }
+        ::close(fd_);
+    }
+
+    int enter(unsigned submit, unsigned complete, unsigned flags) {
+        return static_cast<int>(::syscall(SYS_io_uring_enter, fd_, submit, complete, flags, nullptr, 0));
+    }
+
+    int fd_ = -1;
+    void *sq_ring_ = nullptr;
+    void *cq_ring_ = nullptr;
+    size_t sq_size_ = 0;
+    size_t cq_size_ = 0;
+    io_uring_sqe *sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+    unsigned *sq_tail_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned *sq_array_ = nullptr;
+    unsigned *cq_head_ = nullptr;
+    unsigned *cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe *cqes_ = nullptr;
+};
+#elif defined(MAPREDUCE_HAVE_MMAP)
+// Without io_uring an AsyncFileReader reads through its pread thread
+class IoUring {
+public:
+    explicit IoUring(unsigned) {
+        throw std::runtime_error("io_uring is not supported on this platform");
+    }
+
+    void read(int, char *, size_t, uint64_t, uint64_t) {}
+
+    std::pair<uint64_t, int> wait() {
+        return std::pair<uint64_t, int>(0, 0);
+    }
+};
+#endif
+
+#if defined(MAPREDUCE_HAVE_MMAP)
+// **************************************************************************************
+//
+// Class: AsyncFileReader
+// Description: Reads a file front to back in chunks, with the reads of the next chunks
+//              already running while the current one is mapped.  The chunks are read into a
+//              pool of num_buffers page aligned buffers of buffer_size bytes: the first
+//              num_buffers chunks are requested up front, and whenever a chunk is handed
+//              back its buffer is reused for the read of the chunk num_buffers further on.
+//              The reads go through an IoUring, or - where the kernel has none - through a
+//              thread that reads the chunks with pread in the same order.  With direct the
+//              file is opened with O_DIRECT, if the file system allows it, so a cold run
+//              reads straight from the disk into the buffers and skips the page cache.  A
+//              read that comes back short in the middle of a block is continued through a
+//              second descriptor without O_DIRECT.  Errors are reported as std::runtime_error.
+//
+// **************************************************************************************
+
+class AsyncFileReader {
+public:
+    // The alignment of the buffers, of their size and of the offsets of the reads
+    static constexpr size_t alignment = 4096;
+
+    AsyncFileReader(const std::string &path, size_t buffer_size, size_t num_buffers, bool direct)
+        : buffer_size_(std::max((buffer_size + alignment - 1) / alignment * alignment, alignment)),
+          slots_(std::max<size_t>(num_buffers, 1)) {
+#if defined(O_DIRECT)
+        fd_ = direct ? ::open(path.c_str(), O_RDONLY | O_DIRECT) : -1;
+#else
+        (void)direct;
+#endif
+        if (fd_ < 0) {
+            fd_ = ::open(path.c_str(), O_RDONLY);
+            buffered_fd_ = fd_;
+        } else {
+            // A read that came back short in the middle of a block goes on without O_DIRECT
+            buffered_fd_ = ::open(path.c_str(), O_RDONLY);
+        }
+        if (fd_ < 0 || buffered_fd_ < 0) {
+            const int error = errno;
+            close_files();
+            throw std::runtime_error("Can not open " + path + ": " + std::strerror(error));
+        }
+        struct stat info;
+        if (::fstat(fd_, &info) != 0) {
+            const int error = errno;
+            close_files();
+            throw std::runtime_error("Can not stat " + path + ": " + std::strerror(error));
+        }
+        size_ = static_cast<uint64_t>(info.st_size);
+        buffers_ = static_cast<char *>(::operator new(buffer_size_ * slots_.size(), std::align_val_t(alignment)));
+        for (size_t i = 0; i < slots_.size(); ++i) {
+            slots_[i].data = buffers_ + i * buffer_size_;
+        }
+
+        try {
+            ring_ = std::make_unique<IoUring>(static_cast<unsigned>(slots_.size()));
+        } catch (const std::runtime_error &) {
+            // Fall back to the pread thread below
+        }
+        if (ring_ == nullptr) {
+            reader_ = std::thread([this]() { read_chunks(); });
+        }
+        for (size_t i = 0; i < slots_.size(); ++i) {
+            request(i);
+        }
+    }
+
+    ~AsyncFileReader() {
+        // The buffers may only be freed once no read writes into them any more
+        if (ring_ != nullptr) {
+            while (in_flight_ > 0) {
+                ring_->wait();
+                --in_flight_;
+            }
+        } else {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            requested_.notify_one();
+            reader_.join();
+        }
+        ::operator delete(buffers_, std::align_val_t(alignment));
+        close_files();
+    }
+
+    AsyncFileReader(const AsyncFileReader &) = delete;
+    AsyncFileReader &operator=(const AsyncFileReader &) = delete;
+
+    // The next chunk of the file, empty at the end of the file.  The chunk stays valid until
+    // the next call, which hands its buffer back to the reads.
+    std::string_view next() {
+        if (returned_ > 0) {
+            request((returned_ - 1) % slots_.size());
+        }
+        if (returned_ * buffer_size_ >= size_) {
+            return std::string_view();
+        }
+        Slot &slot = slots_[returned_ % slots_.size()];
+        {
+            MAPREDUCE_SPAN("read wait");
+            if (ring_ != nullptr) {
+                while (!slot.done) {
+                    complete();
+                }
+            } else {
+                std::unique_lock<std::mutex> lock(mutex_);
+                completed_.wait(lock, [&slot]() { return slot.done; });
+            }
+        }
+        if (slot.error != 0) {
+            throw std::runtime_error(std::string("Can not read the input: ") + std::strerror(slot.error));
+        }
+        ++returned_;
+        MAPREDUCE_COUNT(InputBytes, slot.filled);
+        return std::string_view(slot.data, slot.filled);
+    }
+
+    // Whether the reads go through io_uring instead of the pread thread
+    bool uses_io_uring() const {
+        return ring_ != nullptr;
+    }
+
+private:
+    struct Slot {
+        char *data = nullptr;
+        uint64_t offset = 0;
+        size_t length = 0;
+        size_t filled = 0;
+        int error = 0;
+        bool done = false;
+    };
+
+    // Start the read of the next chunk of the file into the buffer of the slot
+    void request(size_t index) {
+        if (issued_ * buffer_size_ >= size_) {
+            return;
+        }
+        Slot &slot = slots_[index];
+        const uint64_t offset = issued_++ * buffer_size_;
+        const size_t length = static_cast<size_t>(std::min<uint64_t>(buffer_size_, size_ - offset));
+        if (ring_ != nullptr) {
+            slot = Slot{slot.data, offset, length, 0, 0, false};
+            submit(index);
+        } else {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                slot = Slot{slot.data, offset, length, 0, 0, false};
+                queue_.push_back(index);
+            }
+            requested_.notify_one();
+        }
+    }
+
+    // Read the rest of the chunk of a slot.  The whole buffer is asked for even when the
+    // chunk is the last one, the length of an O_DIRECT read must stay aligned.
+    void submit(size_t index) {
+        Slot &slot = slots_[index];
+        ring_->read(file_at(slot.filled), slot.data + slot.filled, buffer_size_ - slot.filled, slot.offset + slot.filled, index);
+        ++in_flight_;
+    }
+
+    // The descriptor for a read at the position in a chunk - after a short read the position
+    // may be unaligned, which O_DIRECT does not accept
+    int file_at(size_t filled) const {
+        return filled % alignment == 0 ? fd_ : buffered_fd_;
+    }
+
+    void close_files() {
+        if (buffered_fd_ >= 0 && buffered_fd_ != fd_) {
+            ::close(buffered_fd_);
+        }
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    // Take one completion of the ring, a read that came back short is continued
+    void complete() {
+        const std::pair<uint64_t, int> completion = ring_->wait();
+        --in_flight_;
+        Slot &slot = slots_[completion.first];
+        if (completion.second < 0) {
+            if (completion.second == -EINTR || completion.second == -EAGAIN) {
+                submit(completion.first);
+                return;
+            }
+            slot.error = -completion.second;
+            slot.done = true;
+            return;
+        }
+        slot.filled += static_cast<size_t>(completion.second);
+        if (completion.second == 0 || slot.filled >= slot.length) {
+            // A file that got shorter since it was opened simply ends early
+            slot.filled = std::min(slot.filled, slot.length);
+            slot.done = true;
+        } else {
+            submit(completion.first);
+        }
+    }
+
+    // The pread thread: read the requested chunks in the order in which they come
+    void read_chunks() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            requested_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+            if (stop_) {
+                return;
+            }
+            Slot &slot = slots_[queue_.front()];
+            queue_.pop_front();
+            lock.unlock();
+            size_t filled = 0;
+            int error = 0;
+            while (filled < slot.length) {
+                const ssize_t bytes = ::pread(file_at(filled), slot.data + filled, buffer_size_ - filled,
+                                              static_cast<off_t>(slot.offset + filled));
+                if (bytes < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (bytes <= 0) {
+                    error = bytes < 0 ? errno : 0;
+                    break;
+                }
+                filled += static_cast<size_t>(bytes);
+            }
+            lock.lock();
+            slot.filled = std::min(filled, slot.length);
+            slot.error = error;
+            slot.done = true;
+            completed_.notify_one();
+        }
+    }
+
+    int fd_ = -1;
+    int buffered_fd_ = -1;
+    uint64_t size_ = 0;
+    size_t buffer_size_;
+    std::vector<Slot> slots_;
+    char *buffers_ = nullptr;
+    // Chunks whose reads were started and chunks that were handed out
+    uint64_t issued_ = 0;
+    uint64_t returned_ = 0;
+    std::unique_ptr<IoUring> ring_;
+    size_t in_flight_ = 0;
+    // The pread thread with its queue of slots to read
+    std::thread reader_;
+    std::mutex mutex_;
+    std::condition_variable requested_;
+    std::condition_variable completed_;
+    std::deque<size_t> queue_;
+    bool stop_ = false;
+};
+#endif
+
+// **************************************************************************************
+//
+// Class: OutputWriter
+// Description: Buffered writer for the results of a job.  The text is collected in a large
+//              buffer that is handed to the operating system with a single write call once it
+//              is full, instead of one flush per line.  Numbers are formatted with
+//              std::to_chars straight into the buffer.  Errors are reported as
+//              std::runtime_error.
+//
+// **************************************************************************************
+
+class OutputWriter {
+public:
+    static constexpr size_t buffer_size = 1 << 20;
+
+    // Write to standard output
+    OutputWriter() : name_("standard output") {
+#if defined(MAPREDUCE_HAVE_MMAP)
+        fd_ = STDOUT_FILENO;
+#else
+        file_ = stdout;
+#endif
+        buffer_.reserve(buffer_size);
+    }
+
+    // Create or truncate the file at the path and write to it
+    explicit OutputWriter(const std::string &path) : name_(path), owned_(true) {
+#if defined(MAPREDUCE_HAVE_MMAP)
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd_ < 0) {
+#else
+        file_ = std::fopen(path.c_str(), "wb");
+        if (file_ == nullptr) {
+#endif
+            throw std::runtime_error("Can not create " + path + ": " + std::strerror(errno));
+        }
+        buffer_.reserve(buffer_size);
+    }
+
+    // The destructor does not flush, a writer that is not closed lost its data due to an
+    // error that has already been thrown
+    ~OutputWriter() {
+        if (owned_) {
+#if defined(MAPREDUCE_HAVE_MMAP)
+            ::close(fd_);
+#else
+            std::fclose(file_);
+#endif
+        }
+    }
+
+    OutputWriter(const OutputWriter &) = delete;
+    OutputWriter &operator=(const OutputWriter &) = delete;
+
+    OutputWriter &operator<<(std::string_view text) {
+        if (buffer_.size() + text.size() > buffer_size) {
+            flush();
+        }
+        buffer_.append(text.data(), text.size());
+        return *this;
+    }
+
+    OutputWriter &operator<<(char c) {
+        if (buffer_.size() == buffer_size) {
+            flush();
+        }
+        buffer_.push_back(c);
+        return *this;
+    }
+
+    template <typename Number, typename = std::enable_if_t<std::is_integral<Number>::value>>
+    OutputWriter &operator<<(Number number) {
+        char digits[24];
+        const auto converted = std::to_chars(digits, digits + sizeof(digits), number);
+        return *this << std::string_view(digits, static_cast<size_t>(converted.ptr - digits));
+    }
+
+    // Write out the buffer
+    void flush() {
+        MAPREDUCE_COUNT(OutputBytes, buffer_.size());
+        const char *data = buffer_.data();
+        size_t size = buffer_.size();
+#if defined(MAPREDUCE_HAVE_MMAP)
+        while (size > 0) {
+            const ssize_t written = ::write(fd_, data, size);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written < 0) {
+                throw std::runtime_error("Can not write " + name_ + ": " + std::strerror(errno));
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+#else
+        if (std::fwrite(data, 1, size, file_) != size || std::fflush(file_) != 0) {
+            throw std::runtime_error("Can not write " + name_ + ": " + std::strerror(errno));
+        }
+#endif
+        buffer_.clear();
+    }
+
+    // Flush and close the file
+    void close() {
+        flush();
+        if (owned_) {
+            owned_ = false;
+#if defined(MAPREDUCE_HAVE_MMAP)
+            if (::close(fd_) != 0) {
+#else
+            if (std::fclose(file_) != 0) {
+#endif
+                throw std::runtime_error("Can not write " + name_ + ": " + std::strerror(errno));
+            }
+        }
+    }
+
+private:
+    std::string name_;
+    bool owned_ = false;
+#if defined(MAPREDUCE_HAVE_MMAP)
+    int fd_ = -1;
+#else
+    std::FILE *file_ = nullptr;
+#endif
+    std::string buffer_;
+};
+
+// **************************************************************************************
+//
+// Distributed execution
+// Description: A job can be spread over several processes, possibly on different hosts.
+//              The coordinator process owns the input: it divides it into splits and hands
+//              them to the worker processes that connect to it over TCP.  A worker runs the
+//              job on its split with its own threads, partitions the reduced pairs of the
+//              split by key and streams them back to the coordinator one partition at a time.
+//              The coordinator folds each partition into its reducer table.
+//
+//              With reduce workers the partitions go to the workers instead: partition p is
+//              owned by worker p % N of the first N workers that connect, and the tasks start
+//              once all of them are there.  Every worker listens on a port of its own, which it
+//              names in its Hello.  A mapper sends each partition of its split straight to the
+//              owner and waits until every owner has acknowledged it before it reports the
+//              task as done.  The owners stage the pairs by the attempt of the task, a number
+//              that is unique to each copy of a task that is handed out.  At the end the
+//              coordinator tells every owner which attempts won, the owner folds their pairs
+//              and returns its reduced partitions.  A mapper that fails only loses its task,
+//              the loss of an owner fails the job because the pairs that it staged are gone.
+//
+//              The output of a task is decoded as it arrives and only folded in once the
+//              worker has sent all of it.  If the connection of a worker fails before that, or
+//              a message of the worker does not decode, its staged output is dropped
+//              and the task goes back to the queue for the next worker that asks for one.  The
+//              coordinator keeps waiting for workers until every task has been completed.
+//              With speculative execution an idle worker also gets a backup copy of a map task
+//              that is overdue (see TaskTracker), the output of the copy that completes first is
+//              folded in and the connection of a worker that is still busy with a task is shut
+//              down when the job is done.
+//
+//              Every message is a one byte type and a 32 bit length, followed by a payload
+//              encoded with SpillCodec and stored in a single block (see Blocks), which is
+//              compressed with the codec of the sender.  Block headers use the byte order of
+//              the host, so the processes of a job must run on machines of the same
+//              architecture.  A message is at most max_message_size bytes long, a longer one
+//              fails the connection before anything is allocated for it.
+//
+//                Hello        worker -> coordinator   port of the worker
+//                Owners       coordinator -> worker   index of the worker, number of partitions,
+//                                                     number of owners, HOST:PORT of each owner
+//                Task         coordinator -> worker   task id, attempt, number of partitions,
+//                                                     split
+//                Partition    worker -> coordinator   task id, partition, count, key/value pairs
+//                Shuffle      worker -> owner         attempt, partition, count, key/value pairs
+//                ShuffleDone  worker -> owner         attempt
+//                ShuffleAck   owner -> worker         attempt
+//                TaskDone     worker -> coordinator   task id
+//                Reduce       coordinator -> owner    count, attempt of every task
+//                ReduceOutput owner -> coordinator    index of the owner, partition, count,
+//                                                     key/value pairs
+//                ReduceDone   owner -> coordinator    nothing
+//                Shutdown     coordinator -> worker   the job is done
+//
+//              Owners is only sent with reduce workers, Partition only without them.  A
+//              partition can take more than one Partition, Shuffle or ReduceOutput message.
+//
+// **************************************************************************************
+
+#if defined(MAPREDUCE_HAVE_SOCKETS)
+
+enum class MessageType : uint8_t {
+    Task = 1,
+    Partition = 2,
+    TaskDone = 3,
+    Shutdown = 4,
+    Hello = 5,
+    Owners = 6,
+    Shuffle = 7,
+    ShuffleDone = 8,
+    ShuffleAck = 9,
+    Reduce = 10,
+    ReduceOutput = 11,
+    ReduceDone = 12,
+};
+
+// Largest accepted message, a bad length in a header must not allocate gigabytes.  The
+// payload is a single block, so it can be no larger either.
+constexpr uint32_t max_message_size = max_block_size;
+// Largest number of partitions of a distributed job
+constexpr uint32_t max_partitions = 1 << 16;
+
+// Connected TCP socket that sends and receives whole messages and throws
+// std::runtime_error when the connection fails
+class Connection {
+public:
+    explicit Connection(int fd) : fd_(fd) {
+        const int on = 1;
+        ::setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#if defined(SO_NOSIGPIPE)
+        ::setsockopt(fd_, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    }
+
+    ~Connection() {
+        ::close(fd_);
+    }
+
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+
+    int fd() const {
+        return fd_;
+    }
+
+    // Connect to host:port, retrying for a while so that workers can be started before the
+    // coordinator
+    static std::unique_ptr<Connection> connect(const std::string &address) {
+        const size_t colon = address.rfind(':');
+        if (colon == std::string::npos) {
+            throw std::invalid_argument("Address must be HOST:PORT: " + address);
+        }
+        const std::string host = address.substr(0, colon);
+        const std::string port = address.substr(colon + 1);
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        for (int attempt = 0;; ++attempt) {
+            addrinfo *addresses = nullptr;
+            const int error = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+            if (error != 0) {
+                throw std::runtime_error("Can not resolve " + address + ": " + ::gai_strerror(error));
+            }
+            for (addrinfo *candidate = addresses; candidate != nullptr; candidate = candidate->ai_next) {
+                const int fd = ::socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+                if (fd < 0) {
+                    continue;
+                }
+                if (::connect(fd, candidate->ai_addr, candidate->ai_addrlen) == 0) {
+                    ::freeaddrinfo(addresses);
+                    return std::make_unique<Connection>(fd);
+                }
+                ::close(fd);
+            }
+            ::freeaddrinfo(addresses);
+            if (attempt == 100) {
+                throw std::runtime_error("Can not connect to " + address + ": " + std::strerror(errno));
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+
+    // Codec of the blocks that are sent, the received blocks name their own codec
+    void set_codec(BlockCodec codec) {
+        codec_ = codec;
+    }
+
+    void send(MessageType type, std::string_view payload) {
+        block_.clear();
+        encode_block(payload, codec_, block_);
+        if (block_.size() > max_message_size) {
+            throw std::runtime_error("Message is too large to send");
+        }
+        char header[5];
+        const uint32_t length = static_cast<uint32_t>(block_.size());
+        header[0] = static_cast<char>(type);
+        std::memcpy(header + 1, &length, sizeof(length));
+        send_bytes(header, sizeof(header));
+        send_bytes(block_.data(), block_.size());
+    }
+
+    // Make the sends and receives fail once the deadline has passed, time_point::max() for
+    // no deadline
+    void set_deadline(std::chrono::steady_clock::time_point deadline) {
+        deadline_ = deadline;
+    }
+
+    // Numeric address of the host at the other end
+    std::string peer_host() const {
+        sockaddr_storage address{};
+        socklen_t length = sizeof(address);
+        char host[NI_MAXHOST];
+        if (::getpeername(fd_, reinterpret_cast<sockaddr *>(&address), &length) != 0) {
+            throw std::runtime_error(std::string("Can not get the address of the peer: ") + std::strerror(errno));
+        }
+        const int error = ::getnameinfo(reinterpret_cast<sockaddr *>(&address), length, host, sizeof(host), nullptr, 0, NI_NUMERICHOST);
+        if (error != 0) {
+            throw std::runtime_error(std::string("Can not get the address of the peer: ") + ::gai_strerror(error));
+        }
+        return host;
+    }
+
+    // Make a blocked send or receive of another thread fail
+    void interrupt() {
+        ::shutdown(fd_, SHUT_RDWR);
+    }
+
+    // Receive the next message, the payload is stored in the buffer
+    MessageType receive(std::string &payload) {
+        char header[5];
+        receive_bytes(header, sizeof(header));
+        uint32_t length;
+        std::memcpy(&length, header + 1, sizeof(length));
+        if (length > max_message_size) {
+            throw std::runtime_error("Received a message that is too large");
+        }
+        block_.resize(length);
+        receive_bytes(&block_[0], length);
+        if (length < block_header_size || block_stored_size(block_.data()) != length - block_header_size) {
+            throw std::runtime_error("Received an invalid block");
+        }
+        // decode_block holds the decompressed payload to max_block_size
+        decode_block(block_.data(), std::string_view(block_).substr(block_header_size), payload);
+        return static_cast<MessageType>(header[0]);
+    }
+
+private:
+    void send_bytes(const char *data, size_t size) {
+#if defined(MSG_NOSIGNAL)
+        const int flags = MSG_NOSIGNAL;
+#else
+        const int flags = 0;
+#endif
+        while (size > 0) {
+            wait_until_ready(POLLOUT);
+            const ssize_t sent = ::send(fd_, data, size, flags);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent <= 0) {
+                throw std::runtime_error(std::string("Connection failed: ") + std::strerror(errno));
+            }
+            data += sent;
+            size -= static_cast<size_t>(sent);
+        }
+    }
+
+    void receive_bytes(char *data, size_t size) {
+        while (size > 0) {
+            wait_until_ready(POLLIN);
+            const ssize_t received = ::recv(fd_, data, size, 0);
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            if (received == 0) {
+                throw std::runtime_error("Connection closed");
+            }
+            if (received < 0) {
+                throw std::runtime_error(std::string("Connection failed: ") + std::strerror(errno));
+            }
+            data += received;
+            size -= static_cast<size_t>(received);
+        }
+    }
+
+    // Wait until the socket is ready for the events or throw when the deadline passes first
+    void wait_until_ready(short events) {
+        if (deadline_ == std::chrono::steady_clock::time_point::max()) {
+            return;
+        }
+        for (;;) {
+            const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline_ - std::chrono::steady_clock::now());
+            pollfd ready{fd_, events, 0};
+            const int result = left.count() > 0 ? ::poll(&ready, 1, static_cast<int>(std::min<long long>(left.count(), 1 << 30))) : 0;
+            if (result > 0) {
+                return;
+            }
+            if (result == 0) {
+                throw std::runtime_error("Connection timed out");
+            }
+            if (errno != EINTR) {
+                throw std::runtime_error(std::string("Connection failed: ") + std::strerror(errno));
+            }
+        }
+    }
+
+    int fd_;
+    BlockCodec codec_ = BlockCodec::None;
+    std::string block_;
+    std::chrono::steady_clock::time_point deadline_ = std::chrono::steady_clock::time_point::max();
+};
+
+// Listening TCP socket of the coordinator, or of a worker that owns partitions
+class Listener {
+public:
+    explicit Listener(uint16_t port) : fd_(::socket(AF_INET6, SOCK_STREAM, 0)) {
+        if (fd_ < 0) {
+            throw std::runtime_error(std::string("Can not create socket: ") + std::strerror(errno));
+        }
+        const int on = 1;
+        const int off = 0;
+        ::setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        // Accept IPv4 clients as well
+        ::setsockopt(fd_, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        sockaddr_in6 address{};
+        address.sin6_family = AF_INET6;
+        address.sin6_addr = in6addr_any;
+        address.sin6_port = htons(port);
+        if (::bind(fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || ::listen(fd_, 64) != 0) {
+            const int error = errno;
+            ::close(fd_);
+            throw std::runtime_error("Can not listen on port " + std::to_string(port) + ": " + std::strerror(error));
+        }
+    }
+
+    ~Listener() {
+        ::close(fd_);
+    }
+
+    Listener(const Listener &) = delete;
+    Listener &operator=(const Listener &) = delete;
+
+    // The port, which the system picks when the Listener is created with port 0
+    uint16_t port() const {
+        sockaddr_in6 address{};
+        socklen_t length = sizeof(address);
+        if (::getsockname(fd_, reinterpret_cast<sockaddr *>(&address), &length) != 0) {
+            throw std::runtime_error(std::string("Can not get the port: ") + std::strerror(errno));
+        }
+        return ntohs(address.sin6_port);
+    }
+
+    // Wait up to timeout for a worker to connect, returns null if none did
+    std::unique_ptr<Connection> accept(std::chrono::milliseconds timeout) {
+        pollfd ready{fd_, POLLIN, 0};
+        if (::poll(&ready, 1, static_cast<int>(timeout.count())) <= 0) {
+            return nullptr;
+        }
+        const int fd = ::accept(fd_, nullptr, nullptr);
+        return fd < 0 ? nullptr : std::make_unique<Connection>(fd);
+    }
+
+private:
+    int fd_;
+};
+
+// A pair of send_partition, given by value or by pointer
+template <typename Pair>
+const Pair &deref_pair(const Pair &pair) {
+    return pair;
+}
+
+template <typename Pair>
+const Pair &deref_pair(const Pair *pair) {
+    return *pair;
+}
+
+// Send the pairs of a partition in messages of the type, each one the prefix, the partition,
+// the number of pairs and the pairs.  A large partition is spread over several messages so
+// that every message stays well below max_message_size.
+template <typename Key, typename Value, typename Iterator>
+void send_partition(Connection &connection, MessageType type, uint32_t prefix, uint32_t partition, Iterator first, Iterator last) {
+    constexpr size_t limit = max_message_size / 4;
+    while (first != last) {
+        MessageWriter pairs;
+        uint32_t count = 0;
+        for (; first != last && pairs.offset() < limit; ++first, ++count) {
+            const auto &pair = deref_pair(*first);
+            SpillCodec<Key>::write(pairs, pair.first);
+            SpillCodec<Value>::write(pairs, pair.second);
+        }
+        MessageWriter message;
+        SpillCodec<uint32_t>::write(message, prefix);
+        SpillCodec<uint32_t>::write(message, partition);
+        SpillCodec<uint32_t>::write(message, count);
+        message.write(pairs.bytes().data(), pairs.bytes().size());
+        connection.send(type, message.bytes());
+    }
+}
+
+// Read the rest of a message sent by send_partition, after the prefix.  Throws
+// std::runtime_error if the partition is not below num_partitions or the message does not
+// decode
+template <typename Key, typename Value>
+uint32_t read_partition(MessageReader &reader, size_t payload_size, size_t num_partitions,
+                        std::vector<std::pair<Key, Value>> &pairs) {
+    uint32_t partition;
+    uint32_t count;
+    SpillCodec<uint32_t>::read(reader, partition);
+    SpillCodec<uint32_t>::read(reader, count);
+    if (partition >= num_partitions) {
+        throw std::runtime_error("Received an invalid partition");
+    }
+    pairs.clear();
+    // Every pair takes at least two bytes, a bogus count reserves no more than that
+    pairs.reserve(std::min<size_t>(count, payload_size / 2));
+    for (uint32_t i = 0; i < count; ++i) {
+        pairs.emplace_back();
+        SpillCodec<Key>::read(reader, pairs.back().first);
+        SpillCodec<Value>::read(reader, pairs.back().second);
+    }
+    if (!reader.at_end()) {
+        throw std::runtime_error("Received an invalid partition");
+    }
+    return partition;
+}
+
+// **************************************************************************************
+//
+// Class: Coordinator
+// Description: The coordinator of a distributed job, see Distributed execution above.  It
+//              serves the splits to the workers that connect on the port, one thread per
+//              worker.  Either it folds the partitions that the workers return with the
+//              reducer, or - with set_reduce_workers - the first workers own the partitions
+//              and it collects their reduced partitions at the end.  The reducer must be a
+//              streaming reducer because the workers send values that are already reduced for
+//              their split.
+//
+// Parameters:
+//   - port: The TCP port that the workers connect to
+//   - num_reducers: Number of reducer partitions
+//   - reducer: The reducer of the job
+//   - speculative: Whether to run backup copies of overdue tasks
+//
+// **************************************************************************************
+
+template <typename Key, typename Value, typename Reducer, typename Hash = std::hash<Key>>
+class Coordinator {
+    static_assert(is_streaming_reducer<Reducer>::value, "A distributed job needs a streaming reducer");
+    static_assert(is_spillable<Key>::value && is_spillable<Value>::value, "A distributed job needs a SpillCodec for its key and value");
+
+public:
+    using Traits = KeyTraits<Key, Hash>;
+    using Partition = typename Traits::template Table<Value>;
+    using Result = std::vector<std::pair<Key, Value>>;
+
+    Coordinator(uint16_t port, size_t num_reducers, Reducer reducer = Reducer(), bool speculative = false)
+        : listener_(port), num_reducers_(std::max<size_t>(1, num_reducers)), reducer_(std::move(reducer)), speculative_(speculative) {}
+
+    // Compress the splits that are sent to the workers with the codec
+    Coordinator &set_codec(BlockCodec codec) {
+        codec_ = codec;
+        return *this;
+    }
+
+    // Time that a worker has for a task before the task goes to another worker and the worker
+    // is cut off, zero for no limit.  This also covers a worker that is connected but stopped
+    // answering, without speculative execution.
+    Coordinator &set_task_timeout(std::chrono::milliseconds timeout) {
+        task_timeout_ = timeout;
+        return *this;
+    }
+
+    // Let the first num_owners workers that connect own the reducer partitions, zero keeps
+    // them all in the coordinator.  The tasks only start once that many workers are there.
+    Coordinator &set_reduce_workers(size_t num_owners) {
+        num_owners_ = std::min(num_owners, num_reducers_);
+        return *this;
+    }
+
+    // Run the job, throws std::runtime_error if a worker that owns partitions fails
+    Result run(const std::vector<std::string_view> &splits) {
+        splits_ = &splits;
+        tracker_ = std::make_unique<TaskTracker>(splits.size());
+        remaining_ = splits.size();
+        pending_.clear();
+        for (size_t task = 0; task < splits.size(); ++task) {
+            pending_.push_back(task);
+        }
+        arenas_ = std::vector<Arena>(num_reducers_);
+        partitions_.clear();
+        for (size_t p = 0; p < num_reducers_; ++p) {
+            partitions_.push_back(Traits::template make_table<Value>(&arenas_[p], num_reducers_, p));
+        }
+        partition_mutexes_ = std::vector<std::mutex>(num_reducers_);
+        num_workers_ = 0;
+        owner_addresses_.assign(num_owners_, std::string());
+        owners_.assign(num_owners_, nullptr);
+        owner_results_.assign(num_owners_, Result());
+        winners_.assign(splits.size(), 0);
+        next_attempt_ = 1;
+        failure_.clear();
+
+        // Accept workers until every task is done, each worker gets its own thread.  The
+        // workers that are still running the losing copy of a task are cut off at the end,
+        // except for the owners of partitions, which still have to reduce them.
+        std::vector<std::unique_ptr<Connection>> connections;
+        std::vector<std::thread> workers;
+        while (!done()) {
+            std::unique_ptr<Connection> connection = listener_.accept(std::chrono::milliseconds(100));
+            if (connection) {
+                connection->set_codec(codec_);
+                connections.push_back(std::move(connection));
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    greeting_.push_back(connections.back().get());
+                }
+                workers.emplace_back([this, worker = connections.back().get()]() { serve(*worker); });
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (Connection *client : greeting_) {
+                client->interrupt();
+            }
+            for (Connection *busy : busy_) {
+                if (!failure_.empty() || std::find(owners_.begin(), owners_.end(), busy) == owners_.end()) {
+                    busy->interrupt();
+                }
+            }
+            if (!failure_.empty()) {
+                for (Connection *owner : owners_) {
+                    if (owner != nullptr) {
+                        owner->interrupt();
+                    }
+                }
+            }
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        if (!failure_.empty()) {
+            throw std::runtime_error(failure_);
+        }
+
+        Result result;
+        for (auto& partition : partitions_) {
+            for (auto&& entry : partition) {
+                result.emplace_back(Key(entry.first), std::move(entry.second));
+            }
+        }
+        for (auto& owner_result : owner_results_) {
+            std::move(owner_result.begin(), owner_result.end(), std::back_inserter(result));
+        }
+        return result;
+    }
+
+private:
+    bool done() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return remaining_ == 0 || !failure_.empty();
+    }
+
+    std::chrono::steady_clock::time_point task_deadline() const {
+        return task_timeout_.count() > 0 ? std::chrono::steady_clock::now() + task_timeout_
+                                         : std::chrono::steady_clock::time_point::max();
+    }
+
+    // Hand out tasks to one worker until the job is done or the worker fails
+    void serve(Connection &worker) {
+        // The worker introduces itself with the port on which it takes the partitions of other
+        // workers.  A client that does not is dropped.
+        size_t index;
+        try {
+            std::string payload;
+            worker.set_deadline(task_deadline());
+            if (worker.receive(payload) != MessageType::Hello) {
+                throw std::runtime_error("Worker did not say hello");
+            }
+            worker.set_deadline(std::chrono::steady_clock::time_point::max());
+            MessageReader reader(payload);
+            uint32_t port;
+            SpillCodec<uint32_t>::read(reader, port);
+            std::unique_lock<std::mutex> lock(mutex_);
+            greeting_.erase(std::find(greeting_.begin(), greeting_.end(), &worker));
+            if (remaining_ == 0 || !failure_.empty()) {
+                // The job ended while the worker was connecting
+                lock.unlock();
+                worker.send(MessageType::Shutdown, std::string_view());
+                return;
+            }
+            index = num_workers_++;
+            if (index < num_owners_) {
+                owner_addresses_[index] = worker.peer_host() + ":" + std::to_string(port);
+                owners_[index] = &worker;
+                changed_.notify_all();
+            }
+            // The owners of all partitions must be known before the first output is sent
+            changed_.wait(lock, [this]() { return num_workers_ >= num_owners_ || !failure_.empty(); });
+            if (!failure_.empty()) {
+                return;
+            }
+        } catch (const std::exception &) {
+            worker.interrupt();
+            std::lock_guard<std::mutex> lock(mutex_);
+            const auto client = std::find(greeting_.begin(), greeting_.end(), &worker);
+            if (client != greeting_.end()) {
+                greeting_.erase(client);
+            }
+            return;
+        }
+        const bool owner = index < num_owners_;
+        try {
+            if (num_owners_ != 0) {
+                MessageWriter message;
+                SpillCodec<uint32_t>::write(message, static_cast<uint32_t>(index));
+                SpillCodec<uint32_t>::write(message, static_cast<uint32_t>(num_reducers_));
+                SpillCodec<uint32_t>::write(message, static_cast<uint32_t>(num_owners_));
+                for (const auto& address : owner_addresses_) {
+                    SpillCodec<std::string>::write(message, address);
+                }
+                worker.send(MessageType::Owners, message.bytes());
+            }
+        } catch (const std::exception &error) {
+            fail(worker, owner, error);
+            return;
+        }
+
+        for (;;) {
+            size_t task;
+            uint32_t attempt;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                // Without a pending task wait for a straggler.  changed_ is signalled when a
+                // task starts, completes or fails, otherwise nothing changes before the first
+                // running task becomes overdue.
+                while (remaining_ != 0 && failure_.empty() && pending_.empty()) {
+                    TaskTracker::Clock::time_point due = TaskTracker::Clock::time_point::max();
+                    if (speculative_ && tracker_->straggler(task, due)) {
+                        break;
+                    }
+                    if (due == TaskTracker::Clock::time_point::max()) {
+                        changed_.wait(lock);
+                    } else {
+                        changed_.wait_until(lock, due);
+                    }
+                }
+                if (remaining_ == 0 || !failure_.empty()) {
+                    break;
+                }
+                if (!pending_.empty()) {
+                    task = pending_.front();
+                    pending_.pop_front();
+                    tracker_->start(task);
+                    // The task may become the first one to be overdue
+                    changed_.notify_all();
+                }
+                attempt = next_attempt_++;
+                busy_.push_back(&worker);
+            }
+
+            Staged staged;
+            try {
+                staged = execute(worker, task, attempt);
+            } catch (const std::exception &error) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    busy_.erase(std::find(busy_.begin(), busy_.end(), &worker));
+                }
+                fail(worker, owner, error, task);
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                busy_.erase(std::find(busy_.begin(), busy_.end(), &worker));
+            }
+            if (tracker_->claim(task)) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    winners_[task] = attempt;
+                }
+                commit(staged);
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!failure_.empty()) {
+                return;
+            }
+        }
+        if (owner) {
+            try {
+                collect(worker, index);
+            } catch (const std::exception &error) {
+                fail(worker, owner, error);
+                return;
+            }
+        }
+        try {
+            worker.send(MessageType::Shutdown, std::string_view());
+        } catch (const std::exception &) {
+            // The worker is gone already
+        }
+    }
+
+    // A worker failed.  Its task goes to another worker, unless another copy completed it.  A
+    // worker that timed out may still be alive, its connection is cut off.  The partitions of
+    // an owner are lost with it, which fails the job.
+    void fail(Connection &worker, bool owner, const std::exception &error, size_t task = std::numeric_limits<size_t>::max()) {
+        worker.interrupt();
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (owner) {
+            if (failure_.empty()) {
+                failure_ = std::string("Lost a worker that owns reducer partitions: ") + error.what();
+            }
+        } else if (task != std::numeric_limits<size_t>::max() && !tracker_->done(task)) {
+            pending_.push_front(task);
+        }
+        changed_.notify_all();
+    }
+
+    // The decoded output of a task, the pairs of every partition
+    using Staged = std::vector<std::vector<std::pair<Key, Value>>>;
+
+    // Send the task to the worker and collect its output.  Every partition is decoded here,
+    // before the task is claimed, so a malformed message only fails this copy of the task.
+    // When the workers own the partitions the worker only reports that it is done.
+    Staged execute(Connection &worker, size_t task, uint32_t attempt) {
+        MAPREDUCE_SPAN("remote task");
+        MessageWriter message;
+        const uint32_t task_id = static_cast<uint32_t>(task);
+        const uint32_t num_partitions = static_cast<uint32_t>(num_reducers_);
+        SpillCodec<uint32_t>::write(message, task_id);
+        SpillCodec<uint32_t>::write(message, attempt);
+        SpillCodec<uint32_t>::write(message, num_partitions);
+        SpillCodec<std::string>::write(message, (*splits_)[task]);
+        worker.set_deadline(task_deadline());
+        worker.send(MessageType::Task, message.bytes());
+
+        Staged staged(num_reducers_);
+        std::vector<std::pair<Key, Value>> pairs;
+        for (std::string payload;;) {
+            const MessageType type = worker.receive(payload);
+            MessageReader reader(payload);
+            uint32_t id;
+            SpillCodec<uint32_t>::read(reader, id);
+            if (id != task_id) {
+                throw std::runtime_error("Worker sent the output of another task");
+            }
+            if (type == MessageType::TaskDone) {
+                worker.set_deadline(std::chrono::steady_clock::time_point::max());
+                return staged;
+            }
+            if (type != MessageType::Partition || num_owners_ != 0) {
+                throw std::runtime_error("Worker sent an invalid message");
+            }
+            // A large partition comes in several messages
+            const uint32_t partition = read_partition(reader, payload.size(), num_reducers_, pairs);
+            std::move(pairs.begin(), pairs.end(), std::back_inserter(staged[partition]));
+        }
+    }
+
+    // Have an owner reduce its partitions, with the output of the copies of the tasks that won
+    void collect(Connection &worker, size_t index) {
+        MAPREDUCE_SPAN("remote reduce");
+        MessageWriter message;
+        SpillCodec<uint32_t>::write(message, static_cast<uint32_t>(winners_.size()));
+        for (uint32_t attempt : winners_) {
+            SpillCodec<uint32_t>::write(message, attempt);
+        }
+        worker.set_deadline(task_deadline());
+        worker.send(MessageType::Reduce, message.bytes());
+        std::vector<std::pair<Key, Value>> pairs;
+        for (std::string payload;;) {
+            const MessageType type = worker.receive(payload);
+            if (type == MessageType::ReduceDone) {
+                break;
+            }
+            if (type != MessageType::ReduceOutput) {
+                throw std::runtime_error("Worker sent an invalid message");
+            }
+            MessageReader reader(payload);
+            uint32_t owner;
+            SpillCodec<uint32_t>::read(reader, owner);
+            const uint32_t partition = read_partition(reader, payload.size(), num_reducers_, pairs);
+            if (owner != index || partition % num_owners_ != index) {
+                throw std::runtime_error("Worker sent a partition that it does not own");
+            }
+            std::move(pairs.begin(), pairs.end(), std::back_inserter(owner_results_[index]));
+        }
+        worker.set_deadline(std::chrono::steady_clock::time_point::max());
+    }
+
+    // Fold the output of a completed task into the partitions
+    void commit(const Staged &staged) {
+        for (size_t p = 0; p < staged.size(); ++p) {
+            if (staged[p].empty()) {
+                continue;
+            }
+            const auto lock = lock_counted(partition_mutexes_[p]);
+            for (const auto& pair : staged[p]) {
+                const auto &lookup = Traits::lookup_key(pair.first);
+                Traits::upsert(partitions_[p], lookup, Traits::hash(lookup), pair.second,
+                               [this](Value &accumulator, const Value &other) { reducer_.fold(accumulator, other); });
+            }
+        }
+
+        // A completed task may end the job or lower the limit of the stragglers
+        std::lock_guard<std::mutex> lock(mutex_);
+        --remaining_;
+        changed_.notify_all();
+    }
+
+    Listener listener_;
+    size_t num_reducers_;
+    Reducer reducer_;
+    bool speculative_;
+    BlockCodec codec_ = BlockCodec::None;
+    std::chrono::milliseconds task_timeout_{60000};
+    size_t num_owners_ = 0;
+    std::unique_ptr<TaskTracker> tracker_;
+    const std::vector<std::string_view> *splits_ = nullptr;
+    std::vector<Arena> arenas_;
+    std::vector<Partition> partitions_;
+    std::vector<std::mutex> partition_mutexes_;
+    // The reduced partitions of every owner
+    std::vector<Result> owner_results_;
+
+    // Task state, guarded by mutex_
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<size_t> pending_;
+    std::vector<Connection *> busy_;
+    // Connections that did not say hello yet
+    std::vector<Connection *> greeting_;
+    size_t remaining_ = 0;
+    size_t num_workers_ = 0;
+    std::vector<std::string> owner_addresses_;
+    std::vector<Connection *> owners_;
+    // The attempt of every task whose output counts, attempts are numbered from 1
+    std::vector<uint32_t> winners_;
+    uint32_t next_attempt_ = 1;
+    std::string failure_;
+};
+
+// **************************************************************************************
+//
+// Class: ShuffleServer
+// Description: The partitions that a worker owns when the workers reduce the job, see
+//              Distributed execution above.  The other workers connect to its port and send
+//              it the pairs of the partitions that it owns, one thread per connection stages
+//              them by the attempt of the task that they belong to.  Only the attempts that
+//              the coordinator names in Reduce are folded, the output of the copies of a task
+//              that lost or failed stays in the stage.
+//
+// **************************************************************************************
+
+template <typename Key, typename Value>
+class ShuffleServer {
+public:
+    using Pairs = std::vector<std::pair<Key, Value>>;
+
+    // Listen on a port that the system picks
+    ShuffleServer() : listener_(0), acceptor_([this]() { accept(); }) {}
+
+    ~ShuffleServer() {
+        stopping_ = true;
+        acceptor_.join();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (auto& peer : peers_) {
+                peer->interrupt();
+            }
+        }
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    ShuffleServer(const ShuffleServer &) = delete;
+    ShuffleServer &operator=(const ShuffleServer &) = delete;
+
+    uint16_t port() const {
+        return listener_.port();
+    }
+
+    // Stage pairs of a partition for the attempt
+    void stage(uint32_t attempt, uint32_t partition, Pairs pairs) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        staged_[attempt].emplace_back(partition, std::move(pairs));
+    }
+
+    // Remove the staged partitions of the attempt and return them
+    std::vector<std::pair<uint32_t, Pairs>> take(uint32_t attempt) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<std::pair<uint32_t, Pairs>> partitions;
+        const auto staged = staged_.find(attempt);
+        if (staged != staged_.end()) {
+            partitions.swap(staged->second);
+            staged_.erase(staged);
+        }
+        return partitions;
+    }
+
+private:
+    void accept() {
+        while (!stopping_) {
+            std::unique_ptr<Connection> connection = listener_.accept(std::chrono::milliseconds(100));
+            if (connection) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                peers_.push_back(std::move(connection));
+                threads_.emplace_back([this, peer = peers_.back().get()]() { serve(*peer); });
+            }
+        }
+    }
+
+    // Stage the partitions of one worker.  ShuffleDone is answered once everything that the
+    // worker sent before it is staged.
+    void serve(Connection &peer) {
+        try {
+            Pairs pairs;
+            for (std::string payload;;) {
+                const MessageType type = peer.receive(payload);
+                MessageReader reader(payload);
+                uint32_t attempt;
+                SpillCodec<uint32_t>::read(reader, attempt);
+                if (type == MessageType::ShuffleDone && reader.at_end()) {
+                    peer.send(MessageType::ShuffleAck, payload);
+                    continue;
+                }
+                if (type != MessageType::Shuffle) {
+                    break;
+                }
+                const uint32_t partition = read_partition(reader, payload.size(), max_partitions, pairs);
+                stage(attempt, partition, std::move(pairs));
+                pairs = Pairs();
+            }
+        } catch (const std::exception &) {
+            // The worker is gone, the coordinator gives its task to another worker
+        }
+        peer.interrupt();
+    }
+
+    Listener listener_;
+    std::atomic<bool> stopping_{false};
+    std::mutex mutex_;
+    std::map<uint32_t, std::vector<std::pair<uint32_t, Pairs>>> staged_;
+    std::vector<std::unique_ptr<Connection>> peers_;
+    std::vector<std::thread> threads_;
+    // Started last, it uses the members above
+    std::thread acceptor_;
+};
+
+// **************************************************************************************
+//
+// Function: run_worker
+// Description: Run the tasks that the coordinator at the address hands out until it sends
+//              Shutdown.  The job is a callable that runs the job on one split and returns
+//              its reduced pairs.  They are sent by partition to the coordinator, or to the
+//              workers that own the partitions when the coordinator names owners.  A worker
+//              that owns partitions folds their pairs with the reducer when the coordinator
+//              asks for them.
+//
+// Parameters:
+//   - address: HOST:PORT of the coordinator
+//   - job: Callable that takes a std::string_view split and returns the pairs of the split
+//   - codec: Codec of the partitions that are sent
+//   - reducer: The reducer of the job, a streaming reducer
+//
+// **************************************************************************************
+
+template <typename Key, typename Value, typename Reducer, typename Hash = std::hash<Key>, typename Job>
+void run_worker(const std::string &address, Job &&job, BlockCodec codec = BlockCodec::None, Reducer reducer = Reducer()) {
+    static_assert(is_streaming_reducer<Reducer>::value, "A distributed job needs a streaming reducer");
+    using Traits = KeyTraits<Key, Hash>;
+    using Pairs = std::vector<std::pair<Key, Value>>;
+
+    ShuffleServer<Key, Value> server;
+    std::unique_ptr<Connection> coordinator = Connection::connect(address);
+    coordinator->set_codec(codec);
+    MessageWriter hello;
+    SpillCodec<uint32_t>::write(hello, static_cast<uint32_t>(server.port()));
+    coordinator->send(MessageType::Hello, hello.bytes());
+
+    // The index of this worker and the workers that own the partitions, none when the
+    // coordinator reduces them.  The connections to the owners are made on first use.
+    uint32_t index = 0;
+    uint32_t num_partitions = 0;
+    std::vector<std::string> owners;
+    std::vector<std::unique_ptr<Connection>> peers;
+    for (std::string payload;;) {
+        const MessageType type = coordinator->receive(payload);
+        MessageReader reader(payload);
+        if (type == MessageType::Owners) {
+            uint32_t num_owners;
+            SpillCodec<uint32_t>::read(reader, index);
+            SpillCodec<uint32_t>::read(reader, num_partitions);
+            SpillCodec<uint32_t>::read(reader, num_owners);
+            if (num_partitions == 0 || num_partitions > max_partitions || num_owners == 0 || num_owners > num_partitions) {
+                throw std::runtime_error("Coordinator sent an invalid number of owners");
+            }
+            owners.resize(num_owners);
+            for (auto& owner : owners) {
+                SpillCodec<std::string>::read(reader, owner);
+            }
+            peers.resize(num_owners);
+            continue;
+        }
+
+        if (type == MessageType::Reduce) {
+            MAPREDUCE_SPAN("owned partitions");
+            if (index >= owners.size()) {
+                throw std::runtime_error("Coordinator asked a worker that owns no partitions to reduce");
+            }
+            using Partition = typename Traits::template Table<Value>;
+            const uint32_t num_owners = static_cast<uint32_t>(owners.size());
+            const uint32_t num_owned = (num_partitions - index + num_owners - 1) / num_owners;
+            std::vector<Arena> arenas(num_owned);
+            std::vector<Partition> partitions;
+            for (uint32_t k = 0; k < num_owned; ++k) {
+                partitions.push_back(Traits::template make_table<Value>(&arenas[k], num_partitions, index + k * num_owners));
+            }
+            // Fold the stage of every task attempt that the coordinator counted
+            uint32_t num_attempts;
+            SpillCodec<uint32_t>::read(reader, num_attempts);
+            for (uint32_t i = 0; i < num_attempts; ++i) {
+                uint32_t attempt;
+                SpillCodec<uint32_t>::read(reader, attempt);
+                for (const auto& staged : server.take(attempt)) {
+                    if (staged.first >= num_partitions || staged.first % num_owners != index) {
+                        throw std::runtime_error("Received a partition that this worker does not own");
+                    }
+                    Partition &partition = partitions[staged.first / num_owners];
+                    for (const auto& pair : staged.second) {
+                        const auto &lookup = Traits::lookup_key(pair.first);
+                        Traits::upsert(partition, lookup, Traits::hash(lookup), pair.second,
+                                       [&reducer](Value &accumulator, const Value &other) { reducer.fold(accumulator, other); });
+                    }
+                }
+            }
+            for (uint32_t k = 0; k < num_owned; ++k) {
+                Pairs pairs;
+                for (auto&& entry : partitions[k]) {
+                    pairs.emplace_back(Key(entry.first), std::move(entry.second));
+                }
+                send_partition<Key, Value>(*coordinator, MessageType::ReduceOutput, index, index + k * num_owners, pairs.begin(), pairs.end());
+            }
+            coordinator->send(MessageType::ReduceDone, std::string_view());
+            continue;
+        }
+
+        if (type != MessageType::Task) {
+            return;
+        }
+        uint32_t task_id;
+        uint32_t attempt;
+        uint32_t task_partitions;
+        std::string split;
+        SpillCodec<uint32_t>::read(reader, task_id);
+        SpillCodec<uint32_t>::read(reader, attempt);
+        SpillCodec<uint32_t>::read(reader, task_partitions);
+        SpillCodec<std::string>::read(reader, split);
+        if (task_partitions == 0 || task_partitions > max_partitions || (!owners.empty() && task_partitions != num_partitions)) {
+            // The connection is closed when the exception leaves
+            throw std::runtime_error("Coordinator sent an invalid number of partitions");
+        }
+
+        Pairs pairs = job(std::string_view(split));
+
+        // Group the pairs by partition and send every partition that is not empty, to the
+        // coordinator or to its owner
+        std::vector<std::vector<const std::pair<Key, Value> *>> partitions(task_partitions);
+        for (const auto& pair : pairs) {
+            partitions[Traits::partition(Traits::hash(Traits::lookup_key(pair.first)), task_partitions)].push_back(&pair);
+        }
+        std::vector<bool> shuffled(owners.size());
+        for (uint32_t p = 0; p < task_partitions; ++p) {
+            if (partitions[p].empty()) {
+                continue;
+            }
+            if (owners.empty()) {
+                send_partition<Key, Value>(*coordinator, MessageType::Partition, task_id, p, partitions[p].begin(), partitions[p].end());
+                continue;
+            }
+            const uint32_t owner = p % static_cast<uint32_t>(owners.size());
+            if (owner == index) {
+                Pairs owned;
+                owned.reserve(partitions[p].size());
+                for (const auto *pair : partitions[p]) {
+                    owned.push_back(*pair);
+                }
+                server.stage(attempt, p, std::move(owned));
+                continue;
+            }
+            if (!peers[owner]) {
+                peers[owner] = Connection::connect(owners[owner]);
+                peers[owner]->set_codec(codec);
+            }
+            send_partition<Key, Value>(*peers[owner], MessageType::Shuffle, attempt, p, partitions[p].begin(), partitions[p].end());
+            shuffled[owner] = true;
+        }
+        // The task only counts once every owner staged its pairs
+        for (uint32_t owner = 0; owner < shuffled.size(); ++owner) {
+            if (!shuffled[owner]) {
+                continue;
+            }
+            MessageWriter done;
+            SpillCodec<uint32_t>::write(done, attempt);
+            peers[owner]->send(MessageType::ShuffleDone, done.bytes());
+            std::string ack;
+            if (peers[owner]->receive(ack) != MessageType::ShuffleAck || ack != done.bytes()) {
+                throw std::runtime_error("Worker that owns a partition did not take it");
+            }
+        }
+        MessageWriter done;
+        SpillCodec<uint32_t>::write(done, task_id);
+        coordinator->send(MessageType::TaskDone, done.bytes());
+    }
+}
+
+#endif
+
+// **************************************************************************************
+//
+// Word count job
+// Description: The mappers and the reducer of the word count job.  WordCountMapper emits the
+//              words of map_function, InterningWordCountMapper emits the ids of the words in
+//              a TermDictionary instead.  The reducer forwards to reduce_function above.
+//
+// **************************************************************************************
+
+template <typename Normalizer>
+struct NormalizedWordCountMapper {
+    template <typename Emit>
+    void operator()(std::string_view input, Emit &emit) const {
+        map_function<Normalizer>(input, emit);
+    }
+};
+
+using WordCountMapper = NormalizedWordCountMapper<DefaultNormalization>;
+
+struct InterningWordCountMapper {
+    explicit InterningWordCountMapper(TermDictionary *dictionary) : dictionary(dictionary) {}
+
+    // A copy starts with an empty cache - every map thread builds its own
+    InterningWordCountMapper(const InterningWordCountMapper &other) : dictionary(other.dictionary) {}
+
+    template <typename Emit>
+    void operator()(std::string_view input, Emit &emit) {
+        map_function(input, [&](std::string_view word, int count) {
+            // The thread's cache of ids means that the shared dictionary is only locked the
+            // first time a thread sees a word
+            const uint64_t hash = hash_bytes(word);
+            auto cached = cache.try_emplace(word, hash, 0);
+            if (cached.second) {
+                *cached.first = dictionary->intern(word, hash);
+            }
+            emit(TermId{*cached.first}, count);
+        });
+    }
+
+    TermDictionary *dictionary;
+    FlatStringMap<uint32_t> cache;
+};
+
+struct WordCountReducer {
+    // Sums are associative and commutative so the counts can be folded on arrival
+    static constexpr bool associative = true;
+    void fold(int &accumulator, int value) const {
+        accumulator += value;
+    }
+
+    template <typename Key>
+    int operator()(const Key &, const std::vector<int> &values) const {
+        return reduce_function(values);
+    }
+};
+
+// Options of the word count program, see parse_options
+struct Options {
+    bool list_reduce = false;
+    bool use_combiner = true;
+    bool sorted = true;
+    bool intern = false;
+    size_t num_threads = 0;
+    size_t num_reducers = 0;
+    size_t split_size = 1 << 20;
+    size_t memory_budget = 0;
+    std::string spill_directory;
+    size_t inline_threshold = default_inline_threshold;
+    bool numa = false;
+    bool hot_keys = true;
+    bool pipelined = false;
+    bool speculative = false;
+    size_t top_k = 0;
+    bool approximate = false;
+    bool benchmark = false;
+    size_t corpus_size = 32 << 20;
+    size_t vocabulary = 100000;
+    double zipf_exponent = 1.0;
+    size_t repeat = 3;
+    std::string output_directory;
+    std::string metrics_path;
+    std::string trace_path;
+    bool binary_output = false;
+    BlockCodec codec = BlockCodec::None;
+    uint16_t coordinator_port = 0;
+    std::chrono::milliseconds task_timeout{60000};
+    size_t reduce_workers = 0;
+    std::string worker_address;
+    std::string normalization = "default";
+    std::string cache_directory;
+    bool async_read = false;
+    size_t read_ahead = 4;
+    size_t read_buffer_size = 16 << 20;
+    bool direct_io = false;
+    bool stream = false;
+    uint16_t stream_port = 0;
+    std::chrono::milliseconds window_length{10000};
+    std::chrono::milliseconds window_slide{0};
+    std::vector<std::string> input_paths;
+};
+
+// Parse a size in bytes with an optional K, M or G suffix
+size_t parse_size(const char *text) {
+    char *suffix = nullptr;
+    size_t size = std::strtoull(text, &suffix, 10);
+    switch (*suffix) {
+    case 'G': case 'g': size <<= 10; [[fallthrough]];
+    case 'M': case 'm': size <<= 10; [[fallthrough]];
+    case 'K': case 'k': size <<= 10; break;
+    default: break;
+    }
+    return size;
+}
+
+// Parse a TCP port, returns false unless the text is a number from 1 to 65535
+bool parse_port(const char *text, uint16_t &port) {
+    if (*text < '0' || *text > '9') {
+        return false;
+    }
+    char *end = nullptr;
+    const unsigned long value = std::strtoul(text, &end, 10);
+    if (*end != '\0' || value == 0 || value > 65535) {
+        return false;
+    }
+    port = static_cast<uint16_t>(value);
+    return true;
+}
+
+// **************************************************************************************
+//
+// Function: parse_options
+// Description: Parse the command line of the program.
+//
+//   --list-reduce      Collect the counts of every word in a list and sum them in the reduce
+//                      phase instead of folding them on arrival
+//   --no-combiner      Like --list-reduce, and push a value for every word through the shuffle
+//   --intern           Shuffle and reduce dictionary ids instead of the words
+//   --threads N        Number of map threads
+//   --reducers N       Number of reducer partitions
+//   --split-size N     Size in bytes of the splits that the input files are divided into
+//   --memory-budget N  Spill the intermediate data to disk once it uses more than N bytes
+//   --spill-dir DIR    Directory of the spill files, by default $TMPDIR or /tmp
+//   --inline-threshold N
+//                      Run inputs of fewer than N bytes on a single thread, 0 never does
+//   --pipeline         Reduce the output of the map tasks while the map phase is running
+//   --speculate        Run backup copies of map tasks that take much longer than the others
+//   --numa             Pin the threads to cores and keep their data on their NUMA node
+//   --no-hot-keys      Reduce frequent words with their partition, see split_hot_keys
+//   --metrics FILE     Write a JSON report of the metrics of the run, see Metrics
+//   --trace FILE       Write the spans of the run as Chrome trace events
+//   --benchmark        Time the stages of the job on a synthetic corpus, see run_benchmark
+//   --corpus-size N    Size in bytes of the corpus of --benchmark
+//   --vocabulary N     Number of distinct words of the corpus
+//   --zipf S           Exponent of the Zipf distribution of the words
+//   --repeat N         Number of runs of every benchmark, the best one counts
+//   --coordinator PORT Hand the splits of the input files to the workers that connect on
+//                      the port and reduce their output, see Distributed execution
+//   --task-timeout SECONDS
+//                      Time that a worker has for a task before the task goes to another
+//                      worker, 60 by default, 0 for no limit
+//   --reduce-workers N Let the first N workers reduce the partitions, the workers send
+//                      their output straight to them instead of to the coordinator
+//   --worker HOST:PORT Run the tasks of the coordinator at the address instead of reading
+//                      input files
+//   --normalize NAME   Normalization of the words, see Normalization policies: default
+//                      (lower case without punctuation), exact (the words as they are) or
+//                      search (split at punctuation, no stopwords, plurals stemmed)
+//   --cache DIR        Keep the counts of every split in DIR and only map the splits that
+//                      changed since the last run, see Result cache
+//   --async-read       Read the input files with io_uring (or a pread thread) into a pool of
+//                      buffers ahead of the map threads instead of mapping them, see
+//                      run_async_word_count
+//   --read-ahead N     Number of buffers of --async-read, 4 by default
+//   --read-buffer N    Size in bytes of a buffer of --async-read, 16M by default
+//   --direct-io        Open the input files of --async-read with O_DIRECT
+//   --stream           Count the words of standard input in windows of time, see Streaming
+//   --stream-port PORT Like --stream, reading the TCP connections on the port
+//   --window SECONDS   Length of the windows of --stream, 10 by default
+//   --slide SECONDS    Time between two windows, by default the length of a window which
+//                      makes the windows tumbling.  The length must be a multiple of it.
+//   --unsorted         Print the words in no particular order instead of sorting them
+//   --top K            Only print the K most frequent words, the most frequent first
+//   --approximate      Find the words of --top K with approximate counts in fixed memory,
+//                      see SpaceSaving
+//   --output-dir DIR   Write the results to one file per reducer partition in the directory,
+//                      part-00000 and so on, instead of printing them
+//   --binary-output    Write the results in the binary format of write_binary_results
+//   --compress CODEC   Compress spill files, messages and binary results with none, lz4 or
+//                      zstd - the latter two only when the program is built with them
+//
+// All other arguments are the paths of the input files.  Sizes accept a K, M or G suffix.
+//
+// Returns:
+//   false if the command line is invalid.
+//
+// **************************************************************************************
+
+bool parse_options(int argc, const char *argv[], Options &options) {
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--list-reduce") == 0) {
+            options.list_reduce = true;
+        } else if (std::strcmp(argv[i], "--no-combiner") == 0) {
+            options.list_reduce = true;
+            options.use_combiner = false;
+        } else if (std::strcmp(argv[i], "--intern") == 0) {
+            options.intern = true;
+        } else if (std::strcmp(argv[i], "--pipeline") == 0) {
+            options.pipelined = true;
+        } else if (std::strcmp(argv[i], "--speculate") == 0) {
+            options.speculative = true;
+        } else if (std::strcmp(argv[i], "--numa") == 0) {
+            options.numa = true;
+        } else if (std::strcmp(argv[i], "--no-hot-keys") == 0) {
+            options.hot_keys = false;
+        } else if (std::strcmp(argv[i], "--unsorted") == 0) {
+            options.sorted = false;
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            options.num_threads = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--reducers") == 0 && i + 1 < argc) {
+            options.num_reducers = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--split-size") == 0 && i + 1 < argc) {
+            options.split_size = parse_size(argv[++i]);
+        } else if (std::strcmp(argv[i], "--memory-budget") == 0 && i + 1 < argc) {
+            options.memory_budget = parse_size(argv[++i]);
+        } else if (std::strcmp(argv[i], "--spill-dir") == 0 && i + 1 < argc) {
+            options.spill_directory = argv[++i];
+        } else if (std::strcmp(argv[i], "--inline-threshold") == 0 && i + 1 < argc) {
+            options.inline_threshold = parse_size(argv[++i]);
+        } else if ((std::strcmp(argv[i], "--metrics") == 0 || std::strcmp(argv[i], "--trace") == 0) && i + 1 < argc) {
+#if defined(MAPREDUCE_METRICS)
+            (argv[i][2] == 'm' ? options.metrics_path : options.trace_path) = argv[i + 1];
+            ++i;
+#else
+            std::cerr << argv[i] << " needs a build with MAPREDUCE_METRICS defined" << std::endl;
+            return false;
+#endif
+        } else if (std::strcmp(argv[i], "--benchmark") == 0) {
+            options.benchmark = true;
+        } else if (std::strcmp(argv[i], "--corpus-size") == 0 && i + 1 < argc) {
+            options.corpus_size = parse_size(argv[++i]);
+        } else if (std::strcmp(argv[i], "--vocabulary") == 0 && i + 1 < argc) {
+            options.vocabulary = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--zipf") == 0 && i + 1 < argc) {
+            options.zipf_exponent = std::strtod(argv[++i], nullptr);
+        } else if (std::strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            options.repeat = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            options.top_k = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--approximate") == 0) {
+            options.approximate = true;
+        } else if (std::strcmp(argv[i], "--binary-output") == 0) {
+            options.binary_output = true;
+        } else if (std::strcmp(argv[i], "--compress") == 0 && i + 1 < argc) {
+            if (!parse_block_codec(argv[++i], options.codec)) {
+                std::cerr << "Unsupported codec: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--output-dir") == 0 && i + 1 < argc) {
+            options.output_directory = argv[++i];
+        } else if (std::strcmp(argv[i], "--coordinator") == 0 && i + 1 < argc) {
+            if (!parse_port(argv[++i], options.coordinator_port)) {
+                std::cerr << "Invalid port: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--task-timeout") == 0 && i + 1 < argc) {
+            options.task_timeout = std::chrono::milliseconds(static_cast<long long>(std::llround(std::strtod(argv[++i], nullptr) * 1000)));
+        } else if (std::strcmp(argv[i], "--reduce-workers") == 0 && i + 1 < argc) {
+            options.reduce_workers = std::strtoul(argv[++i], nullptr, 10);
+        } else if (std::strcmp(argv[i], "--worker") == 0 && i + 1 < argc) {
+            options.worker_address = argv[++i];
+        } else if (std::strcmp(argv[i], "--normalize") == 0 && i + 1 < argc) {
+            options.normalization = argv[++i];
+            if (!with_normalization(options.normalization, [](auto) {})) {
+                std::cerr << "Unknown normalization: " << options.normalization << std::endl;
+                return false;
+            }
+        } else if (std::strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            options.cache_directory = argv[++i];
+        } else if (std::strcmp(argv[i], "--async-read") == 0) {
+            options.async_read = true;
+        } else if (std::strcmp(argv[i], "--read-ahead") == 0 && i + 1 < argc) {
+            options.async_read = true;
+            options.read_ahead = std::max<size_t>(std::strtoull(argv[++i], nullptr, 10), 1);
+        } else if (std::strcmp(argv[i], "--read-buffer") == 0 && i + 1 < argc) {
+            options.async_read = true;
+            // A read of io_uring returns its length as an int
+            options.read_buffer_size = std::min<size_t>(parse_size(argv[++i]), 1 << 30);
+        } else if (std::strcmp(argv[i], "--direct-io") == 0) {
+            options.async_read = true;
+            options.direct_io = true;
+        } else if (std::strcmp(argv[i], "--stream") == 0) {
+            options.stream = true;
+        } else if (std::strcmp(argv[i], "--stream-port") == 0 && i + 1 < argc) {
+            options.stream = true;
+            if (!parse_port(argv[++i], options.stream_port)) {
+                std::cerr << "Invalid port: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if ((std::strcmp(argv[i], "--window") == 0 || std::strcmp(argv[i], "--slide") == 0) && i + 1 < argc) {
+            const double seconds = std::strtod(argv[i + 1], nullptr);
+            (argv[i][2] == 'w' ? options.window_length : options.window_slide) =
+                std::chrono::milliseconds(static_cast<long long>(std::llround(seconds * 1000)));
+            ++i;
+        } else if (argv[i][0] != '-') {
+            options.input_paths.push_back(argv[i]);
+        } else {
+            std::cerr << "Unknown option: " << argv[i] << std::endl;
+            return false;
+        }
+    }
+    if (options.approximate && options.top_k == 0) {
+        std::cerr << "--approximate needs --top" << std::endl;
+        return false;
+    }
+#if defined(MAPREDUCE_HAVE_SOCKETS)
+    // A split and the output of its task must fit into a message
+    if (options.coordinator_port != 0 && options.split_size > max_message_size / 4) {
+        std::cerr << "--split-size of a distributed job must be at most " << max_message_size / 4 << " bytes" << std::endl;
+        return false;
+    }
+    if (options.coordinator_port != 0 && options.num_reducers > max_partitions) {
+        std::cerr << "A distributed job has at most " << max_partitions << " reducers" << std::endl;
+        return false;
+    }
+#endif
+    if (options.reduce_workers != 0 && options.coordinator_port == 0) {
+        std::cerr << "--reduce-workers needs --coordinator" << std::endl;
+        return false;
+    }
+    if (options.intern && (options.coordinator_port != 0 || !options.worker_address.empty())) {
+        std::cerr << "--intern can not be used in a distributed job" << std::endl;
+        return false;
+    }
+    if (options.normalization != "default" && (options.intern || options.benchmark || !options.cache_directory.empty()
+                                                || options.coordinator_port != 0 || !options.worker_address.empty())) {
+        std::cerr << "--normalize works for local jobs without --intern or --cache" << std::endl;
+        return false;
+    }
+    if (options.intern && !options.cache_directory.empty()) {
+        std::cerr << "--intern can not be used with --cache" << std::endl;
+        return false;
+    }
+    if (!options.cache_directory.empty() && (options.approximate || options.stream || options.benchmark
+                                             || options.coordinator_port != 0 || !options.worker_address.empty())) {
+        std::cerr << "--cache only works for a local word count of input files" << std::endl;
+        return false;
+    }
+    if (options.async_read && (options.intern || options.approximate || !options.cache_directory.empty() || options.stream
+                               || options.benchmark || options.coordinator_port != 0 || !options.worker_address.empty())) {
+        std::cerr << "--async-read only works for a local word count of input files" << std::endl;
+        return false;
+    }
+#if !defined(MAPREDUCE_HAVE_MMAP)
+    if (options.async_read) {
+        std::cerr << "--async-read is not supported on this platform" << std::endl;
+        return false;
+    }
+#endif
+    if (options.stream) {
+        if (options.window_slide.count() == 0) {
+            options.window_slide = options.window_length;
+        }
+        if (options.window_slide.count() <= 0 || options.window_length.count() % options.window_slide.count() != 0) {
+            std::cerr << "--window must be a positive multiple of --slide" << std::endl;
+            return false;
+        }
+        if (!options.input_paths.empty() || options.benchmark || options.coordinator_port != 0 || !options.worker_address.empty()
+            || options.binary_output || !options.output_directory.empty()) {
+            std::cerr << "--stream reads no input files and prints text to standard output" << std::endl;
+            return false;
+        }
+    }
+    if (options.spill_directory.empty()) {
+        const char *temporary = std::getenv("TMPDIR");
+        options.spill_directory = temporary != nullptr ? temporary : "/tmp";
+    }
+    return true;
+}
+
+// **************************************************************************************
+//
+// Function: write_binary_results
+// Description: Write the results in the binary result format: the magic bytes "MRB1" and
+//              then blocks (see Blocks) of at most 64KB of data, each holding whole records.
+//              A record is a word with its varint length in front followed by the zigzag
+//              varint of its count (SpillCodec<std::string> and SpillCodec<int>).
+//
+// **************************************************************************************
+
+void write_binary_results(const std::vector<std::pair<std::string, int>> &results, BlockCodec codec, OutputWriter &out) {
+    out << std::string_view("MRB1");
+    MessageWriter block;
+    std::string encoded;
+    auto write_block = [&]() {
+        encoded.clear();
+        encode_block(block.bytes(), codec, encoded);
+        out << std::string_view(encoded);
+        block.bytes().clear();
+    };
+    for (const auto& result : results) {
+        SpillCodec<std::string>::write(block, result.first);
+        SpillCodec<int>::write(block, result.second);
+        if (block.bytes().size() >= (64 << 10)) {
+            write_block();
+        }
+    }
+    if (!block.bytes().empty()) {
+        write_block();
+    }
+}
+
+// **************************************************************************************
+//
+// Function: print_results
+// Description: Write the results as "word: count" lines, or in the binary result format with
+//              --binary-output, in the order in which they are, and close the writer.
+//
+// **************************************************************************************
+
+void print_results(const std::vector<std::pair<std::string, int>> &results, const Options &options, OutputWriter &&out) {
+    if (options.binary_output) {
+        write_binary_results(results, options.codec, out);
+    } else {
+        for (const auto& result : results) {
+            out << result.first << ": " << result.second << '\n';
+        }
+    }
+    out.close();
+}
+
+// **************************************************************************************
+//
+// Function: write_partitioned_results
+// Description: Write the results to one part file per reducer partition in the output
+//              directory, every file by its own thread.  The words are assigned to the files
+//              with the partition function of the job, so with the same number of reducers a
+//              file holds exactly the words of one reducer.  Every file keeps the order of the
+//              results.
+//
+// **************************************************************************************
+
+void write_partitioned_results(std::vector<std::pair<std::string, int>> &results, const Options &options) {
+#if defined(MAPREDUCE_HAVE_MMAP)
+    if (::mkdir(options.output_directory.c_str(), 0777) != 0 && errno != EEXIST) {
+        throw std::runtime_error("Can not create " + options.output_directory + ": " + std::strerror(errno));
+    }
+#endif
+    const size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+    const size_t num_parts = options.num_reducers != 0 ? options.num_reducers
+                           : options.num_threads != 0 ? options.num_threads : hardware_threads;
+    std::vector<std::vector<std::pair<std::string, int>>> parts(num_parts);
+    for (auto& result : results) {
+        const size_t part = KeyTraits<std::string, std::hash<std::string>>::partition(hash_bytes(result.first), num_parts);
+        parts[part].push_back(std::move(result));
+    }
+    run_parallel(num_parts, [&](size_t part) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/part-%05zu", part);
+        print_results(parts[part], options, OutputWriter(options.output_directory + name));
+    });
+}
+
+// **************************************************************************************
+//
+// Function: run_word_count
+// Description: Run the word count job with the reducer path selected in the options.  The
+//              reducer and the combiner policy are template parameters, so each choice is
+//              its own compiled job.
+//
+// **************************************************************************************
+
+template <typename Key, typename Mapper>
+std::vector<std::pair<Key, int>> run_word_count(const Options &options, const std::vector<std::string_view> &input_data, const Mapper &mapper) {
+    using Reducer = WordCountReducer;
+    // Ids are not in the order of the words, the words of an interning job are sorted later
+    const bool sorted = options.sorted && options.top_k == 0 && !std::is_same<Key, TermId>::value;
+    if (!options.list_reduce) {
+        return MapReduce<std::string_view, Key, int, Mapper, Reducer, NoCombiner>(options.num_threads, options.num_reducers, mapper)
+            .set_memory_budget(options.memory_budget, options.spill_directory, options.codec)
+            .set_pipelined(options.pipelined)
+            .set_speculative(options.speculative)
+            .set_top_k(options.top_k)
+            .set_sorted(sorted)
+            .set_inline_threshold(options.inline_threshold)
+            .set_numa(options.numa)
+            .run(input_data);
+    } else if (options.use_combiner) {
+        return MapReduce<std::string_view, Key, int, Mapper, ListReducer<Reducer>, SumCombiner>(options.num_threads, options.num_reducers, mapper)
+            .set_memory_budget(options.memory_budget, options.spill_directory, options.codec)
+            .set_pipelined(options.pipelined)
+            .set_speculative(options.speculative)
+            .set_top_k(options.top_k)
+            .set_sorted(sorted)
+            .set_inline_threshold(options.inline_threshold)
+            .set_numa(options.numa)
+            .run(input_data);
+    } else {
+        return MapReduce<std::string_view, Key, int, Mapper, ListReducer<Reducer>, NoCombiner>(options.num_threads, options.num_reducers, mapper)
+            .set_memory_budget(options.memory_budget, options.spill_directory, options.codec)
+            .set_pipelined(options.pipelined)
+            .set_speculative(options.speculative)
+            .set_top_k(options.top_k)
+            .set_sorted(sorted)
+            .set_inline_threshold(options.inline_threshold)
+            .set_numa(options.numa)
+            .set_hot_keys(options.hot_keys)
+            .run(input_data);
+    }
+}
+
+// **************************************************************************************
+//
+// Result cache
+// Description: With --cache DIR a rerun of the word count only maps the splits that changed.
+//              The counts of every split are stored in the directory under the content hash
+//              of the split, together with the totals of the last run and the list of the
+//              splits that they were counted from (the manifest).  A rerun hashes its splits
+//              and compares them with the manifest: the counts of the splits that were added
+//              are added to the cached totals and the counts of the splits that are gone are
+//              subtracted.  Only added splits that are not in the cache are mapped, one job per
+//              split.  Splits are cut the same way from the start of every file, so appending a
+//              file leaves the splits of the other files unchanged, and a file that grows only
+//              changes its last split.
+//
+//              The files are in the binary result format (see write_binary_results) and are
+//              written to a temporary name and renamed, so an interrupted run leaves the cache
+//              consistent.  When the manifest or the counts of a split that is gone can not be
+//              read the totals are built from the counts of all splits again.  Once the new
+//              manifest is in place the counts of the splits that it does not name are removed,
+//              so the directory only holds the splits of the last run.
+//
+// **************************************************************************************
+
+// **************************************************************************************
+//
+// Function: read_binary_results
+// Description: Parse data in the binary result format.  Throws std::runtime_error when the
+//              data is not in the format or a block is damaged.
+//
+// **************************************************************************************
+
+std::vector<std::pair<std::string, int>> read_binary_results(std::string_view data) {
+    if (data.substr(0, 4) != "MRB1") {
+        throw std::runtime_error("Not in the binary result format");
+    }
+    data.remove_prefix(4);
+    std::vector<std::pair<std::string, int>> results;
+    std::string block;
+    while (!data.empty()) {
+        if (data.size() < block_header_size || block_stored_size(data.data()) > data.size() - block_header_size) {
+            throw std::runtime_error("Binary results are truncated");
+        }
+        const size_t stored_size = block_stored_size(data.data());
+        decode_block(data.data(), data.substr(block_header_size, stored_size), block);
+        MessageReader reader(block);
+        while (!reader.at_end()) {
+            std::pair<std::string, int> result;
+            SpillCodec<std::string>::read(reader, result.first);
+            SpillCodec<int>::read(reader, result.second);
+            results.push_back(std::move(result));
+        }
+        data.remove_prefix(block_header_size + stored_size);
+    }
+    return results;
+}
+
+// **************************************************************************************
+//
+// Class: ResultCache
+// Description: The files of the result cache in a directory, see Result cache.
+//
+// **************************************************************************************
+
+class ResultCache {
+public:
+    using Counts = std::vector<std::pair<std::string, int>>;
+
+    ResultCache(std::string directory, BlockCodec codec) : directory_(std::move(directory)), codec_(codec) {
+#if defined(MAPREDUCE_HAVE_MMAP)
+        if (::mkdir(directory_.c_str(), 0777) != 0 && errno != EEXIST) {
+            throw std::runtime_error("Can not create " + directory_ + ": " + std::strerror(errno));
+        }
+#endif
+    }
+
+    // The name of the counts of a split: two independent hashes of its bytes and its size
+    static std::string key(std::string_view split) {
+        char name[48];
+        std::snprintf(name, sizeof(name), "%016llx%08x-%zx", static_cast<unsigned long long>(hash_bytes(split)),
+                      static_cast<unsigned>(crc32c(split)), split.size());
+        return name;
+    }
+
+    // Read the counts of a split, returns false when they are not in the cache
+    bool load(const std::string &key, Counts &counts) const {
+        return read_file("split-" + key, counts);
+    }
+
+    void store(const std::string &key, const Counts &counts) const {
+        write_file("split-" + key, counts);
+    }
+
+    // Read the totals of the last run and the keys of its splits, returns false when there
+    // is no usable manifest
+    bool load_totals(std::vector<std::string> &keys, Counts &totals) const {
+        keys.clear();
+        std::string totals_name;
+        try {
+            MappedFile manifest(directory_ + "/manifest");
+            std::string_view lines = manifest.view();
+            while (!lines.empty()) {
+                const size_t end = std::min(lines.find('\n'), lines.size());
+                const std::string line(lines.substr(0, end));
+                lines.remove_prefix(std::min(end + 1, lines.size()));
+                if (totals_name.empty()) {
+                    totals_name = line;
+                } else {
+                    keys.push_back(line);
+                }
+            }
+        } catch (const std::exception &) {
+            return false;
+        }
+        return !totals_name.empty() && read_file(totals_name, totals);
+    }
+
+    // Replace the totals and the manifest.  The manifest is renamed into place last, so it
+    // always names a complete totals file.
+    void store_totals(const std::vector<std::string> &keys, const Counts &totals) const {
+        std::string list;
+        for (const auto& key : keys) {
+            list += key;
+            list += '\n';
+        }
+        char name[32];
+        std::snprintf(name, sizeof(name), "totals-%016llx", static_cast<unsigned long long>(hash_bytes(list)));
+        write_file(name, totals);
+
+        std::string previous;
+        try {
+            MappedFile manifest(directory_ + "/manifest");
+            const std::string_view lines = manifest.view();
+            previous = std::string(lines.substr(0, std::min(lines.find('\n'), lines.size())));
+        } catch (const std::exception &) {
+        }
+        {
+            OutputWriter manifest(directory_ + "/manifest.tmp");
+            manifest << std::string_view(name) << '\n' << std::string_view(list);
+            manifest.close();
+        }
+        rename(directory_ + "/manifest.tmp", directory_ + "/manifest");
+        if (!previous.empty() && previous != name) {
+            std::remove((directory_ + "/" + previous).c_str());
+        }
+        remove_stale_splits(keys);
+    }
+
+private:
+    // Remove the counts of the splits that the manifest does not name, and the temporary
+    // files of an interrupted run.  Only called once the manifest is in place, a rerun never
+    // needs the counts of a split that is in neither the manifest nor its input.
+    void remove_stale_splits(const std::vector<std::string> &keys) const {
+#if defined(MAPREDUCE_HAVE_MMAP)
+        std::unordered_set<std::string> current;
+        for (const auto& key : keys) {
+            current.insert("split-" + key);
+        }
+        DIR *directory = ::opendir(directory_.c_str());
+        if (directory == nullptr) {
+            return;
+        }
+        std::vector<std::string> stale;
+        while (const dirent *entry = ::readdir(directory)) {
+            const std::string_view name(entry->d_name);
+            if (name.substr(0, 6) == "split-" && current.count(std::string(name)) == 0) {
+                stale.emplace_back(name);
+            }
+        }
+        ::closedir(directory);
+        for (const auto& name : stale) {
+            std::remove((directory_ + "/" + name).c_str());
+        }
+#else
+        (void)keys;
+#endif
+    }
+
+    bool read_file(const std::string &name, Counts &counts) const {
+        try {
+            MappedFile file(directory_ + "/" + name);
+            counts = read_binary_results(file.view());
+            return true;
+        } catch (const std::exception &) {
+            return false;
+        }
+    }
+
+    void write_file(const std::string &name, const Counts &counts) const {
+        const std::string path = directory_ + "/" + name;
+        {
+            OutputWriter out(path + ".tmp");
+            write_binary_results(counts, codec_, out);
+            out.close();
+        }
+        rename(path + ".tmp", path);
+    }
+
+    static void rename(const std::string &from, const std::string &to) {
+        if (std::rename(from.c_str(), to.c_str()) != 0) {
+            throw std::runtime_error("Can not rename " + from + " to " + to + ": " + std::strerror(errno));
+        }
+    }
+
+    std::string directory_;
+    BlockCodec codec_;
+};
+
+// **************************************************************************************
+//
+// Function: run_cached_word_count
+// Description: Run the word count job on the splits with the result cache of the options,
+//              see Result cache.  The options of the job apply to the jobs of the changed
+//              splits, the results are in no particular order.
+//
+// **************************************************************************************
+
+std::vector<std::pair<std::string, int>> run_cached_word_count(const Options &options, const std::vector<std::string_view> &splits) {
+    MAPREDUCE_SPAN("cached job");
+    const ResultCache cache(options.cache_directory, options.codec);
+    const size_t num_threads = options.num_threads != 0 ? options.num_threads : std::max(1u, std::thread::hardware_concurrency());
+
+    // Hash the splits, every thread hashes a stride of them
+    std::vector<std::string> keys(splits.size());
+    run_parallel(std::max<size_t>(1, std::min(num_threads, splits.size())), [&](size_t worker) {
+        for (size_t i = worker; i < splits.size(); i += num_threads) {
+            keys[i] = ResultCache::key(splits[i]);
+        }
+    });
+
+    // How often every split was added (positive) or removed (negative) since the last run, in
+    // the order in which the splits are first seen
+    std::vector<std::string> previous_keys;
+    ResultCache::Counts previous_totals;
+    bool incremental = cache.load_totals(previous_keys, previous_totals);
+    std::unordered_map<std::string, size_t> first_split;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        first_split.emplace(keys[i], i);
+    }
+    std::unordered_map<std::string, long> changes;
+    std::vector<std::string> order;
+    auto count_changes = [&]() {
+        changes.clear();
+        order.clear();
+        auto change = [&](const std::string &key, long amount) {
+            auto entry = changes.try_emplace(key, 0);
+            if (entry.second) {
+                order.push_back(key);
+            }
+            entry.first->second += amount;
+        };
+        for (const auto& key : keys) {
+            change(key, 1);
+        }
+        if (incremental) {
+            for (const auto& key : previous_keys) {
+                change(key, -1);
+            }
+        }
+    };
+    count_changes();
+
+    // The jobs of splits that are not cached, with the output order and the top k left to
+    // the caller
+    Options job_options = options;
+    job_options.sorted = false;
+    job_options.top_k = 0;
+    auto split_counts = [&](const std::string &key, ResultCache::Counts &counts) {
+        if (cache.load(key, counts)) {
+            return true;
+        }
+        const auto split = first_split.find(key);
+        if (split == first_split.end()) {
+            return false;
+        }
+        std::vector<std::string_view> parts;
+        const std::string_view data = splits[split->second];
+        split_input(data, std::max<size_t>(data.size() / (4 * num_threads), 1 << 12), parts);
+        counts = run_word_count<std::string>(job_options, parts, WordCountMapper());
+        cache.store(key, counts);
+        return true;
+    };
+
+    Arena arena;
+    FlatStringMap<long> totals(&arena);
+    for (;;) {
+        totals.clear();
+        if (incremental) {
+            for (const auto& total : previous_totals) {
+                totals[total.first] += total.second;
+            }
+        }
+        bool complete = true;
+        ResultCache::Counts counts;
+        for (const auto& key : order) {
+            const long change = changes[key];
+            if (change == 0) {
+                continue;
+            }
+            if (!split_counts(key, counts)) {
+                // The counts of a split that is gone are lost, count everything again
+                complete = false;
+                break;
+            }
+            for (const auto& count : counts) {
+                totals[count.first] += change * count.second;
+            }
+        }
+        if (complete) {
+            break;
+        }
+        incremental = false;
+        count_changes();
+    }
+
+    ResultCache::Counts results;
+    results.reserve(totals.size());
+    for (auto&& total : totals) {
+        if (total.second != 0) {
+            results.emplace_back(std::string(total.first), static_cast<int>(total.second));
+        }
+    }
+    cache.store_totals(keys, results);
+    return results;
+}
+
+#if defined(MAPREDUCE_HAVE_MMAP)
+// **************************************************************************************
+//
+// Function: run_async_word_count
+// Description: Count the words of the input files with --async-read: every file is read by
+//              an AsyncFileReader and each chunk that it hands out is divided into splits for
+//              a word count job of its own, while the reads of the next --read-ahead chunks
+//              keep running.  A cold run then keeps the map threads busy instead of having
+//              them wait for page faults on a mapped file.  A chunk is cut after its last
+//              whitespace byte and the rest is carried over to the next chunk, so no word is
+//              cut in two.  The counts of the jobs are added up, the output order and the top
+//              k are left to the caller.
+//
+// **************************************************************************************
+
+template <typename Mapper>
+std::vector<std::pair<std::string, int>> run_async_word_count(const Options &options, const Mapper &mapper) {
+    MAPREDUCE_SPAN("async job");
+    const size_t num_threads = options.num_threads != 0 ? options.num_threads : std::max(1u, std::thread::hardware_concurrency());
+    Options job_options = options;
+    job_options.sorted = false;
+    job_options.top_k = 0;
+
+    Arena arena;
+    FlatStringMap<long> totals(&arena);
+    std::vector<std::string_view> splits;
+    auto count_splits = [&]() {
+        for (const auto& count : run_word_count<std::string>(job_options, splits, mapper)) {
+            totals[count.first] += count.second;
+        }
+        splits.clear();
+    };
+
+    for (const auto& path : options.input_paths) {
+        AsyncFileReader reader(path, options.read_buffer_size, options.read_ahead, options.direct_io);
+        // The words at the end of the previous chunk that may go on in the next one
+        std::string carry;
+        for (std::string_view chunk; !(chunk = reader.next()).empty();) {
+            size_t first = 0;
+            while (first < chunk.size() && !is_space_byte(chunk[first])) {
+                ++first;
+            }
+            size_t last = chunk.size();
+            while (last > first && !is_space_byte(chunk[last - 1])) {
+                --last;
+            }
+            carry.append(chunk.substr(0, first));
+            if (first == chunk.size()) {
+                // A chunk without whitespace is a part of a single word
+                continue;
+            }
+            splits.push_back(carry);
+            split_input(chunk.substr(first, last - first), std::max<size_t>(options.split_size, chunk.size() / (4 * num_threads)), splits);
+            count_splits();
+            // The buffer of the chunk is reused by the next call of next
+            carry.assign(chunk.substr(last));
+        }
+        if (!carry.empty()) {
+            splits.push_back(carry);
+            count_splits();
+        }
+    }
+
+    std::vector<std::pair<std::string, int>> results;
+    results.reserve(totals.size());
+    for (auto&& total : totals) {
+        results.emplace_back(std::string(total.first), static_cast<int>(total.second));
+    }
+    return results;
+}
+#endif
+
+#if defined(MAPREDUCE_HAVE_SOCKETS)
+// **************************************************************************************
+//
+// Streaming
+// Description: --stream counts the words of an unbounded input - standard input, or with
+//              --stream-port the TCP connections on a port, one after the other - and prints
+//              the counts of a window of time every --slide seconds.  A window of --window
+//              seconds is made of window / slide panes.  With the same window and slide the
+//              windows are tumbling, each pane is a window of its own; with a shorter slide
+//              they are sliding and overlap.
+//
+//              The input is read in chunks that end at a whitespace byte and every chunk is
+//              mapped into the combiner table of the current pane as soon as it arrives.  When
+//              a pane closes its counts are added to the running totals of the window and the
+//              counts of the pane that just left the window are subtracted, so the work of a
+//              window is proportional to the words of the two panes and not to the whole
+//              window.  The output of a window is a line "# window START-END ms", in
+//              milliseconds since the start of the stream, followed by "word: count" lines -
+//              sorted, or the most frequent ones with --top.  The stream ends when standard
+//              input does.
+//
+// **************************************************************************************
+
+// **************************************************************************************
+//
+// Class: WindowedCounts
+// Description: The counts of the panes that form the current window and their totals.  A
+//              word whose total drops to zero stays in the totals table because FlatStringMap
+//              can not erase it - the table is rebuilt from the live words once it holds more
+//              dead words than live ones.
+//
+// **************************************************************************************
+
+class WindowedCounts {
+public:
+    explicit WindowedCounts(size_t num_panes) : num_panes_(std::max<size_t>(1, num_panes)) {
+        current_ = std::make_unique<Pane>();
+        totals_ = std::make_unique<Pane>();
+    }
+
+    // Count a word in the current pane
+    void add(std::string_view word, int count) {
+        current_->counts[word] += count;
+    }
+
+    // Close the current pane: it enters the window and the oldest pane leaves it once the
+    // window is full
+    void close_pane() {
+        if (panes_.size() == num_panes_) {
+            for (auto&& entry : panes_.front()->counts) {
+                int &total = totals_->counts[entry.first];
+                total -= entry.second;
+                live_ -= total == 0 ? 1 : 0;
+            }
+            panes_.pop_front();
+        }
+        for (auto&& entry : current_->counts) {
+            int &total = totals_->counts[entry.first];
+            live_ += total == 0 ? 1 : 0;
+            total += entry.second;
+        }
+        panes_.push_back(std::move(current_));
+        current_ = std::make_unique<Pane>();
+        if (totals_->counts.size() > 2 * live_ + 1024) {
+            compact();
+        }
+    }
+
+    // Number of words in the window
+    size_t size() const { return live_; }
+
+    // The words of the window with their counts
+    std::vector<std::pair<std::string, int>> window() {
+        std::vector<std::pair<std::string, int>> results;
+        results.reserve(live_);
+        for (auto&& entry : totals_->counts) {
+            if (entry.second != 0) {
+                results.emplace_back(std::string(entry.first), entry.second);
+            }
+        }
+        return results;
+    }
+
+private:
+    // A table of counts and the arena that it allocates from
+    struct Pane {
+        Arena arena;
+        FlatStringMap<int> counts{&arena};
+    };
+
+    void compact() {
+        auto totals = std::make_unique<Pane>();
+        totals->counts.reserve(live_);
+        for (auto&& entry : totals_->counts) {
+            if (entry.second != 0) {
+                totals->counts.try_emplace(entry.first, entry.second);
+            }
+        }
+        totals_ = std::move(totals);
+    }
+
+    size_t num_panes_;
+    std::unique_ptr<Pane> current_;
+    std::deque<std::unique_ptr<Pane>> panes_;
+    std::unique_ptr<Pane> totals_;
+    // Number of words of the totals whose count is not zero
+    size_t live_ = 0;
+};
+
+// **************************************************************************************
+//
+// Function: run_stream
+// Description: Count the words of the stream, see Streaming.  Reading, mapping and closing
+//              the panes happen on one thread: poll waits for data until the current pane is
+//              due, so the windows are printed on time also while the input is quiet.
+//
+// **************************************************************************************
+
+void run_stream(const Options &options) {
+    using Clock = std::chrono::steady_clock;
+    const auto slide = options.window_slide;
+    WindowedCounts counts(static_cast<size_t>(options.window_length / slide));
+    OutputWriter out;
+
+    const auto start = Clock::now();
+    auto pane_end = start + slide;
+    // The start of the oldest pane of the window, for the header
+    std::deque<Clock::time_point> pane_starts{start};
+    auto close_pane = [&](Clock::time_point end) {
+        counts.close_pane();
+        std::vector<std::pair<std::string, int>> results = counts.window();
+        if (options.top_k != 0) {
+            TopK<std::string, int> top(options.top_k);
+            for (auto& result : results) {
+                top.push(std::move(result.first), result.second);
+            }
+            results = top.take();
+        } else if (options.sorted) {
+            std::sort(results.begin(), results.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+        }
+        using std::chrono::duration_cast;
+        using std::chrono::milliseconds;
+        out << "# window " << duration_cast<milliseconds>(pane_starts.front() - start).count() << '-'
+            << duration_cast<milliseconds>(end - start).count() << " ms\n";
+        for (const auto& result : results) {
+            out << result.first << ": " << result.second << '\n';
+        }
+        out.flush();
+        pane_starts.push_back(end);
+        if (pane_starts.size() > static_cast<size_t>(options.window_length / slide)) {
+            pane_starts.pop_front();
+        }
+    };
+
+    std::unique_ptr<Listener> listener;
+    std::unique_ptr<Connection> connection;
+    if (options.stream_port != 0) {
+        listener = std::make_unique<Listener>(options.stream_port);
+    }
+
+    // The bytes after the last whitespace of a chunk wait for the rest of their word
+    std::string buffer(1 << 16, '\0');
+    size_t pending = 0;
+    auto map_chunk = [&](size_t size) {
+        with_normalization(options.normalization, [&](auto normalization) {
+            map_function<decltype(normalization)>(std::string_view(buffer.data(), size), [&counts](std::string_view word, int count) {
+                counts.add(word, count);
+            });
+        });
+    };
+
+    for (;;) {
+        const auto now = Clock::now();
+        if (now >= pane_end) {
+            close_pane(pane_end);
+            pane_end += slide;
+            continue;
+        }
+        const int timeout = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(pane_end - now).count()) + 1;
+        if (listener && !connection) {
+            connection = listener->accept(std::chrono::milliseconds(timeout));
+            continue;
+        }
+        pollfd ready{connection ? connection->fd() : 0, POLLIN, 0};
+        if (::poll(&ready, 1, timeout) <= 0) {
+            continue;
+        }
+        if (pending == buffer.size()) {
+            // A word longer than the buffer
+            buffer.resize(2 * buffer.size());
+        }
+        const ssize_t received = ::read(ready.fd, &buffer[pending], buffer.size() - pending);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            // The end of the input maps its last word
+            map_chunk(pending);
+            pending = 0;
+            if (connection) {
+                connection.reset();
+                continue;
+            }
+            if (received < 0) {
+                throw std::runtime_error(std::string("Can not read the stream: ") + std::strerror(errno));
+            }
+            close_pane(Clock::now());
+            return;
+        }
+        const size_t size = pending + static_cast<size_t>(received);
+        size_t end = size;
+        while (end > 0 && !is_space_byte(buffer[end - 1])) {
+            --end;
+        }
+        map_chunk(end);
+        pending = size - end;
+        std::memmove(&buffer[0], &buffer[end], pending);
+    }
+}
+
+#endif
+
+// **************************************************************************************
+//
+// Benchmark
+// Description: --benchmark measures the job on a synthetic corpus instead of counting the
+//              words of input files, so that every change to the code can be compared with a
+//              baseline.  The corpus follows Zipf's law like natural text: the word of rank r
+//              occurs with a probability proportional to 1 / r^s.  Some words are capitalized
+//              or followed by a punctuation mark so the tokenizer also has to normalize.
+//
+//              The stages are timed on their own and together, every measurement is the best
+//              of --repeat runs:
+//
+//                tokenize       map_function on one thread
+//                shuffle        the job on words that were tokenized up front
+//                reduce         reduce_function over lists of counts
+//                end to end     the whole word count job for 1, 2, 4 ... threads
+//
+// **************************************************************************************
+
+// **************************************************************************************
+//
+// Function: generate_zipf_corpus
+// Description: Generate size bytes of text from a vocabulary of Zipf distributed words.  The
+//              words are made up from the bits of their rank, frequent words are shorter.
+//              The same parameters always generate the same corpus.
+//
+// **************************************************************************************
+
+std::string generate_zipf_corpus(size_t size, size_t vocabulary, double exponent, uint64_t seed = 42) {
+    vocabulary = std::max<size_t>(1, vocabulary);
+    std::vector<std::string> words(vocabulary);
+    std::vector<double> cumulative(vocabulary);
+    double total = 0;
+    for (size_t rank = 0; rank < vocabulary; ++rank) {
+        uint64_t bits = mix64(rank + 1);
+        const size_t length = 1 + std::min<size_t>(12, 1 + static_cast<size_t>(std::log2(rank + 2.0)) / 2 + bits % 3);
+        for (size_t i = 0; i < length; ++i, bits /= 26) {
+            words[rank].push_back(static_cast<char>('a' + bits % 26));
+        }
+        total += 1.0 / std::pow(static_cast<double>(rank + 1), exponent);
+        cumulative[rank] = total;
+    }
+
+    std::mt19937_64 random(seed);
+    std::uniform_real_distribution<double> uniform(0.0, total);
+    std::string corpus;
+    corpus.reserve(size + 32);
+    for (size_t count = 1; corpus.size() < size; ++count) {
+        const size_t rank = std::min(vocabulary - 1,
+            static_cast<size_t>(std::lower_bound(cumulative.begin(), cumulative.end(), uniform(random)) - cumulative.begin()));
+        const uint64_t style = random();
+        const size_t start = corpus.size();
+        corpus += words[rank];
+        if (style % 10 == 0) {
+            corpus[start] = static_cast<char>(corpus[start] - 'a' + 'A');
+        }
+        if (style % 13 == 0) {
+            corpus.push_back(",.;!?"[(style >> 8) % 5]);
+        }
+        corpus.push_back(count % 12 == 0 ? '\n' : ' ');
+    }
+    return corpus;
+}
+
+// The words of a split after tokenization, stored back to back - the input of the
+// shuffle benchmark
+struct TokenizedSplit {
+    std::string bytes;
+    std::vector<uint32_t> ends;
+};
+
+struct TokenizedSplitMapper {
+    template <typename Emit>
+    void operator()(const TokenizedSplit &split, Emit &emit) const {
+        uint32_t begin = 0;
+        for (uint32_t end : split.ends) {
+            emit(std::string_view(split.bytes.data() + begin, end - begin), 1);
+            begin = end;
+        }
+    }
+};
+
+// Time the function, the best of repeat runs in seconds
+template <typename Function>
+double best_seconds(size_t repeat, Function &&function) {
+    double best = 0;
+    for (size_t run = 0; run < std::max<size_t>(1, repeat); ++run) {
+        const auto start = std::chrono::steady_clock::now();
+        function();
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        best = run == 0 ? seconds : std::min(best, seconds);
+    }
+    return best;
+}
+
+void print_rate(const char *stage, double seconds, size_t tokens, size_t bytes) {
+    std::printf("%-24s %10.1f ms %12.2f Mtokens/s %10.1f MB/s\n", stage, seconds * 1e3,
+                tokens / seconds / 1e6, bytes / seconds / (1 << 20));
+}
+
+// **************************************************************************************
+//
+// Function: run_benchmark
+// Description: Generate the corpus and time the stages, see Benchmark above.  The number of
+//              reducers and the split size of the options apply to the jobs.
+//
+// **************************************************************************************
+
+void run_benchmark(const Options &options) {
+    const std::string corpus = generate_zipf_corpus(options.corpus_size, options.vocabulary, options.zipf_exponent);
+    std::vector<std::string_view> splits;
+    split_input(corpus, options.split_size, splits);
+    std::printf("corpus: %zu bytes, %zu splits, vocabulary %zu, exponent %.2f, kernel %s\n", corpus.size(), splits.size(),
+                options.vocabulary, options.zipf_exponent,
+                tokenizer_kernel() == TokenizerKernel::Avx2 ? "avx2" : tokenizer_kernel() == TokenizerKernel::Sse2 ? "sse2"
+                : tokenizer_kernel() == TokenizerKernel::Neon ? "neon" : "scalar");
+
+    // Tokenize on one thread
+    size_t tokens = 0;
+    const double tokenize = best_seconds(options.repeat, [&]() {
+        tokens = 0;
+        for (std::string_view split : splits) {
+            map_function(split, [&tokens](std::string_view, int) { ++tokens; });
+        }
+    });
+    print_rate("tokenize", tokenize, tokens, corpus.size());
+
+    // Shuffle and fold words that were tokenized up front
+    std::vector<TokenizedSplit> tokenized(splits.size());
+    for (size_t i = 0; i < splits.size(); ++i) {
+        map_function(splits[i], [&](std::string_view word, int) {
+            tokenized[i].bytes.append(word.data(), word.size());
+            tokenized[i].ends.push_back(static_cast<uint32_t>(tokenized[i].bytes.size()));
+        });
+    }
+    size_t distinct = 0;
+    const double shuffle = best_seconds(options.repeat, [&]() {
+        distinct = MapReduce<TokenizedSplit, std::string, int, TokenizedSplitMapper, WordCountReducer>(options.num_threads, options.num_reducers)
+            .run(tokenized).size();
+    });
+    print_rate("shuffle", shuffle, tokens, corpus.size());
+    std::printf("distinct words: %zu\n", distinct);
+
+    // Sum lists of counts
+    const std::vector<int> counts(std::max<size_t>(1, tokens), 1);
+    volatile int sum = 0;
+    const double reduce = best_seconds(options.repeat, [&]() { sum = reduce_function(counts); });
+    print_rate("reduce", reduce, counts.size(), counts.size() * sizeof(int));
+
+    // Many jobs on small documents, the latency of a job is dominated by its setup.  The first
+    // row goes through the thread pool, the second one takes the inline fast path.
+    const std::vector<std::string_view> document{std::string_view(corpus).substr(0, std::min<size_t>(corpus.size(), 4096))};
+    const size_t small_jobs = 1000;
+    for (size_t threshold : {size_t(0), default_inline_threshold}) {
+        const double seconds = best_seconds(options.repeat, [&]() {
+            for (size_t job = 0; job < small_jobs; ++job) {
+                MapReduce<std::string_view, std::string, int, WordCountMapper, WordCountReducer>(options.num_threads, options.num_reducers)
+                    .set_inline_threshold(threshold).run(document);
+            }
+        });
+        std::printf("%-24s %10.2f us/job\n", threshold == 0 ? "small jobs, pooled" : "small jobs, inline", seconds / small_jobs * 1e6);
+    }
+
+    // The whole job at increasing thread counts
+    const size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<size_t> thread_counts;
+    for (size_t threads = 1; threads < hardware_threads; threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(hardware_threads);
+    double single_thread = 0;
+    for (size_t threads : thread_counts) {
+        const double seconds = best_seconds(options.repeat, [&]() {
+            MapReduce<std::string_view, std::string, int, WordCountMapper, WordCountReducer>(threads, options.num_reducers).run(splits);
+        });
+        if (threads == 1) {
+            single_thread = seconds;
+        }
+        char stage[32];
+        std::snprintf(stage, sizeof(stage), "end to end, %zu threads", threads);
+        print_rate(stage, seconds, tokens, corpus.size());
+        std::printf("%-24s %10.2fx\n", "  speedup", single_thread / seconds);
+    }
+}
+
+// **************************************************************************************
+//
+// Tests
+// Description: A build with MAPREDUCE_TESTS defined runs the checks below instead of the
+//              program and exits with 1 if one of them fails:
+//
+//                g++ -std=c++17 -O2 -pthread -DMAPREDUCE_TESTS main.cpp -o mapreduce-tests
+//
+//              They cover the pieces that decode untrusted or damaged bytes - blocks,
+//              varints, UTF-8 and SpillCodec - with data that is truncated or corrupt as well
+//              as intact, the SIMD tokenizer kernels against the scalar one, the result
+//              cache against plain jobs, the windows of the streaming mode against recounts,
+//              and the lock-free MpscRing under several producers.  For the ring a
+//              thread sanitizer build (-fsanitize=thread) is the useful one.
+//
+// **************************************************************************************
+
+#if defined(MAPREDUCE_TESTS)
+
+// Number of failed checks of the run, checks may fail on any thread
+std::atomic<size_t> test_failures{0};
+
+#define MAPREDUCE_CHECK(condition)                                                          \
+    do {                                                                                    \
+        if (!(condition)) {                                                                 \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+            ++test_failures;                                                                \
+        }                                                                                   \
+    } while (false)
+
+// Check that the callable throws std::runtime_error
+template <typename Function>
+bool throws_runtime_error(Function &&function) {
+    try {
+        function();
+    } catch (const std::runtime_error &) {
+        return true;
+    }
+    return false;
+}
+
+void test_blocks() {
+    std::vector<BlockCodec> codecs = {BlockCodec::None};
+#if defined(MAPREDUCE_WITH_LZ4)
+    codecs.push_back(BlockCodec::Lz4);
+#endif
+#if defined(MAPREDUCE_WITH_ZSTD)
+    codecs.push_back(BlockCodec::Zstd);
+#endif
+    std::string text;
+    for (int i = 0; i < 10000; ++i) {
+        text += "the quick brown fox " + std::to_string(i % 97) + " ";
+    }
+    for (BlockCodec codec : codecs) {
+        for (std::string_view data : {std::string_view(), std::string_view("x"), std::string_view(text)}) {
+            std::string block;
+            encode_block(data, codec, block);
+            MAPREDUCE_CHECK(block.size() == block_header_size + block_stored_size(block.data()));
+            std::string decoded;
+            decode_block(block.data(), std::string_view(block).substr(block_header_size), decoded);
+            MAPREDUCE_CHECK(decoded == data);
+        }
+    }
+
+    std::string block;
+    encode_block(text, BlockCodec::None, block);
+    const std::string_view stored = std::string_view(block).substr(block_header_size);
+    std::string decoded;
+    // A damaged stored byte fails the checksum
+    std::string damaged = block;
+    damaged[block_header_size + 100] ^= 1;
+    MAPREDUCE_CHECK(throws_runtime_error([&]() { decode_block(damaged.data(), std::string_view(damaged).substr(block_header_size), decoded); }));
+    // Stored bytes that are cut short fail the checksum as well
+    MAPREDUCE_CHECK(throws_runtime_error([&]() { decode_block(block.data(), stored.substr(0, stored.size() - 1), decoded); }));
+    // The header is not covered by the checksum, a bad raw size must fail before it is
+    // allocated, for a stored block as for a compressed one
+    for (uint32_t raw_size : {0xFFFFFFFFu, max_block_size + 1, static_cast<uint32_t>(text.size() + 1), 0u}) {
+        damaged = block;
+        std::memcpy(&damaged[0], &raw_size, sizeof(raw_size));
+        decoded = std::string();
+        MAPREDUCE_CHECK(throws_runtime_error([&]() { decode_block(damaged.data(), stored, decoded); }));
+        MAPREDUCE_CHECK(decoded.capacity() <= text.size());
+        damaged[8] = static_cast<char>(BlockCodec::Lz4);
+        if (raw_size > max_block_size) {
+            MAPREDUCE_CHECK(throws_runtime_error([&]() { decode_block(damaged.data(), stored, decoded); }));
+            MAPREDUCE_CHECK(decoded.capacity() <= text.size());
+        }
+    }
+    damaged = block;
+    damaged[8] = 99;
+    MAPREDUCE_CHECK(throws_runtime_error([&]() { decode_block(damaged.data(), stored, decoded); }));
+}
+
+void test_varints() {
+    const uint64_t values[] = {0, 1, 127, 128, 16383, 16384, 0xFFFFFFFFull, 0x8000000000000000ull, 0xFFFFFFFFFFFFFFFFull};
+    const size_t sizes[] = {1, 1, 1, 2, 2, 3, 5, 10, 10};
+    for (size_t i = 0; i < std::size(values); ++i) {
+        MessageWriter writer;
+        write_varint(writer, values[i]);
+        MAPREDUCE_CHECK(writer.bytes().size() == sizes[i]);
+        MessageReader reader(writer.bytes());
+        MAPREDUCE_CHECK(read_varint(reader) == values[i]);
+        MAPREDUCE_CHECK(reader.at_end());
+        // Every prefix of the varint is truncated
+        for (size_t size = 0; size < writer.bytes().size(); ++size) {
+            MessageReader prefix(std::string_view(writer.bytes()).substr(0, size));
+            MAPREDUCE_CHECK(throws_runtime_error([&]() { read_varint(prefix); }));
+        }
+    }
+    const std::string endless(11, '\x80');
+    MessageReader reader(endless);
+    MAPREDUCE_CHECK(throws_runtime_error([&]() { read_varint(reader); }));
+    // A tenth byte with more than the top bit overflows, 1 is the largest one that fits
+    for (int last = 0; last < 0x100; ++last) {
+        const std::string overflow = std::string(9, '\xFF') + static_cast<char>(last);
+        MessageReader overflow_reader(overflow);
+        if (last <= 1) {
+            MAPREDUCE_CHECK(read_varint(overflow_reader) == (last == 0 ? 0x7FFFFFFFFFFFFFFFull : 0xFFFFFFFFFFFFFFFFull));
+        } else {
+            MAPREDUCE_CHECK(throws_runtime_error([&]() { read_varint(overflow_reader); }));
+        }
+    }
+
+    // Zigzag keeps small negative values short
+    const int64_t signed_values[] = {0, -1, 1, -64, 63, -65, std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max()};
+    for (int64_t value : signed_values) {
+        MessageWriter writer;
+        SpillCodec<int64_t>::write(writer, value);
+        MAPREDUCE_CHECK((writer.bytes().size() == 1) == (value >= -64 && value <= 63));
+        MessageReader signed_reader(writer.bytes());
+        int64_t decoded;
+        SpillCodec<int64_t>::read(signed_reader, decoded);
+        MAPREDUCE_CHECK(decoded == value);
+    }
+    for (int value : {std::numeric_limits<int>::min(), -1, 0, std::numeric_limits<int>::max()}) {
+        MessageWriter writer;
+        SpillCodec<int>::write(writer, value);
+        MessageReader int_reader(writer.bytes());
+        int decoded;
+        SpillCodec<int>::read(int_reader, decoded);
+        MAPREDUCE_CHECK(decoded == value);
+    }
+}
+
+// The words that a tokenizer emits for the input
+template <typename Tokenize>
+std::vector<std::string> tokenize_words(Tokenize tokenize, std::string_view input) {
+    std::vector<std::string> words;
+    auto emit = [&words](std::string_view word, int) { words.emplace_back(word); };
+    tokenize(input, emit);
+    return words;
+}
+
+// Check that every SIMD kernel this CPU has gives the words of the scalar tokenizer
+template <typename Normalizer>
+void check_tokenizer_kernels(std::string_view input) {
+    const auto expected = tokenize_words([](std::string_view text, auto &emit) { tokenize_scalar<Normalizer>(text, emit); }, input);
+#if defined(MAPREDUCE_SIMD_X86)
+    MAPREDUCE_CHECK(tokenize_words([](std::string_view text, auto &emit) { tokenize_simd<Normalizer, Sse2Kernel>(text, emit); }, input) == expected);
+#if defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2")) {
+        MAPREDUCE_CHECK(tokenize_words([](std::string_view text, auto &emit) { tokenize_simd<Normalizer, Avx2Kernel>(text, emit); }, input) == expected);
+    }
+#endif
+#elif defined(MAPREDUCE_SIMD_NEON)
+    MAPREDUCE_CHECK(tokenize_words([](std::string_view text, auto &emit) { tokenize_simd<Normalizer, NeonKernel>(text, emit); }, input) == expected);
+#endif
+}
+
+void test_tokenizer() {
+    // Valid sequences of every length decode to their code point
+    const std::pair<std::string_view, char32_t> valid[] = {
+        {"a", 'a'}, {"\xc3\xa9", 0xe9}, {"\xe2\x82\xac", 0x20ac}, {"\xf0\x9d\x84\x9e", 0x1d11e}, {"\xf4\x8f\xbf\xbf", 0x10ffff},
+    };
+    for (const auto& [bytes, code_point] : valid) {
+        const char *position = bytes.data();
+        MAPREDUCE_CHECK(decode_utf8(position, bytes.data() + bytes.size()) == code_point);
+        MAPREDUCE_CHECK(position == bytes.data() + bytes.size());
+        std::string encoded;
+        append_utf8(encoded, code_point);
+        MAPREDUCE_CHECK(encoded == bytes);
+    }
+    // Truncated, overlong, surrogate and out of range sequences, stray continuation bytes and
+    // bad continuations are rejected one byte at a time
+    const std::string_view invalid[] = {
+        "\xc3", "\xe2\x82", "\xf0\x9d\x84", "\xc0\x80", "\xc1\xbf", "\xe0\x80\x80", "\xe0\x9f\xbf", "\xf0\x80\x80\x80",
+        "\xf0\x8f\xbf\xbf", "\xed\xa0\x80", "\xed\xbf\xbf", "\xf4\x90\x80\x80", "\xf5\x80\x80\x80", "\xff", "\x80", "\xc3" "A",
+    };
+    for (std::string_view bytes : invalid) {
+        const char *position = bytes.data();
+        MAPREDUCE_CHECK(decode_utf8(position, bytes.data() + bytes.size()) == invalid_code_point);
+        MAPREDUCE_CHECK(position == bytes.data() + 1);
+    }
+
+    // Simple case folding, including the irregular mappings of Latin Extended-B, scripts
+    // outside of the BMP and code points that only have a full or Turkic folding
+    const std::pair<char32_t, char32_t> folds[] = {
+        {'A', 'a'}, {'z', 'z'}, {0xc0, 0xe0}, {0xd7, 0xd7}, {0xb5, 0x3bc}, {0x178, 0xff}, {0x17f, 's'},
+        {0x181, 0x253}, {0x182, 0x183}, {0x186, 0x254}, {0x189, 0x256}, {0x18f, 0x259}, {0x190, 0x25b},
+        {0x1a0, 0x1a1}, {0x1a1, 0x1a1}, {0x1af, 0x1b0}, {0x1c5, 0x1c6}, {0x1f6, 0x195}, {0x220, 0x19e},
+        {0x23a, 0x2c65}, {0x24e, 0x24f}, {0x3d8, 0x3d9}, {0x3ee, 0x3ef}, {0x3c2, 0x3c3}, {0x410, 0x430},
+        {0x1e9e, 0xdf}, {0x212a, 'k'}, {0xab70, 0x13a0}, {0xff21, 0xff41}, {0x10400, 0x10428}, {0x1e921, 0x1e943},
+        {0x130, 0x130}, {0xdf, 0xdf}, {0x3000, 0x3000}, {0x10ffff, 0x10ffff},
+    };
+    for (const auto& [code_point, folded] : folds) {
+        MAPREDUCE_CHECK(fold_case(code_point) == folded);
+    }
+    // Folding is idempotent
+    for (char32_t c = 0; c < 0x20000; ++c) {
+        MAPREDUCE_CHECK(fold_case(fold_case(c)) == fold_case(c));
+    }
+
+    // Upper and lower case forms count as the same word, and Unicode whitespace separates
+    // words under every table - also under one that keeps every byte
+    const auto folded = tokenize_words([](std::string_view text, auto &emit) { tokenize_scalar<DefaultNormalization>(text, emit); },
+                                       "\xc6\xa0n \xc6\xa1n \xc3\x89T\xc3\x89");
+    MAPREDUCE_CHECK((folded == std::vector<std::string>{"\xc6\xa1n", "\xc6\xa1n", "\xc3\xa9t\xc3\xa9"}));
+    const auto exact = tokenize_words([](std::string_view text, auto &emit) { tokenize_scalar<ExactNormalization>(text, emit); },
+                                      "A\xc2\xa0" "b c\xe3\x80\x80" "D");
+    MAPREDUCE_CHECK((exact == std::vector<std::string>{"A", "b", "c", "D"}));
+
+    // The SIMD kernels agree with the scalar tokenizer on mixed text and on random bytes, at
+    // every length so that the words cross the block boundaries and end in the padded tail
+    const std::string_view pieces[] = {
+        "word", "Word", "WORD", "don't", "x", "42", " ", "  ", "\t", "\n", "\r\n", ",", "...", "!?", "\xc3\xa9t\xc3\xa9",
+        "\xc3\x89T\xc3\x89", "\xc6\xa0n", "\xce\xa3\xcf\x82", "\xd0\x9c\xd0\xb8\xd1\x80", "\xe2\x80\x94", "\xc2\xa0",
+        "\xe3\x80\x80", "\xe3\x80\x82", "\xe6\x97\xa5\xe6\x9c\xac", "\xf0\x9f\x98\x80", "\xf0\x90\x90\x80", "\xff", "\xc3", "\x80",
+    };
+    std::mt19937 random(2024);
+    for (size_t length = 0; length < 400; ++length) {
+        std::string mixed;
+        while (mixed.size() < length) {
+            mixed += pieces[random() % std::size(pieces)];
+        }
+        std::string bytes(length, '\0');
+        for (char &byte : bytes) {
+            byte = static_cast<char>(random());
+        }
+        for (const std::string &input : {mixed, bytes}) {
+            check_tokenizer_kernels<DefaultNormalization>(input);
+            check_tokenizer_kernels<ExactNormalization>(input);
+            check_tokenizer_kernels<SearchNormalization>(input);
+        }
+    }
+}
+
+void test_spill_codecs() {
+    const std::string long_string(3 * spill_read_chunk + 5, 'w');
+    for (const std::string &value : {std::string(), std::string("word"), long_string}) {
+        MessageWriter writer;
+        SpillCodec<std::string>::write(writer, value);
+        MessageReader reader(writer.bytes());
+        std::string decoded = "left over";
+        SpillCodec<std::string>::read(reader, decoded);
+        MAPREDUCE_CHECK(decoded == value);
+        MAPREDUCE_CHECK(reader.at_end());
+        if (!value.empty()) {
+            MessageReader truncated(std::string_view(writer.bytes()).substr(0, writer.bytes().size() - 1));
+            MAPREDUCE_CHECK(throws_runtime_error([&]() { SpillCodec<std::string>::read(truncated, decoded); }));
+        }
+    }
+
+    const std::vector<int> values = {3, -1, 0, 1 << 30};
+    MessageWriter writer;
+    SpillCodec<std::vector<int>>::write(writer, values);
+    MessageReader reader(writer.bytes());
+    std::vector<int> decoded = {7};
+    SpillCodec<std::vector<int>>::read(reader, decoded);
+    MAPREDUCE_CHECK(decoded == values);
+    MAPREDUCE_CHECK(reader.at_end());
+    MessageReader truncated(std::string_view(writer.bytes()).substr(0, writer.bytes().size() - 1));
+    MAPREDUCE_CHECK(throws_runtime_error([&]() { SpillCodec<std::vector<int>>::read(truncated, decoded); }));
+
+    // A corrupt length with hardly any input behind it fails without allocating for it
+    for (uint64_t length : {uint64_t(1) << 40, uint64_t(max_block_size), uint64_t(1000)}) {
+        MessageWriter corrupt;
+        write_varint(corrupt, length);
+        corrupt.write("abc", 3);
+        MessageReader string_reader(corrupt.bytes());
+        std::string string;
+        MAPREDUCE_CHECK(throws_runtime_error([&]() { SpillCodec<std::string>::read(string_reader, string); }));
+        MAPREDUCE_CHECK(string.capacity() <= 2 * spill_read_chunk);
+        MessageReader vector_reader(corrupt.bytes());
+        std::vector<int> vector;
+        MAPREDUCE_CHECK(throws_runtime_error([&]() { SpillCodec<std::vector<int>>::read(vector_reader, vector); }));
+        MAPREDUCE_CHECK(vector.capacity() <= spill_read_chunk);
+    }
+
+    // The same records through a spill file, over many blocks
+    const char *temporary = std::getenv("TMPDIR");
+    SpillFile file(temporary != nullptr ? temporary : "/tmp");
+    {
+        SpillWriter spill(file.path());
+        for (int i = 0; i < 20000; ++i) {
+            SpillCodec<std::string>::write(spill, "key " + std::to_string(i));
+            SpillCodec<std::vector<int>>::write(spill, std::vector<int>(static_cast<size_t>(i % 5), i));
+        }
+        SpillCodec<std::string>::write(spill, long_string);
+        spill.close();
+    }
+    std::FILE *stream = std::fopen(file.path().c_str(), "rb");
+    MAPREDUCE_CHECK(stream != nullptr);
+    std::fseek(stream, 0, SEEK_END);
+    const uint64_t size = static_cast<uint64_t>(std::ftell(stream));
+    std::fclose(stream);
+    SpillReader spill(file.path(), 0, size);
+    bool intact = true;
+    for (int i = 0; i < 20000; ++i) {
+        std::string key;
+        std::vector<int> list;
+        SpillCodec<std::string>::read(spill, key);
+        SpillCodec<std::vector<int>>::read(spill, list);
+        intact = intact && key == "key " + std::to_string(i) && list == std::vector<int>(static_cast<size_t>(i % 5), i);
+    }
+    MAPREDUCE_CHECK(intact);
+    std::string last;
+    SpillCodec<std::string>::read(spill, last);
+    MAPREDUCE_CHECK(last == long_string);
+    MAPREDUCE_CHECK(spill.at_end());
+    // A range that ends inside the file is truncated for the records after it
+    SpillReader cut(file.path(), 0, size - 1);
+    MAPREDUCE_CHECK(throws_runtime_error([&]() {
+        for (std::string key; !cut.at_end();) {
+            SpillCodec<std::string>::read(cut, key);
+        }
+    }));
+}
+
+// Several producers push through a small ring at once: every item must come out exactly
+// once and the items of each producer in the order in which it pushed them
+void test_mpsc_ring() {
+    constexpr uint64_t num_producers = 4;
+    constexpr uint64_t items_per_producer = 50000;
+    MpscRing<uint64_t> ring(8);
+    std::vector<std::thread> producers;
+    std::atomic<bool> pushed{true};
+    for (uint64_t producer = 0; producer < num_producers; ++producer) {
+        producers.emplace_back([&ring, &pushed, producer]() {
+            for (uint64_t i = 0; i < items_per_producer; ++i) {
+                if (!ring.push(producer << 32 | i)) {
+                    pushed = false;
+                }
+            }
+        });
+    }
+    std::thread closer([&]() {
+        for (auto& producer : producers) {
+            producer.join();
+        }
+        ring.close();
+    });
+    std::vector<uint64_t> next(num_producers, 0);
+    bool ordered = true;
+    uint64_t popped = 0;
+    for (uint64_t item; ring.pop(item); ++popped) {
+        const uint64_t producer = item >> 32;
+        ordered = ordered && producer < num_producers && (item & 0xFFFFFFFFu) == next[producer];
+        if (producer < num_producers) {
+            ++next[producer];
+        }
+    }
+    closer.join();
+    MAPREDUCE_CHECK(pushed);
+    MAPREDUCE_CHECK(ordered);
+    MAPREDUCE_CHECK(popped == num_producers * items_per_producer);
+
+    // The items that are pushed before close() are still popped, later ones are refused
+    MpscRing<int> closed(4);
+    MAPREDUCE_CHECK(closed.push(1));
+    MAPREDUCE_CHECK(closed.push(2));
+    closed.close();
+    MAPREDUCE_CHECK(!closed.push(3));
+    int item = 0;
+    MAPREDUCE_CHECK(closed.pop(item) && item == 1);
+    MAPREDUCE_CHECK(closed.pop(item) && item == 2);
+    MAPREDUCE_CHECK(!closed.pop(item));
+    // A full ring that is closed does not keep the producer waiting
+    MpscRing<int> full(2);
+    MAPREDUCE_CHECK(full.push(1) && full.push(2));
+    std::thread blocked([&full]() { MAPREDUCE_CHECK(!full.push(3)); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    full.close();
+    blocked.join();
+}
+
+// An idle worker waits in next_straggler until a running task is overdue, and is let go when
+// the last task completes or the tracker is cancelled
+void test_task_tracker() {
+    using namespace std::chrono_literals;
+    TaskTracker tracker(3, 1.5, 20ms);
+    tracker.start(0);
+    tracker.start(1);
+    MAPREDUCE_CHECK(tracker.claim(0));
+    MAPREDUCE_CHECK(!tracker.claim(0));
+    size_t task = 0;
+    const auto start = std::chrono::steady_clock::now();
+    MAPREDUCE_CHECK(tracker.next_straggler(task) && task == 1);
+    MAPREDUCE_CHECK(std::chrono::steady_clock::now() - start >= 15ms);
+    // Task 2 becomes a straggler some time after it starts, the last completion ends the wait
+    std::thread waiter([&tracker]() {
+        size_t straggler;
+        MAPREDUCE_CHECK(tracker.next_straggler(straggler) && straggler == 2);
+    });
+    std::this_thread::sleep_for(5ms);
+    tracker.start(2);
+    waiter.join();
+    std::thread finisher([&tracker]() {
+        size_t straggler;
+        MAPREDUCE_CHECK(!tracker.next_straggler(straggler));
+    });
+    MAPREDUCE_CHECK(tracker.claim(1));
+    MAPREDUCE_CHECK(tracker.claim(2));
+    finisher.join();
+
+    TaskTracker cancelled(2, 1.5, 20ms);
+    cancelled.start(0);
+    std::thread idle([&cancelled]() {
+        size_t straggler;
+        MAPREDUCE_CHECK(!cancelled.next_straggler(straggler));
+    });
+    std::this_thread::sleep_for(5ms);
+    cancelled.cancel();
+    idle.join();
+}
+
+// The number of distinct values of a key.  It has fold but is not splittable: the counts of
+// two pieces of the values can not be added up, they may share values.
+struct DistinctReducer {
+    int operator()(const std::string &, const std::vector<int> &values) const {
+        return static_cast<int>(std::unordered_set<int>(values.begin(), values.end()).size());
+    }
+    void fold(int &accumulator, int value) const { accumulator += value; }
+};
+
+// A hot key is only reduced in pieces by a splittable reducer
+void test_hot_keys() {
+    static_assert(is_splittable_reducer<ListReducer<WordCountReducer>>::value, "A list reducer of an associative reducer is splittable");
+    static_assert(!is_splittable_reducer<DistinctReducer>::value, "A reducer with fold alone is not splittable");
+    std::vector<int> inputs(64);
+    std::iota(inputs.begin(), inputs.end(), 0);
+    auto mapper = [](int input, auto &&emit) {
+        for (int i = 0; i < 2000; ++i) {
+            emit(std::string("hot"), i % 10);
+        }
+        emit("cold" + std::to_string(input), 1);
+    };
+    const auto results = MapReduce<int, std::string, int, decltype(mapper), DistinctReducer>(4, 4, mapper).run(inputs);
+    MAPREDUCE_CHECK(results.size() == inputs.size() + 1);
+    for (const auto& [key, value] : results) {
+        MAPREDUCE_CHECK(value == (key == "hot" ? 10 : 1));
+    }
+}
+
+#if defined(MAPREDUCE_HAVE_MMAP)
+// The names of the files in a directory that start with prefix
+std::vector<std::string> files_in(const std::string &directory, std::string_view prefix) {
+    std::vector<std::string> names;
+    if (DIR *listing = ::opendir(directory.c_str())) {
+        while (const dirent *entry = ::readdir(listing)) {
+            const std::string_view name(entry->d_name);
+            if (name.substr(0, prefix.size()) == prefix && name != "." && name != "..") {
+                names.emplace_back(name);
+            }
+        }
+        ::closedir(listing);
+    }
+    return names;
+}
+
+// Cached runs give the counts of a plain job over the same input while files are added,
+// removed and duplicated, the split size changes and the counts of the splits are deleted
+void test_result_cache() {
+    const char *temporary = std::getenv("TMPDIR");
+    std::string directory = std::string(temporary != nullptr ? temporary : "/tmp") + "/mapreduce-cache-XXXXXX";
+    MAPREDUCE_CHECK(::mkdtemp(&directory[0]) != nullptr);
+
+    // Files with a shared vocabulary, so removing one changes the totals of words that stay
+    std::mt19937 random(7);
+    std::vector<std::string> files(3);
+    for (auto& file : files) {
+        for (int i = 0; i < 6000; ++i) {
+            file += "Word" + std::to_string(random() % 500) + (random() % 7 == 0 ? ". " : " ");
+        }
+    }
+
+    Options options;
+    options.num_threads = 4;
+    options.split_size = 4096;
+    options.inline_threshold = 0;
+    auto check = [&](const std::vector<size_t> &inputs) {
+        std::vector<std::string_view> splits;
+        for (size_t input : inputs) {
+            split_input(files[input], options.split_size, splits);
+        }
+        Options plain = options;
+        auto expected = run_word_count<std::string>(plain, splits, WordCountMapper());
+        options.cache_directory = directory;
+        auto cached = run_cached_word_count(options, splits);
+        options.cache_directory.clear();
+        std::sort(expected.begin(), expected.end());
+        std::sort(cached.begin(), cached.end());
+        MAPREDUCE_CHECK(cached == expected);
+        // Only the counts of the current splits are kept
+        std::unordered_set<std::string> keys;
+        for (std::string_view split : splits) {
+            keys.insert("split-" + ResultCache::key(split));
+        }
+        const auto stored = files_in(directory, "split-");
+        MAPREDUCE_CHECK(stored.size() == keys.size());
+        for (const auto& name : stored) {
+            MAPREDUCE_CHECK(keys.count(name) == 1);
+        }
+        MAPREDUCE_CHECK(files_in(directory, "totals-").size() == 1);
+    };
+
+    check({0, 1});        // cold run
+    check({0, 1});        // warm run
+    check({0, 1, 2});     // added file
+    files[2] += "appended Words at the end";
+    check({0, 1, 2});     // appended to a file, its last split changes
+    check({0, 2});        // removed file
+    check({0, 2, 0});     // duplicate splits
+    check({2, 0});        // the same splits in another order
+    options.split_size = 10000;
+    check({2, 0});        // every split is new
+    // A removed split whose counts are gone makes the run count everything again
+    for (const auto& name : files_in(directory, "split-")) {
+        std::remove((directory + "/" + name).c_str());
+    }
+    check({2});
+    check({});            // no input at all
+
+    for (const auto& name : files_in(directory, "")) {
+        std::remove((directory + "/" + name).c_str());
+    }
+    ::rmdir(directory.c_str());
+}
+#endif
+
+#if defined(MAPREDUCE_HAVE_SOCKETS)
+// Every window of WindowedCounts is the recount of its last panes, for tumbling and sliding
+// windows.  Most words of a pane are its own and die once the pane leaves the window, enough
+// of them to compact the totals several times; a few shared words drop to zero and come back.
+void test_windowed_counts() {
+    for (size_t num_panes : {1, 3}) {
+        WindowedCounts counts(num_panes);
+        std::deque<std::map<std::string, int>> panes;
+        std::mt19937 random(static_cast<unsigned>(num_panes));
+        for (int pane = 0; pane < 24; ++pane) {
+            std::map<std::string, int> added;
+            const int own_words = pane % 5 == 4 ? 0 : 3000;
+            for (int word = 0; word < own_words; ++word) {
+                const std::string key = "pane" + std::to_string(pane) + "-" + std::to_string(word);
+                const int count = 1 + static_cast<int>(random() % 3);
+                counts.add(key, count);
+                added[key] += count;
+            }
+            for (int word = 0; word < 20; ++word) {
+                if (random() % 3 == 0) {
+                    const std::string key = "shared" + std::to_string(word);
+                    counts.add(key, 1);
+                    ++added[key];
+                }
+            }
+            counts.close_pane();
+            panes.push_back(std::move(added));
+            if (panes.size() > num_panes) {
+                panes.pop_front();
+            }
+
+            std::map<std::string, int> expected;
+            for (const auto& recounted : panes) {
+                for (const auto& [key, count] : recounted) {
+                    expected[key] += count;
+                }
+            }
+            auto window = counts.window();
+            std::sort(window.begin(), window.end());
+            const std::vector<std::pair<std::string, int>> recount(expected.begin(), expected.end());
+            MAPREDUCE_CHECK(window == recount);
+            MAPREDUCE_CHECK(counts.size() == recount.size());
+        }
+    }
+}
+#endif
+
+int run_tests() {
+    test_blocks();
+    test_varints();
+    test_tokenizer();
+    test_spill_codecs();
+    test_mpsc_ring();
+    test_task_tracker();
+    test_hot_keys();
+#if defined(MAPREDUCE_HAVE_SOCKETS)
+    test_windowed_counts();
+#endif
+#if defined(MAPREDUCE_HAVE_MMAP)
+    test_result_cache();
+#endif
+    if (test_failures != 0) {
+        std::cerr << test_failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return 0;
+}
+
+#endif
+
+int main(int argc, const char * argv[]) {
+#if defined(MAPREDUCE_TESTS)
+    return run_tests();
+#endif
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        return 1;
+    }
+#if defined(MAPREDUCE_METRICS)
+    if (!options.trace_path.empty()) {
+        Metrics::instance().enable_trace();
+    }
+#endif
+
+    if (options.benchmark) {
+        try {
+            run_benchmark(options);
+        } catch (const std::exception &error) {
+            std::cerr << error.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (options.stream) {
+        try {
+#if defined(MAPREDUCE_HAVE_SOCKETS)
+            run_stream(options);
+#else
+            throw std::runtime_error("Streaming is not supported on this platform");
+#endif
+        } catch (const std::exception &error) {
+            std::cerr << error.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+#if defined(MAPREDUCE_HAVE_SOCKETS)
+    // A worker gets its input from the coordinator.  Every split that it receives is divided
+    // again so that all threads of the worker take part.
+    if (!options.worker_address.empty()) {
+        try {
+            const size_t num_threads = options.num_threads != 0 ? options.num_threads : std::max(1u, std::thread::hardware_concurrency());
+            run_worker<std::string, int, WordCountReducer>(options.worker_address, [&](std::string_view split) {
+                std::vector<std::string_view> splits;
+                split_input(split, std::max<size_t>(split.size() / (4 * num_threads), 1 << 12), splits);
+                return run_word_count<std::string>(options, splits, WordCountMapper());
+            }, options.codec);
+        } catch (const std::exception &error) {
+            std::cerr << error.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+#endif
+
+    // Test input sentences to show MapReduce model.
+    std::vector<std::string> sentences = {
+        "This is sentence one.",
+        "This is sentence two.",
+        "This is a sentence that ends with red.",
+        "This is a sentence that ends with blue."
+    };
+
+    // Map the input files and divide them into splits - without input files the test
+    // sentences above are used, one split per sentence
+    std::vector<std::unique_ptr<MappedFile>> input_files;
+    std::vector<std::string_view> input_data;
+    try {
+        for (const auto& path : options.async_read ? std::vector<std::string>() : options.input_paths) {
+            input_files.push_back(std::make_unique<MappedFile>(path));
+            split_input(input_files.back()->view(), options.split_size, input_data);
+            MAPREDUCE_COUNT(InputBytes, input_files.back()->view().size());
+        }
+    } catch (const std::exception &error) {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+    if (options.input_paths.empty()) {
+        input_data.assign(sentences.begin(), sentences.end());
+    }
+
+    // Run the word count job.  With --intern the job counts dictionary ids and the words are
+    // only looked up in the dictionary here, once per distinct word.
+    std::vector<std::pair<std::string, int>> results;
+    try {
+        if (options.coordinator_port != 0) {
+#if defined(MAPREDUCE_HAVE_SOCKETS)
+            const size_t num_reducers = options.num_reducers != 0 ? options.num_reducers : std::max(1u, std::thread::hardware_concurrency());
+            results = Coordinator<std::string, int, WordCountReducer>(options.coordinator_port, num_reducers, WordCountReducer(), options.speculative)
+                .set_codec(options.codec)
+                .set_task_timeout(options.task_timeout)
+                .set_reduce_workers(options.reduce_workers)
+                .run(input_data);
+#else
+            throw std::runtime_error("Distributed jobs are not supported on this platform");
+#endif
+        } else if (!options.cache_directory.empty()) {
+            results = run_cached_word_count(options, input_data);
+        } else if (options.async_read && !options.input_paths.empty()) {
+#if defined(MAPREDUCE_HAVE_MMAP)
+            with_normalization(options.normalization, [&](auto normalization) {
+                results = run_async_word_count(options, NormalizedWordCountMapper<decltype(normalization)>());
+            });
+#endif
+        } else if (options.approximate) {
+            with_normalization(options.normalization, [&](auto normalization) {
+                using Mapper = NormalizedWordCountMapper<decltype(normalization)>;
+                results = approximate_top_k(input_data, Mapper(), options.top_k, options.num_threads,
+                                            std::max<size_t>(16 * options.top_k, 4096));
+            });
+        } else if (options.intern) {
+            TermDictionary dictionary;
+            auto counts = run_word_count<TermId>(options, input_data, InterningWordCountMapper(&dictionary));
+            const std::vector<std::string_view> terms = dictionary.terms();
+            results.reserve(counts.size());
+            for (const auto& count : counts) {
+                results.emplace_back(std::string(terms[count.first.value]), count.second);
+            }
+        } else {
+            with_normalization(options.normalization, [&](auto normalization) {
+                using Mapper = NormalizedWordCountMapper<decltype(normalization)>;
+                results = run_word_count<std::string>(options, input_data, Mapper());
+            });
+        }
+    } catch (const std::exception &error) {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+
+    // Order the results.  The job sorts the words itself except when they were interned,
+    // counted by other processes, approximately, from the result cache or chunk by chunk with
+    // --async-read.  The words of a distributed job are only cut down to the top k here.
+    if (options.top_k != 0) {
+        TopK<std::string, int> top(options.top_k);
+        for (auto& result : results) {
+            top.push(std::move(result.first), result.second);
+        }
+        results = top.take();
+    } else if (options.sorted && (options.intern || options.coordinator_port != 0 || !options.cache_directory.empty()
+                                    || options.async_read)) {
+        const size_t num_threads = options.num_threads != 0 ? options.num_threads : std::max(1u, std::thread::hardware_concurrency());
+        parallel_sort(results, [](const auto &a, const auto &b) { return a.first < b.first; }, num_threads);
+    }
+
+    try {
+        {
+            MAPREDUCE_SPAN("output");
+            if (options.output_directory.empty()) {
+                print_results(results, options, OutputWriter());
+            } else {
+                write_partitioned_results(results, options);
+            }
+        }
+#if defined(MAPREDUCE_METRICS)
+        if (!options.metrics_path.empty()) {
+            OutputWriter report(options.metrics_path);
+            Metrics::instance().write_report(report);
+            report.close();
+        }
+        if (!options.trace_path.empty()) {
+            OutputWriter trace(options.trace_path);
+            Metrics::instance().write_trace(trace);
+            trace.close();
+        }
+#endif
+    } catch (const std::exception &error) {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}